@@ -1,17 +1,30 @@
 #include <iostream>
+#include <memory>
 using namespace std;
 
+// The whole pipeline computes in FTYPE. Building with -DFTYPE=float halves
+// the memory traffic and doubles the width of every vector kernel.
+#ifndef FTYPE
 #define FTYPE double
+#endif
 #include "olcNoiseMaker.h"
+#include "synthEnvelope.h"
+#include "synthEvents.h"
+#include "synthOscillator.h"
+#include "synthTuning.h"
+#include "synthVoicePool.h"
+#include "synthBench.h"
+#include "synthThreadPool.h"
+#include "synthSequencer.h"
+#include "synthProfile.h"
+#include "synthBus.h"
+#include "synthPatch.h"
+#include "synthOneShot.h"
+#include "synthSampler.h"
+#include "synthMidiFile.h"
 
 namespace synth
 {
-   // converts freq to angular velocity
-   FTYPE w(FTYPE dHertz)
-   {
-      return dHertz * 2.0 * PI;
-   }
-
    struct instrument_base;
 
    // basic note
@@ -33,140 +46,170 @@ namespace synth
       }
    };
 
-   const int OSC_SINE = 0;
-   const int OSC_SQUARE = 1;
-   const int OSC_TRIANGLE = 2;
-   const int OSC_SAW_ANA = 3;
-   const int OSC_SAW_DIG = 4;
-   const int OSC_NOISE = 5;
-
-   FTYPE osc(const FTYPE dHertz, const FTYPE dTime, const int nType = OSC_SINE,
-      const FTYPE dLFOHertz = 0.0, const FTYPE dLFOAmplitude = 0.0, FTYPE dCustom = 50.0)
+   struct instrument_base
    {
-      FTYPE dFreq = w(dHertz) * dTime + dLFOAmplitude * dHertz * (sin(w(dLFOHertz) * dTime));
-
-      switch (nType)
+      // One oscillator layer, pitched nOffset scale steps from the note
+      struct osc_layer
       {
-      case OSC_SINE:  // sin
-         return sin(dFreq);
-
-      case OSC_SQUARE:  // square
-         return sin(dFreq) > 0.0 ? 1.0 : -1.0;
+         int nType;
+         int nOffset;
+         FTYPE dGain;
+      };
 
-      case OSC_TRIANGLE:  // triangle
-         return asin(sin(dFreq) * (2.0 / PI));
+      FTYPE dVolume;
+      FTYPE dPan;                      // -1 left .. 1 right, taken by each voice on note on
+      synth::envelope_adsr env;
+      FTYPE fMaxLifeTime;
+      wstring name;
+      vector<osc_layer> vecLayers;
+      const synth::tuning* pTuning;    // nullptr plays the standard 12-TET table
+      synth::instrument_cost cost;     // time spent rendering its voices
+      unique_ptr<oneshot_cache> pOneShot;   // set to play hits from memory, see synthOneShot.h
 
-      case OSC_SAW_ANA:  // saw (analogue / warm / slow)
+      instrument_base()
       {
-         FTYPE dOutput = 0.0;
-
-         for (FTYPE n = 1.0; n < 10.0; n++)
-            dOutput += (sin(n * dFreq)) / n;
-
-         return dOutput * (2.0 / PI);
+         dVolume = 1.0;
+         dPan = 0.0;
+         fMaxLifeTime = -1.0;
+         pTuning = nullptr;
       }
 
-      case OSC_SAW_DIG:  // saw (optimised / harsh / fast)
-         return (2.0 / PI) * (dHertz * PI * fmod(dTime, 1.0 / dHertz) - (PI / 2.0));
+      virtual FTYPE sound(const FTYPE dTime, synth::note n, bool& bNoteFinished) = 0;
 
-      case OSC_NOISE:  // pseudo random noise
-         return 2.0 * ((double)rand() / (double)RAND_MAX) - 1.0;
+      // Renders nFrames of voice v into pOutput, the first sample at dTime.
+      // Instruments with a layer table run it through the phase accumulator
+      // oscillators at the frequencies fixed on note on, the rest fall back
+      // to calling sound() once per sample.
+      virtual void render(voice_pool& voices, int v, FTYPE dTime, FTYPE dTimeStep, FTYPE* pOutput, int nFrames, bool& bNoteFinished)
+      {
+         if (vecLayers.empty())
+         {
+            note n;
+            n.id = voices.vId[v];
+            n.on = voices.vOn[v];
+            n.off = voices.vOff[v];
+            n.active = true;
+            n.channel = this;
+
+            for (int i = 0; i < nFrames; i++)
+               pOutput[i] = sound(dTime + i * dTimeStep, n, bNoteFinished);
+            return;
+         }
 
-      default:
-         return 0.0;
-      }
-   }
+         for (int i = 0; i < nFrames; i++) pOutput[i] = 0.0;
 
-   const int SCALE_DEFAULT = 0;
+         for (size_t l = 0; l < vecLayers.size() && l < (size_t)VOICE_LAYERS; l++)
+            layer(voices, v, (int)l, pOutput, nFrames, dTimeStep, vecLayers[l].nType, voices.vHertz[l][v], vecLayers[l].dGain);
 
-   FTYPE scale(const int nNoteID, const int nScaleID = SCALE_DEFAULT)
-   {
-      switch (nScaleID)
-      {
-      case SCALE_DEFAULT: default:
-         return 256 * pow(1.0594630943592952645618252949463, nNoteID);
+         shape(voices, v, dTime, dTimeStep, pOutput, nFrames, bNoteFinished);
       }
-   }
 
-   struct envelope
-   {
-      virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff) = 0;
-   };
+      // Gate changes for voice v, the envelope follows them. Layer pitches
+      // are looked up once here rather than every block.
+      virtual void note_on(voice_pool& voices, int v, FTYPE dSampleRate)
+      {
+         const synth::tuning& t = pTuning ? *pTuning : synth::tuning::standard();
+         for (size_t l = 0; l < vecLayers.size() && l < (size_t)VOICE_LAYERS; l++)
+            voices.vHertz[l][v] = t.hertz(voices.vId[v] + vecLayers[l].nOffset);
 
-   struct envelope_adsr : public envelope
-   {
-      FTYPE dAttackTime;
-      FTYPE dDecayTime;
-      FTYPE dReleaseTime;
-      FTYPE dSustainAmplitude;
-      FTYPE dStartAmplitude;
+         env.start(voices.vEnv[v], dSampleRate);
+      }
 
-      envelope_adsr()
+      virtual void note_off(voice_pool& voices, int v, FTYPE dSampleRate)
       {
-         dAttackTime = 0.1;
-         dDecayTime = 0.1;
-         dSustainAmplitude = 1.0;
-         dReleaseTime = 0.2;
-         dStartAmplitude = 1.0;
+         env.release(voices.vEnv[v], dSampleRate);
       }
 
-      virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff)
+      // Everything a hit of note nId is rendered from, for telling when a
+      // one-shot is out of date. The pitches around the note cover layer
+      // offsets, whether they come from vecLayers or the type.
+      uint64_t fingerprint(int nId, FTYPE dSampleRate) const
       {
-         FTYPE dAmplitude = 0.0;
-         FTYPE dReleaseAmplitude = 0.0;
+         const synth::tuning& t = pTuning ? *pTuning : synth::tuning::standard();
+         FTYPE dFields[] = { dVolume, fMaxLifeTime, dSampleRate, env.dAttackTime, env.dDecayTime, env.dReleaseTime,
+            env.dSustainAmplitude, env.dStartAmplitude, (FTYPE)env.nCurve };
 
-         if (dTimeOn > dTimeOff)   // note is on
+         uint64_t h = fingerprint_add(FINGERPRINT_START, &nId, sizeof(nId));
+         h = fingerprint_add(h, dFields, sizeof(dFields));
+         for (const osc_layer& l : vecLayers)
          {
-            FTYPE dLifeTime = dTime - dTimeOn;
-
-				if (dLifeTime <= dAttackTime)
-					dAmplitude = (dLifeTime / dAttackTime) * dStartAmplitude;
-
-				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
-					dAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
-
-				if (dLifeTime > (dAttackTime + dDecayTime))
-					dAmplitude = dSustainAmplitude;
-
+            FTYPE dLayer[] = { (FTYPE)l.nType, (FTYPE)l.nOffset, l.dGain };
+            h = fingerprint_add(h, dLayer, sizeof(dLayer));
          }
-         else  // note is off
+         for (int i = -48; i <= 48; i++)
          {
-            FTYPE dLifeTime = dTimeOff - dTimeOn;
+            FTYPE dHertz = t.hertz(nId + i);
+            h = fingerprint_add(h, &dHertz, sizeof(dHertz));
+         }
+         return h != 0 ? h : 1;   // 0 means never built
+      }
 
-				if (dLifeTime <= dAttackTime)
-					dReleaseAmplitude = (dLifeTime / dAttackTime) * dStartAmplitude;
+   protected:
+      // Adds one oscillator layer of voice v to pOutput
+      void layer(voice_pool& voices, int v, int nLayer, FTYPE* pOutput, int nFrames, FTYPE dTimeStep,
+         int nType, FTYPE dHertz, FTYPE dGain)
+      {
+         synth::osc_block(pOutput, nFrames, nType, dHertz, 1.0 / dTimeStep, dGain,
+            voices.vPhase[nLayer][v], voices.vLFOPhase[nLayer][v], 0.0, 0.0, 0.5, &voices.vNoise[v]);
+      }
 
-				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
-					dReleaseAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
+      // Applies envelope and volume to a block of summed layers. Every
+      // instrument finishes the same way: when its envelope goes idle, or
+      // when it outlives fMaxLifeTime if that is set.
+      void shape(voice_pool& voices, int v, FTYPE dTime, FTYPE dTimeStep, FTYPE* pOutput, int nFrames, bool& bNoteFinished)
+      {
+         if (env.apply(voices.vEnv[v], 1.0 / dTimeStep, pOutput, nFrames, dVolume * voices.vVelocity[v]))
+            bNoteFinished = true;
 
-				if (dLifeTime > (dAttackTime + dDecayTime))
-					dReleaseAmplitude = dSustainAmplitude;
+         if (fMaxLifeTime > 0.0 && dTime + nFrames * dTimeStep - voices.vOn[v] >= fMaxLifeTime)
+            bNoteFinished = true;
+      }
+   };
 
-				dAmplitude = ((dTime - dTimeOff) / dReleaseTime) * (0.0 - dReleaseAmplitude) + dReleaseAmplitude;
-         }
+   // Instrument whose oscillator layers are fixed at compile time, a list
+   // of static_layer. The layer loop unrolls into one direct call per layer
+   // with the waveform known, so render() is the only virtual call per voice
+   // per block. Sounds the same as the equivalent vecLayers table.
+   template<class... Layers>
+   struct instrument_graph : public instrument_base
+   {
+      static_assert(sizeof...(Layers) <= VOICE_LAYERS, "instrument_graph has more layers than a voice can hold");
 
-         if (dAmplitude <= 0.000)
-            dAmplitude = 0.0;
+      virtual void render(voice_pool& voices, int v, FTYPE dTime, FTYPE dTimeStep, FTYPE* pOutput, int nFrames, bool& bNoteFinished)
+      {
+         for (int i = 0; i < nFrames; i++) pOutput[i] = 0.0;
+         render_layers<0, Layers...>(voices, v, pOutput, nFrames, 1.0 / dTimeStep);
+         shape(voices, v, dTime, dTimeStep, pOutput, nFrames, bNoteFinished);
+      }
 
-         return dAmplitude;
+      virtual void note_on(voice_pool& voices, int v, FTYPE dSampleRate)
+      {
+         const synth::tuning& t = pTuning ? *pTuning : synth::tuning::standard();
+         const int nOffsets[] = { 0, Layers::offset... };
+         for (int l = 0; l < (int)sizeof...(Layers); l++)
+            voices.vHertz[l][v] = t.hertz(voices.vId[v] + nOffsets[l + 1]);
+
+         env.start(voices.vEnv[v], dSampleRate);
       }
-   };
 
-   FTYPE env(const FTYPE dTime, envelope& env, const FTYPE dTimeOn, const FTYPE dTimeOff)
-   {
-      return env.amplitude(dTime, dTimeOn, dTimeOff);
-   }
+   private:
+      template<int L, class Layer, class... Rest>
+      void render_layers(voice_pool& voices, int v, FTYPE* pOutput, int nFrames, FTYPE dSampleRate)
+      {
+         Layer::render(pOutput, nFrames, voices.vHertz[L][v], dSampleRate, voices.vPhase[L][v], voices.vLFOPhase[L][v], &voices.vNoise[v]);
+         render_layers<L + 1, Rest...>(voices, v, pOutput, nFrames, dSampleRate);
+      }
 
-   struct instrument_base
-   {
-      FTYPE dVolume;
-      synth::envelope_adsr env;
-      FTYPE fMaxLifeTime;
-      wstring name;
-      virtual FTYPE sound(const FTYPE dTime, synth::note n, bool& bNoteFinished) = 0;
+      template<int L>
+      void render_layers(voice_pool&, int, FTYPE*, int, FTYPE)
+      {
+      }
    };
 
-   struct instrument_bell : public instrument_base
+   struct instrument_bell : public instrument_graph<
+      static_layer<OSC_SINE, 12, std::ratio<1>>,
+      static_layer<OSC_SINE, 24, std::ratio<1, 2>>,
+      static_layer<OSC_SINE, 36, std::ratio<1, 4>>>
    {
       instrument_bell()
       {
@@ -176,6 +219,7 @@ namespace synth
          env.dReleaseTime = 1.0;
          fMaxLifeTime = 3.0;
          dVolume = 1.0;
+         dPan = -0.4;
          name = L"Bell";
       }
 
@@ -194,7 +238,10 @@ namespace synth
       }
    };
 
-   struct instrument_bell8 : public instrument_base
+   struct instrument_bell8 : public instrument_graph<
+      static_layer<OSC_SQUARE, 0, std::ratio<1>>,
+      static_layer<OSC_SINE, 12, std::ratio<1, 2>>,
+      static_layer<OSC_SINE, 24, std::ratio<1, 4>>>
    {
       instrument_bell8()
       {
@@ -204,6 +251,7 @@ namespace synth
          env.dReleaseTime = 1.0;
          fMaxLifeTime = 3.0;
          dVolume = 1.0;
+         dPan = 0.4;
          name = L"8-Bit Bell";
       }
 
@@ -219,10 +267,12 @@ namespace synth
 
          return dAmplitude * dSound * dVolume;
       }
-
    };
 
-   struct instrument_harmonica : public instrument_base
+   struct instrument_harmonica : public instrument_graph<
+      static_layer<OSC_SQUARE, 0, std::ratio<1>>,
+      static_layer<OSC_SQUARE, 12, std::ratio<1, 2>>,
+      static_layer<OSC_NOISE, 0, std::ratio<5, 100>>>
    {
       instrument_harmonica()
       {
@@ -248,10 +298,11 @@ namespace synth
 
          return dAmplitude * dSound * dVolume;
       }
-
    };
 
-   struct instrument_drumkick : public instrument_base
+   struct instrument_drumkick : public instrument_graph<
+      static_layer<OSC_SINE, -36, std::ratio<99, 100>>,
+      static_layer<OSC_NOISE, 0, std::ratio<1, 100>>>
    {
       instrument_drumkick()
       {
@@ -275,10 +326,11 @@ namespace synth
 
          return dAmplitude * dSound * dVolume;
       }
-
    };
 
-   struct instrument_drumsnare : public instrument_base
+   struct instrument_drumsnare : public instrument_graph<
+      static_layer<OSC_SINE, -24, std::ratio<1, 2>>,
+      static_layer<OSC_NOISE, 0, std::ratio<1, 2>>>
    {
       instrument_drumsnare()
       {
@@ -289,6 +341,7 @@ namespace synth
          fMaxLifeTime = 1.0;
          name = L"Drum Snare";
          dVolume = 1.0;
+         dPan = -0.15;
       }
 
       virtual FTYPE sound(const FTYPE dTime, synth::note n, bool& bNoteFinished)
@@ -302,11 +355,12 @@ namespace synth
 
          return dAmplitude * dSound * dVolume;
       }
-
    };
 
 
-   struct instrument_drumhihat : public instrument_base
+   struct instrument_drumhihat : public instrument_graph<
+      static_layer<OSC_SQUARE, -12, std::ratio<1, 10>>,
+      static_layer<OSC_NOISE, 0, std::ratio<9, 10>>>
    {
       instrument_drumhihat()
       {
@@ -317,6 +371,7 @@ namespace synth
          fMaxLifeTime = 1.0;
          name = L"Drum HiHat";
          dVolume = 0.5;
+         dPan = 0.35;
       }
 
       virtual FTYPE sound(const FTYPE dTime, synth::note n, bool& bNoteFinished)
@@ -330,141 +385,1106 @@ namespace synth
 
          return dAmplitude * dSound * dVolume;
       }
-
    };
 
-   struct sequencer
+   // Instrument played from a patch file. The audio thread owns the program
+   // it plays. A (re)load compiles on the caller's thread and queues the
+   // result, the audio thread swaps it in between blocks and queues the old
+   // one back to be deleted, so neither side ever waits on the other.
+   struct instrument_patch : public instrument_base
    {
-   public:
-      struct channel
+      instrument_patch()
       {
-         instrument_base* instrument;
-         wstring sBeat;
-      };
+         pProgram = nullptr;
+         nLoads = 0;
+         name = L"Patch";
+      }
 
-   public:
-      sequencer(float tempo = 120.0f, int beats = 4, int subbeats = 4)
+      ~instrument_patch()
       {
-         nBeats = beats;
-         nSubBeats = subbeats;
-         fTempo = tempo;
-         fBeatTime = (60.0f / fTempo) / (float)nSubBeats;
-         nCurrentBeat = 0;
-         nTotalBeats = nSubBeats * nBeats;
-         fAccumulate = 0;
+         Collect();
+         patch_program* p;
+         while (queIncoming.Peek(p))
+         {
+            queIncoming.Pop();
+            delete p;
+         }
+         delete pProgram;
       }
 
-      int Update(FTYPE fElapsedTime)
+      // Not the audio thread. Compiles sFile if its text has changed since
+      // the last call and queues the program; cheap enough to poll. On an
+      // error sError says why and the current program keeps playing.
+      bool Load(const string& sFile, int nMaxVoices, string& sError)
       {
-         vecNotes.clear();
+         string sPatch;
+         if (!patch_program::read(sFile, sPatch, sError))
+            return false;
+         return LoadText(sPatch, nMaxVoices, sError);
+      }
 
-         fAccumulate += fElapsedTime;
-         while (fAccumulate >= fBeatTime)
+      bool LoadText(const string& sPatch, int nMaxVoices, string& sError)
+      {
+         Collect();
+         if (sPatch == sText)
+            return true;
+         sText = sPatch;   // a broken patch is reported once, not on every poll
+
+         patch_program* p = new patch_program();
+         if (!p->compile(sPatch, nMaxVoices, sError))
+         {
+            delete p;
+            return false;
+         }
+
+         // The name is only taken from the first load, the UI reads it
+         if (nLoads == 0)
+            name = p->sName;
+
+         if (!queIncoming.Push(p))
          {
-            fAccumulate -= fBeatTime;
-            nCurrentBeat++;
+            delete p;
+            sText.clear();
+            sError = "earlier reloads are still waiting for the audio thread";
+            return false;
+         }
 
-            if (nCurrentBeat >= nTotalBeats)
-               nCurrentBeat = 0;
+         nLoads++;
+         return true;
+      }
 
-            int c = 0;
-            for (auto v : vecChannel)
+      // Audio thread, between blocks. Retired holds twice what can be in
+      // flight, so it can't fill between two Collect() calls.
+      void Update(voice_pool& voices)
+      {
+         patch_program* p;
+         while (queIncoming.Peek(p))
+         {
+            queIncoming.Pop();
+            if (pProgram != nullptr)
             {
-               if (v.sBeat[nCurrentBeat] == L'X')
-               {
-                  note n;
-                  n.channel = vecChannel[c].instrument;
-                  n.active = true;
-                  n.id = 64;
-                  vecNotes.push_back(n);
-               }
-               c++;
+               p->adopt(*pProgram, voices, this, pTuning ? *pTuning : tuning::standard());
+               queRetired.Push(pProgram);
             }
+            pProgram = p;
+         }
+      }
+
+      virtual void render(voice_pool& voices, int v, FTYPE dTime, FTYPE dTimeStep, FTYPE* pOutput, int nFrames, bool& bNoteFinished)
+      {
+         if (pProgram == nullptr)
+         {
+            for (int i = 0; i < nFrames; i++) pOutput[i] = 0.0;
+            bNoteFinished = true;
+            return;
          }
 
-         return vecNotes.size();
+         pProgram->render(voices, v, dTime, dTimeStep, pOutput, nFrames, bNoteFinished);
       }
 
-      void AddInstrument(instrument_base* inst)
+      virtual void note_on(voice_pool& voices, int v, FTYPE dSampleRate)
       {
-         channel c;
-         c.instrument = inst;
-         vecChannel.push_back(c);
+         if (pProgram != nullptr)
+            pProgram->note_on(voices, v, pTuning ? *pTuning : tuning::standard(), dSampleRate);
       }
 
-   public:
-      int nBeats;
-      int nSubBeats;
-      FTYPE fTempo;
-      FTYPE fBeatTime;
-      FTYPE fAccumulate;
-      int nCurrentBeat;
-      int nTotalBeats;
+      virtual void note_off(voice_pool& voices, int v, FTYPE dSampleRate)
+      {
+         if (pProgram != nullptr)
+            pProgram->note_off(voices, v, dSampleRate);
+      }
 
-   public:
-      vector<channel> vecChannel;
-      vector<note> vecNotes;
+      // Patches only render by the block. The per sample path is not
+      // supported and stays silent.
+      virtual FTYPE sound(const FTYPE, synth::note, bool&)
+      {
+         return 0.0;
+      }
+
+      int nLoads;   // programs queued so far
+
+   private:
+      patch_program* pProgram;
+      spsc_queue<patch_program*, 4> queIncoming;
+      spsc_queue<patch_program*, 8> queRetired;
+      string sText;
+
+      void Collect()
+      {
+         patch_program* p;
+         while (queRetired.Peek(p))
+         {
+            queRetired.Pop();
+            delete p;
+         }
+      }
+   };
+
+   // Instrument played from a sampler kit. The kit is loaded once, before
+   // the engine starts; it streams its files on its own thread from then on.
+   struct instrument_sampler : public instrument_base
+   {
+      instrument_sampler()
+      {
+         name = L"Sampler";
+      }
+
+      bool Load(const string& sFile, int nMaxVoices, string& sError)
+      {
+         if (!kit.load(sFile, nMaxVoices, sError))
+            return false;
+
+         name = kit.sName;
+         dVolume = kit.dVolume;
+         dPan = kit.dPan;
+         env = kit.env;
+         return true;
+      }
+
+      virtual void render(voice_pool& voices, int v, FTYPE dTime, FTYPE dTimeStep, FTYPE* pOutput, int nFrames, bool& bNoteFinished)
+      {
+         kit.render(v, pOutput, nFrames, bNoteFinished);
+         shape(voices, v, dTime, dTimeStep, pOutput, nFrames, bNoteFinished);
+         if (bNoteFinished)
+            kit.finish(v);
+      }
+
+      virtual void note_on(voice_pool& voices, int v, FTYPE dSampleRate)
+      {
+         kit.note_on(v, voices.vId[v], pTuning ? *pTuning : tuning::standard(), dSampleRate);
+         env.start(voices.vEnv[v], dSampleRate);
+      }
+
+      // Kits only play by the block; per sample, a sampler is silent
+      virtual FTYPE sound(const FTYPE, synth::note, bool&)
+      {
+         return 0.0;
+      }
+
+      sampler kit;
    };
 }
 
-vector<synth::note> vecNotes;
-mutex muxNotes;
+// Voices are owned by the audio thread. Everything else talks to it through
+// the event queue, so the render path never waits on the UI.
+synth::voice_pool voices(256, synth::STEAL_OLDEST);
+synth::event_queue queEvents;
+synth::event_clock clkEvents;
+atomic<int> nNotesActive(0);
 synth::instrument_bell instBell;
 synth::instrument_harmonica instHarm;
 synth::instrument_drumkick instKick;
 synth::instrument_drumsnare instSnare;
 synth::instrument_drumhihat instHiHat;
+synth::instrument_base* pInstruments[] = { &instBell, &instHarm, &instKick, &instSnare, &instHiHat };
+synth::tuning tunPlay;
+vector<unique_ptr<synth::instrument_patch>> vecPatches;   // from --patch, loaded before the engine starts
+vector<string> vecPatchFiles;
+vector<unique_ptr<synth::instrument_sampler>> vecSamplers;   // from --sampler
+synth::midi_score scoreMidi;                                 // from --midi
+
+// Where each MIDI channel and note of the score plays, see MapScore()
+struct score_target
+{
+   synth::instrument_base* channel;   // nullptr drops the note
+   int id;
+};
+score_target scoreMap[16][128];
+
+unsigned int nSampleRate = 44100;   // the benchmarks vary it
+const unsigned int nBlockFrames = 256;
+
+// Voices render in chunks of nChunkVoices. Each chunk is summed into its
+// own buffer and the chunks are added up in order, so the mix comes out the
+// same whichever thread rendered what, and however many threads there are.
+const int nChunkVoices = 8;
+const int nParallelVoices = 16;              // below this the audio thread renders alone
+synth::work_pool* pRenderPool = nullptr;     // set up by main, nullptr renders inline
+synth::sequencer* pSequencer = nullptr;      // stepped by the renderer, set before it starts
+synth::score_cursor* pScore = nullptr;       // the same for a --midi score
+vector<vector<FTYPE>> vecVoiceBuffers;       // scratch, one per worker
+vector<synth::bus> vecChunkBuffers;          // partial mix, one per chunk, planar
+
+struct render_pass
+{
+   FTYPE dTime;
+   FTYPE dTimeStep;
+   unsigned int nFrames;
+   unsigned int nChannels;
+};
+
+// Sizes the scratch buffers, so the render thread never has to
+void PrepareRender(unsigned int nMaxFrames, int nMaxVoices, unsigned int nChannels)
+{
+   int nWorkers = pRenderPool ? pRenderPool->size() : 1;
+   if ((int)vecVoiceBuffers.size() < nWorkers)
+      vecVoiceBuffers.resize(nWorkers);
+   for (auto& b : vecVoiceBuffers)
+      if (b.size() < nMaxFrames) b.resize(nMaxFrames);
+
+   int nChunks = (nMaxVoices + nChunkVoices - 1) / nChunkVoices;
+   if ((int)vecChunkBuffers.size() < nChunks)
+      vecChunkBuffers.resize(nChunks);
+   for (auto& b : vecChunkBuffers)
+      b.resize(nChannels, nMaxFrames);
+}
 
-typedef bool(*lambda)(synth::note const& item);
-template<class T>
-void safe_remove(T& v, lambda f)
+// Renders chunk nChunk of the active list into its chunk buffer. Each voice
+// belongs to exactly one chunk, so chunks never touch the same voice state.
+// A voice is rendered once and added to each channel at its pan gain. A
+// voice that took a one-shot on note on reads it from memory instead, the
+// take already has volume and envelope in it, only velocity is left to
+// apply, and the release once the note is let go.
+void RenderChunk(void* pContext, int nChunk, int nWorker)
+{
+   const render_pass& pass = *(const render_pass*)pContext;
+   const synth::simd::kernels<FTYPE>& k = synth::simd::active<FTYPE>();
+   synth::bus& chunk = vecChunkBuffers[nChunk];
+   FTYPE* pVoice = vecVoiceBuffers[nWorker].data();
+   FTYPE dGains[synth::BUS_MAX_CHANNELS];
+
+   chunk.clear(0, pass.nFrames);
+
+   int nLast = min(voices.nActive, (nChunk + 1) * nChunkVoices);
+   for (int i = nChunk * nChunkVoices; i < nLast; i++)
+   {
+      int v = voices.vActiveList[i];
+      synth::instrument_base* inst = voices.vChannel[v];
+      if (inst == nullptr || voices.vFinished[v])
+         continue;
+
+      const vector<FTYPE>* pTake = voices.vTake[v] >= 0 ? inst->pOneShot->take(voices.vId[v], voices.vTake[v]) : nullptr;
+      int nCursor = voices.vCursor[v];
+      voices.vCursor[v] += pass.nFrames;
+
+      bool bNoteFinished = false;
+      const FTYPE* pSource = pVoice;
+      int nSource = (int)pass.nFrames;
+      FTYPE dGain = 0.2;
+      {
+         synth::scoped_cost cost(inst->cost, pass.nFrames);
+         if (pTake != nullptr)
+         {
+            nSource = max(0, min(nSource, (int)pTake->size() - nCursor));
+            pSource = pTake->data() + min(nCursor, (int)pTake->size());
+            dGain *= voices.vVelocity[v];
+            bNoteFinished = nCursor + (int)pass.nFrames >= (int)pTake->size();
+            if (voices.vState[v] == synth::VOICE_RELEASED)
+            {
+               for (int j = 0; j < nSource; j++) pVoice[j] = pSource[j];
+               if (inst->env.apply(voices.vEnv[v], 1.0 / pass.dTimeStep, pVoice, nSource, 1.0))
+                  bNoteFinished = true;
+               pSource = pVoice;
+            }
+         }
+         else
+            inst->render(voices, v, pass.dTime, pass.dTimeStep, pVoice, pass.nFrames, bNoteFinished);
+      }
+
+      synth::pan_gains(voices.vPan[v], pass.nChannels, dGains);
+      for (unsigned int ch = 0; ch < pass.nChannels; ch++)
+         if (dGains[ch] != 0.0)
+            k.scale_add(chunk.plane(ch), pSource, nSource, dGain * dGains[ch]);
+      voices.vLevel[v] = k.peak(pSource, nSource) * dGain;
+
+      if (bNoteFinished)
+         voices.vFinished[v] = true;
+   }
+}
+
+// Renders nTakes hits of note nId on inst, each with its own noise, on a
+// scratch voice. They run until the instrument finishes them, trailing
+// silence trimmed. Not the audio thread, it allocates.
+synth::oneshot_entry* RenderOneShot(synth::instrument_base& inst, int nId, int nTakes)
 {
-   auto n = v.begin();
-   while (n != v.end())
+   const int nLongest = 10 * nSampleRate;   // for instruments that never finish
+   FTYPE dTimeStep = 1.0 / (FTYPE)nSampleRate;
+   synth::voice_pool scratch(1);
+   vector<FTYPE> vecBlock(nBlockFrames);
+
+   synth::oneshot_entry* e = new synth::oneshot_entry();
+   e->nId = nId;
+   e->nFingerprint = inst.fingerprint(nId, (FTYPE)nSampleRate);
+   e->vTakes.resize(nTakes);
+   for (int t = 0; t < nTakes; t++)
    {
-      if (!f(*n))
-         n = v.erase(n);
+      scratch.Seed(0x6f6e65ull + t);
+      int v = scratch.Allocate(&inst, nId, 0.0, 0);
+      inst.note_on(scratch, v, (FTYPE)nSampleRate);
+
+      vector<FTYPE>& vecTake = e->vTakes[t];
+      bool bNoteFinished = false;
+      while (!bNoteFinished && (int)vecTake.size() < nLongest)
+      {
+         inst.render(scratch, v, (FTYPE)vecTake.size() * dTimeStep, dTimeStep, vecBlock.data(), nBlockFrames, bNoteFinished);
+         vecTake.insert(vecTake.end(), vecBlock.begin(), vecBlock.end());
+      }
+
+      while (!vecTake.empty() && vecTake.back() == 0.0)
+         vecTake.pop_back();
+      vecTake.shrink_to_fit();
+      scratch.Release(v);
+   }
+   return e;
+}
+
+// Renders the one-shots the audio thread asked for, every note the
+// sequencer triggers on an instrument with a cache if there is one, and
+// again any whose instrument changed since. They are installed at the start
+// of the next block. Not the audio thread. Returns how many were rendered.
+int UpdateOneShots(const synth::sequencer* pSeq)
+{
+   if (pSeq != nullptr)
+      for (const synth::sequencer::channel& c : pSeq->vecChannel)
+         if (c.instrument->pOneShot)
+            for (int nPattern : c.vecChain)
+               for (int nNote : pSeq->vecPatterns[nPattern].vNote)
+                  c.instrument->pOneShot->want(nNote);
+
+   int nRendered = 0;
+   for (synth::instrument_base* inst : pInstruments)
+   {
+      if (!inst->pOneShot)
+         continue;
+
+      for (int nId : inst->pOneShot->notes())
+      {
+         if (inst->pOneShot->built(nId) == inst->fingerprint(nId, (FTYPE)nSampleRate))
+            continue;
+
+         synth::oneshot_entry* e = RenderOneShot(*inst, nId, inst->pOneShot->takes());
+         if (inst->pOneShot->publish(e))
+            nRendered++;
+         else
+         {
+            delete e;
+            inst->pOneShot->want(nId);   // queue full, next time
+         }
+      }
+   }
+   return nRendered;
+}
+
+// Applies a note event on the audio thread at sample nSample
+void ApplyEvent(const synth::event& e, uint64_t nSample)
+{
+   FTYPE dTime = (FTYPE)nSample / (FTYPE)nSampleRate;
+
+   if (e.type == synth::EVENT_NOTE_ON)
+   {
+      // Retrigger a note that is still releasing, otherwise start a new one
+      int v = voices.Find(e.channel, e.id, synth::VOICE_RELEASED);
+      if (v < 0)
+         v = voices.Allocate(e.channel, e.id, dTime, nSample);
       else
-         ++n;
+         voices.Retrigger(v, dTime, nSample);
+
+      voices.vVelocity[v] = (FTYPE)e.velocity / 127.0;
+      voices.vPan[v] = e.channel->dPan;
+      e.channel->note_on(voices, v, (FTYPE)nSampleRate);
+      if (e.channel->pOneShot)
+         voices.vTake[v] = e.channel->pOneShot->pick(e.id, voices.vNoise[v].nKey);
+   }
+   else
+   {
+      int v = voices.Find(e.channel, e.id, synth::VOICE_HELD);
+      if (v >= 0)
+      {
+         voices.vOff[v] = dTime;
+         voices.vState[v] = synth::VOICE_RELEASED;
+         e.channel->note_off(voices, v, (FTYPE)nSampleRate);
+         if (voices.vTake[v] >= 0)
+            e.channel->env.fade(voices.vEnv[v], (FTYPE)nSampleRate);
+      }
    }
 }
 
+// Applies a score event, through scoreMap, at sample nSample
+void ApplyScoreEvent(const synth::score_event& n, uint64_t nSample)
+{
+   const score_target& t = scoreMap[n.nChannel][n.nNote];
+   if (t.channel == nullptr)
+      return;
+
+   synth::event e;
+   e.type = n.nType;
+   e.id = t.id;
+   e.velocity = n.nVelocity;
+   e.channel = t.channel;
+   e.nSample = nSample;
+   ApplyEvent(e, nSample);
+}
 
-FTYPE MakeNoise(int nChannel, double dTime)
+// Renders one block into nChannels planar buses. Pending events are drained
+// at the start and the block is split at each event, so they land on their
+// exact sample. Finished voices go back to the pool at the end.
+void MakeNoise(FTYPE** ppBus, unsigned int nFrames, unsigned int nChannels, uint64_t nStartSample)
 {
-   unique_lock<mutex> lm(muxNotes);
-   FTYPE dMixedOutput = 0.0;
+   clkEvents.Publish(nStartSample);
+
+   // Reloaded patches and new one-shots take over here, while no voice is
+   // being rendered
+   for (auto& p : vecPatches)
+      p->Update(voices);
+   for (synth::instrument_base* inst : pInstruments)
+      if (inst->pOneShot)
+         inst->pOneShot->update();
+
+   for (unsigned int ch = 0; ch < nChannels; ch++)
+      for (unsigned int i = 0; i < nFrames; i++)
+         ppBus[ch][i] = 0.0;
+
+   FTYPE dTimeStep = 1.0 / (FTYPE)nSampleRate;
+   FTYPE dStartTime = (FTYPE)nStartSample * dTimeStep;
+
+   // Only if the pool or block grew past what main prepared for
+   if (vecChunkBuffers.size() * nChunkVoices < (size_t)voices.nCapacity || vecChunkBuffers[0].nStride < (int)nFrames
+      || vecChunkBuffers[0].nChannels != (int)nChannels)
+      PrepareRender(max(nFrames, nBlockFrames), voices.nCapacity, nChannels);
+
+   const synth::simd::kernels<FTYPE>& k = synth::simd::active<FTYPE>();
+
+   // Sequencer steps and score notes for this block, already in sample order
+   int nSteps = pSequencer ? pSequencer->Schedule(nStartSample, nFrames, nSampleRate) : 0;
+   int nNextStep = 0;
+   const synth::score_event* pNotes = nullptr;
+   int nNotes = pScore ? pScore->take(nStartSample, nFrames, pNotes) : 0;
+   int nNextNote = 0;
+
+   unsigned int nFrom = 0;
+   while (nFrom < nFrames)
+   {
+      // Apply everything that is due, late events take effect immediately
+      synth::event e;
+      while (queEvents.Peek(e) && e.nSample <= nStartSample + nFrom)
+      {
+         ApplyEvent(e, nStartSample + nFrom);
+         queEvents.Pop();
+      }
+
+      while (nNextStep < nSteps && pSequencer->vecEvents[nNextStep].nSample <= nStartSample + nFrom)
+         ApplyEvent(pSequencer->vecEvents[nNextStep++], nStartSample + nFrom);
+
+      while (nNextNote < nNotes && pNotes[nNextNote].nSample <= nStartSample + nFrom)
+         ApplyScoreEvent(pNotes[nNextNote++], nStartSample + nFrom);
+
+      // Render up to the next event or step, or the end of the block
+      unsigned int nTo = nFrames;
+      if (queEvents.Peek(e) && e.nSample < nStartSample + nFrames)
+         nTo = (unsigned int)(e.nSample - nStartSample);
+      if (nNextStep < nSteps && pSequencer->vecEvents[nNextStep].nSample < nStartSample + nTo)
+         nTo = (unsigned int)(pSequencer->vecEvents[nNextStep].nSample - nStartSample);
+      if (nNextNote < nNotes && pNotes[nNextNote].nSample < nStartSample + nTo)
+         nTo = (unsigned int)(pNotes[nNextNote].nSample - nStartSample);
+
+      render_pass pass;
+      pass.dTime = dStartTime + nFrom * dTimeStep;
+      pass.dTimeStep = dTimeStep;
+      pass.nFrames = nTo - nFrom;
+      pass.nChannels = nChannels;
+
+      int nChunks = (voices.nActive + nChunkVoices - 1) / nChunkVoices;
+      if (pRenderPool != nullptr && voices.nActive >= nParallelVoices)
+         pRenderPool->run(nChunks, RenderChunk, &pass);
+      else
+      {
+         for (int c = 0; c < nChunks; c++)
+            RenderChunk(&pass, c, 0);
+      }
+
+      for (int c = 0; c < nChunks; c++)
+         for (unsigned int ch = 0; ch < nChannels; ch++)
+            k.scale_add(ppBus[ch] + nFrom, vecChunkBuffers[c].plane(ch), nTo - nFrom, 1.0);
+
+      nFrom = nTo;
+   }
+
+   voices.Collect();
+   nNotesActive = voices.nActive;
+}
 
-   for (auto &n : vecNotes)
+// Prints the cost of the block oscillators and noise against the reference osc()
+void MeasureOscillators()
+{
+   struct { const char* name; int nType; bool bReference; } tests[] =
    {
-      bool bNoteFinished = false;
-      FTYPE dSound = 0;
+      { "osc()      OSC_SAW_ANA    ", synth::OSC_SAW_ANA, true },
+      { "osc_block  OSC_SAW_ANA    ", synth::OSC_SAW_ANA, false },
+      { "osc_block  OSC_SAW_BLEP   ", synth::OSC_SAW_BLEP, false },
+      { "osc()      OSC_SQUARE     ", synth::OSC_SQUARE, true },
+      { "osc_block  OSC_SQUARE_BLEP", synth::OSC_SQUARE_BLEP, false },
+      { "osc_block  OSC_PULSE_BLEP ", synth::OSC_PULSE_BLEP, false },
+      { "osc()      OSC_NOISE      ", synth::OSC_NOISE, true },
+      { "osc_block  OSC_NOISE      ", synth::OSC_NOISE, false },
+      { "osc_block  OSC_NOISE_PINK ", synth::OSC_NOISE_PINK, false },
+   };
+
+   for (auto& t : tests)
+      cout << t.name << "  " << synth::measure_osc(t.nType, t.bReference, nSampleRate) << " ns/sample" << endl;
+}
+
+// Headless benchmark suite. Oscillators, envelopes and instruments in
+// ns/sample, MakeNoise against voice count, sequencer stepping against
+// channel count, and the headroom of one block at the common sample rates.
+// Writes CSV, or JSON when the file name ends in .json; stdout when no file
+// is given.
+int RunBenchmarks(const string& sFile)
+{
+   synth::bench::report rep;
+   const int nBlock = nBlockFrames;
+   vector<FTYPE> vecBlock(nBlock);
+   auto narrow = [](const wstring& w) { string s; for (wchar_t c : w) s += c == L' ' ? '_' : (char)c; return s; };
+
+   // Oscillators, reference and block versions of every type
+   const char* sOscNames[] = { "sine", "square", "triangle", "saw_ana", "saw_dig", "noise", "saw_blep", "square_blep", "pulse_blep", "noise_pink", "noise_brown" };
+   for (int t = synth::OSC_SINE; t <= synth::OSC_NOISE_BROWN; t++)
+   {
+      rep.add("osc", sOscNames[t], 0, synth::measure_osc(t, true, nSampleRate, 0.5), "ns/sample");
+      rep.add("osc_block", sOscNames[t], 0, synth::measure_osc(t, false, nSampleRate, 0.5), "ns/sample");
+   }
+
+   // Envelope, the per sample reference against the block ramps
+   {
+      synth::envelope_adsr env;
+      env.dAttackTime = 0.01; env.dDecayTime = 0.1; env.dSustainAmplitude = 0.8; env.dReleaseTime = 0.2;
+      FTYPE dTime = 0.0, dSink = 0.0;
+      double d = synth::bench::seconds_per_call([&]()
+      {
+         for (int i = 0; i < nBlock; i++)
+            dSink += env.amplitude(dTime += 1.0 / nSampleRate, 0.0, 0.0);
+         if (dTime > 1.0) dTime = 0.0;
+      });
+      rep.add("envelope", "amplitude", 0, d * 1e9 / nBlock, "ns/sample");
+
+      synth::envelope_state st;
+      env.start(st, nSampleRate);
+      d = synth::bench::seconds_per_call([&]()
+      {
+         for (int i = 0; i < nBlock; i++) vecBlock[i] = 1.0;
+         env.apply(st, nSampleRate, vecBlock.data(), nBlock, 1.0);
+      });
+      rep.add("envelope", "apply", 0, d * 1e9 / nBlock, "ns/sample");
+      volatile FTYPE dKeep = dSink; (void)dKeep;
+   }
+
+   // Instruments, sound() per sample and render() per block. Notes are held
+   // and restarted when they finish so the cost covers a whole note.
+   for (synth::instrument_base* inst : pInstruments)
+   {
+      synth::note n;
+      n.id = 64;
+      n.channel = inst;
+      n.active = true;
+      FTYPE dTime = 0.0, dSink = 0.0;
+      double d = synth::bench::seconds_per_call([&]()
+      {
+         bool bFinished = false;
+         for (int i = 0; i < nBlock; i++)
+            dSink += inst->sound(dTime += 1.0 / nSampleRate, n, bFinished);
+         if (bFinished) dTime = 0.0;
+      });
+      rep.add("sound", narrow(inst->name), 0, d * 1e9 / nBlock, "ns/sample");
+      volatile FTYPE dKeep = dSink; (void)dKeep;
+
+      synth::voice_pool pool(1);
+      int v = pool.Allocate(inst, 64, 0.0, 0);
+      inst->note_on(pool, v, nSampleRate);
+      dTime = 0.0;
+      d = synth::bench::seconds_per_call([&]()
+      {
+         bool bFinished = false;
+         inst->render(pool, v, dTime, 1.0 / nSampleRate, vecBlock.data(), nBlock, bFinished);
+         dTime += (FTYPE)nBlock / nSampleRate;
+         if (bFinished)
+         {
+            pool.Retrigger(v, 0.0, 0);
+            inst->note_on(pool, v, nSampleRate);
+            dTime = 0.0;
+         }
+      });
+      rep.add("render", narrow(inst->name), 0, d * 1e9 / nBlock, "ns/sample");
+   }
+
+   // The interpreter against the compiled graph it copies, same sound
+   {
+      const char* sBell8 =
+         "name 8-Bit Bell\n"
+         "lifetime 3.0\n"
+         "envelope attack 0.01 decay 0.5 sustain 0.8 release 1.0\n"
+         "osc square offset 0 gain 1.0\n"
+         "osc sine offset 12 gain 0.5\n"
+         "osc sine offset 24 gain 0.25\n";
+
+      synth::instrument_bell8 instGraph;
+      synth::instrument_patch instPatch;
+      synth::voice_pool pool(1);
+      string sError;
+      instPatch.LoadText(sBell8, pool.nCapacity, sError);
+      instPatch.Update(pool);
+
+      synth::instrument_base* pCompare[] = { &instGraph, &instPatch };
+      const char* sKind[] = { "graph", "patch" };
+      for (int i = 0; i < 2; i++)
+      {
+         synth::instrument_base* inst = pCompare[i];
+         int v = pool.Allocate(inst, 64, 0.0, 0);
+         inst->note_on(pool, v, nSampleRate);
+         FTYPE dTime = 0.0;
+         double d = synth::bench::seconds_per_call([&]()
+         {
+            bool bFinished = false;
+            inst->render(pool, v, dTime, 1.0 / nSampleRate, vecBlock.data(), nBlock, bFinished);
+            dTime += (FTYPE)nBlock / nSampleRate;
+            if (bFinished)
+            {
+               pool.Retrigger(v, 0.0, 0);
+               inst->note_on(pool, v, nSampleRate);
+               dTime = 0.0;
+            }
+         });
+         rep.add("render_8-Bit_Bell", sKind[i], 0, d * 1e9 / nBlock, "ns/sample");
+         pool.Release(v);
+      }
+   }
+
+   // Sampler kit load time, and playback of a mapped 16 bit file resampled
+   // a third above its root
+   {
+      const string sSample = "synth_bench_sample.wav";
+      vector<int16_t> vecSine(nSampleRate * 10);
+      for (size_t i = 0; i < vecSine.size(); i++)
+         vecSine[i] = (int16_t)(16000.0 * sin(2.0 * PI * 220.0 * (double)i / nSampleRate));
+
+      olcBackendFile file(sSample);
+      if (file.Open(L"", nSampleRate, 1, OLC_FORMAT_S16, 1, (unsigned int)(vecSine.size() * sizeof(int16_t)), [](void*) {}, nullptr))
+      {
+         file.Submit(0, vecSine.data(), (unsigned int)(vecSine.size() * sizeof(int16_t)));
+         file.Close();
+
+         synth::instrument_sampler instSampler;
+         synth::voice_pool pool(1);
+         string sError;
+         auto tp1 = chrono::steady_clock::now();
+         bool bLoaded = instSampler.kit.compile("zone " + sSample + " root 60\n", "", pool.nCapacity, sError);
+         auto tp2 = chrono::steady_clock::now();
+         if (bLoaded)
+         {
+            rep.add("sampler", "load", 0, chrono::duration<double>(tp2 - tp1).count() * 1e3, "ms");
+
+            int v = pool.Allocate(&instSampler, 4, 0.0, 0);   // a third above the root, so it resamples
+            instSampler.note_on(pool, v, nSampleRate);
+            FTYPE dTime = 0.0;
+            double d = synth::bench::seconds_per_call([&]()
+            {
+               bool bFinished = false;
+               instSampler.render(pool, v, dTime, 1.0 / nSampleRate, vecBlock.data(), nBlock, bFinished);
+               dTime += (FTYPE)nBlock / nSampleRate;
+               if (bFinished)
+               {
+                  pool.Retrigger(v, 0.0, 0);
+                  instSampler.note_on(pool, v, nSampleRate);
+                  dTime = 0.0;
+               }
+            });
+            rep.add("sampler", "render", 0, d * 1e9 / nBlock, "ns/sample");
+         }
+      }
+      remove(sSample.c_str());
+   }
+
+   // Renders blocks of MakeNoise with nVoices held harmonica notes, returns
+   // seconds per block
+   synth::bus bus;
+   auto polyphony = [&](int nVoices, int nChannels)
+   {
+      bus.resize(nChannels, nBlock);
+      PrepareRender(nBlock, 1024, nChannels);
+      voices = synth::voice_pool(1024, synth::STEAL_OLDEST);
+      voices.Seed(0);
+      for (int i = 0; i < nVoices; i++)
+      {
+         synth::event e;
+         e.type = synth::EVENT_NOTE_ON;
+         e.id = i % 96;
+         e.channel = &instHarm;
+         ApplyEvent(e, 0);   // repeated ids still get a voice each, held notes never match
+      }
+
+      uint64_t nSample = 0;
+      return synth::bench::seconds_per_call([&]()
+      {
+         MakeNoise(bus.planes(), nBlock, nChannels, nSample);
+         nSample += nBlock;
+      }, 0.05, 2);
+   };
+
+   for (int nVoices = 1; nVoices <= 1024; nVoices *= 2)
+   {
+      double d = polyphony(nVoices, 1);
+      rep.add("polyphony", "block", nVoices, d * 1e6, "us/block");
+      rep.add("polyphony", "voice", nVoices, d * 1e9 / ((double)nBlock * nVoices), "ns/voice_sample");
+   }
+
+   // Stereo renders every voice once too, it only adds a second pan-and-add
+   for (int nVoices = 16; nVoices <= 256; nVoices *= 4)
+      rep.add("polyphony_stereo", "block", nVoices, polyphony(nVoices, 2) * 1e6, "us/block");
+
+   // Dense hi-hats, nHits new ones every block, synthesised against played
+   // from one-shots. Each rings on for about ten blocks.
+   auto hihats = [&](int nHits, bool bOneShot)
+   {
+      unique_ptr<synth::oneshot_cache> pSaved = move(instHiHat.pOneShot);
+      if (bOneShot)
+      {
+         instHiHat.pOneShot.reset(new synth::oneshot_cache());
+         instHiHat.pOneShot->want(64);
+         UpdateOneShots(nullptr);
+      }
+
+      bus.resize(1, nBlock);
+      PrepareRender(nBlock, 1024, 1);
+      voices = synth::voice_pool(1024, synth::STEAL_OLDEST);
+      voices.Seed(0);
+
+      uint64_t nSample = 0;
+      double d = synth::bench::seconds_per_call([&]()
+      {
+         synth::event e;
+         e.type = synth::EVENT_NOTE_ON;
+         e.id = 64;
+         e.channel = &instHiHat;
+         for (int h = 0; h < nHits; h++)
+            ApplyEvent(e, nSample);
+         MakeNoise(bus.planes(), nBlock, 1, nSample);
+         nSample += nBlock;
+      }, 0.05, 2);
+
+      instHiHat.pOneShot = move(pSaved);
+      return d;
+   };
+
+   for (int nHits = 1; nHits <= 16; nHits *= 4)
+   {
+      rep.add("hihat_hits", "synth", nHits, hihats(nHits, false) * 1e6, "us/block");
+      rep.add("hihat_hits", "oneshot", nHits, hihats(nHits, true) * 1e6, "us/block");
+   }
+
+   // A large score built in memory: 16 tracks of sixteenth notes with a
+   // tempo change every bar. Load time, the cost of handing each block its
+   // events, and a seek.
+   {
+      const int nTracks = 16, nNotes = 25000;
+      vector<unsigned char> vecFile = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, 0, nTracks + 1, 0x01, 0xe0 };   // 480 ticks a beat
+      auto vlq = [](vector<unsigned char>& v, uint32_t n)
+      {
+         unsigned char b[4];
+         int i = 0;
+         do { b[i++] = n & 0x7f; n >>= 7; } while (n);
+         while (i-- > 0) v.push_back(b[i] | (i > 0 ? 0x80 : 0));
+      };
+      auto chunk = [&](const vector<unsigned char>& vecTrack)
+      {
+         uint32_t n = (uint32_t)vecTrack.size();
+         vecFile.insert(vecFile.end(), { 'M', 'T', 'r', 'k', (unsigned char)(n >> 24), (unsigned char)(n >> 16), (unsigned char)(n >> 8), (unsigned char)n });
+         vecFile.insert(vecFile.end(), vecTrack.begin(), vecTrack.end());
+      };
+
+      vector<unsigned char> vecTrack;
+      for (int b = 0; b < nNotes / 16; b++)
+      {
+         uint32_t nTempo = 400000 + (b % 8) * 25000;
+         vlq(vecTrack, b == 0 ? 0 : 1920);
+         vecTrack.insert(vecTrack.end(), { 0xff, 0x51, 3, (unsigned char)(nTempo >> 16), (unsigned char)(nTempo >> 8), (unsigned char)nTempo });
+      }
+      chunk(vecTrack);
+
+      for (int t = 0; t < nTracks; t++)
+      {
+         vecTrack.clear();
+         for (int n = 0; n < nNotes; n++)
+         {
+            vlq(vecTrack, n == 0 ? t : 60);
+            vecTrack.insert(vecTrack.end(), { (unsigned char)(0x90 | t), (unsigned char)(36 + (n * 7 + t) % 60), 100 });
+            vlq(vecTrack, 60);
+            vecTrack.insert(vecTrack.end(), { (unsigned char)(0x80 | t), (unsigned char)(36 + (n * 7 + t) % 60), 0 });
+         }
+         chunk(vecTrack);
+      }
+
+      synth::midi_score score;
+      string sError;
+      auto tp1 = chrono::steady_clock::now();
+      score.parse(vecFile.data(), vecFile.size(), (FTYPE)nSampleRate, sError);
+      auto tp2 = chrono::steady_clock::now();
+      int nEvents = (int)score.vecEvents.size();
+      rep.add("midi", "load", nEvents, chrono::duration<double>(tp2 - tp1).count() * 1e3, "ms");
+
+      synth::score_cursor cursor(&score);
+      uint64_t nSample = 0;
+      double d = synth::bench::seconds_per_call([&]()
+      {
+         const synth::score_event* pFirst;
+         cursor.take(nSample, nBlock, pFirst);
+         nSample = nSample + nBlock > score.nLength ? 0 : nSample + nBlock;
+      });
+      rep.add("midi", "block", nEvents, d * 1e9, "ns/block");
 
-      if (n.channel != nullptr)
-         dSound = n.channel->sound(dTime, n, bNoteFinished);
+      d = synth::bench::seconds_per_call([&]()
+      {
+         nSample = (nSample * 6364136223846793005ull + 1442695040888963407ull) % score.nLength;
+         cursor.seek(nSample);
+      });
+      rep.add("midi", "seek", nEvents, d * 1e9, "ns");
+   }
+
+   // The same again spread over every core, when there is more than one
+   int nCores = (int)thread::hardware_concurrency();
+   if (nCores > 1)
+   {
+      synth::work_pool* pSaved = pRenderPool;
+      pRenderPool = new synth::work_pool(nCores - 1);
+      for (int nVoices = 16; nVoices <= 1024; nVoices *= 2)
+         rep.add("polyphony_threads", "block", nVoices, polyphony(nVoices, 1) * 1e6, "us/block");
+      delete pRenderPool;
+      pRenderPool = pSaved;
+   }
+
+   // Sequencer: stepping a block of a song with many sparse channels, each
+   // chaining a 64 and a 48 step pattern so the channels drift apart
+   for (int nChannels = 64; nChannels <= 1024; nChannels *= 4)
+   {
+      synth::sequencer seq(140.0);
+      int p64 = seq.AddPattern(synth::pattern(64));
+      int p48 = seq.AddPattern(synth::pattern(48));
+      seq.vecPatterns[p64].set(0, 60, 100, 2);
+      seq.vecPatterns[p64].set(37, 67, 80, 4);
+      seq.vecPatterns[p48].set(12, 64, 127, 1);
+      for (int c = 0; c < nChannels; c++)
+      {
+         int n = seq.AddInstrument(&instHiHat);
+         seq.Chain(n, (c & 1) ? p48 : p64);
+         seq.Chain(n, (c & 1) ? p64 : p48);
+      }
+
+      uint64_t nSample = 0;
+      double d = synth::bench::seconds_per_call([&]()
+      {
+         seq.Schedule(nSample, nBlock, nSampleRate);
+         nSample += nBlock;
+      });
+      rep.add("sequencer", "block", nChannels, d * 1e6, "us/block");
+   }
+
+   // Output conversion of one block, loud enough that a third of it clips
+   for (int i = 0; i < nBlock; i++)
+      vecBlock[i] = (FTYPE)(1.5 * sin(0.01 * i));
+   vector<int16_t> vecS16(nBlock);
+   vector<int32_t> vecS24(nBlock);
+   vector<float> vecF32(nBlock);
+   rep.add("convert", "s16", 0, synth::bench::seconds_per_call([&]() { olcSampleFormat<int16_t>::Convert(vecS16.data(), vecBlock.data(), nBlock, 0, 0.0f); }) * 1e9 / nBlock, "ns/sample");
+   rep.add("convert", "s16_dither", 0, synth::bench::seconds_per_call([&]() { olcSampleFormat<int16_t>::Convert(vecS16.data(), vecBlock.data(), nBlock, 0, 1.0f); }) * 1e9 / nBlock, "ns/sample");
+   rep.add("convert", "s24", 0, synth::bench::seconds_per_call([&]() { olcSampleFormat<int32_t>::Convert(vecS24.data(), vecBlock.data(), nBlock, 0, 0.0f); }) * 1e9 / nBlock, "ns/sample");
+   rep.add("convert", "f32", 0, synth::bench::seconds_per_call([&]() { olcSampleFormat<float>::Convert(vecF32.data(), vecBlock.data(), nBlock, 0, 0.0f); }) * 1e9 / nBlock, "ns/sample");
+
+   // Planar buses to the device layout, once per block
+   vector<FTYPE> vecInterleaved(nBlock * 4);
+   for (int nChannels = 1; nChannels <= 4; nChannels *= 2)
+   {
+      bus.resize(nChannels, nBlock);
+      rep.add("interleave", "block", nChannels, synth::bench::seconds_per_call([&]()
+      {
+         synth::simd::active<FTYPE>().interleave(vecInterleaved.data(), bus.planes(), nChannels, nBlock);
+      }) * 1e9 / nBlock, "ns/frame");
+   }
+
+   // Headroom: how many times over one block of 16 voices fits in its own
+   // playback time
+   unsigned int nRates[] = { 44100, 48000, 96000 };
+   for (unsigned int nRate : nRates)
+   {
+      nSampleRate = nRate;
+      double d = polyphony(16, 1);
+      rep.add("headroom", "16_voices", nRate, ((double)nBlock / nRate) / d, "x_realtime");
+   }
+   nSampleRate = 44100;
+   voices = synth::voice_pool(256, synth::STEAL_OLDEST);
+
+   if (sFile.empty())
+   {
+      rep.write_csv(cout);
+      return 0;
+   }
+
+   ofstream f(sFile);
+   if (!f.is_open())
+   {
+      cout << "can't write " << sFile << endl;
+      return 1;
+   }
+
+   if (sFile.size() >= 5 && sFile.compare(sFile.size() - 5, 5, ".json") == 0)
+      rep.write_json(f);
+   else
+      rep.write_csv(f);
+   return 0;
+}
 
-      dMixedOutput += dSound;
+// Channel 10 is General MIDI percussion, its kicks, snares and closed
+// hats go to the drums. Every other channel plays the first sampler kit
+// loaded, else the first patch, else the harmonica. Every melodic target
+// takes note ids, with middle C, MIDI note 60, on note 0; kits convert their
+// zones the same way when they load, so a score plays a kit at its pitch.
+void MapScore()
+{
+   synth::instrument_base* pMelody = !vecSamplers.empty() ? (synth::instrument_base*)vecSamplers[0].get()
+      : !vecPatches.empty() ? (synth::instrument_base*)vecPatches[0].get() : (synth::instrument_base*)&instHarm;
 
-      if (bNoteFinished && n.off > n.on)
+   for (int c = 0; c < 16; c++)
+      for (int n = 0; n < 128; n++)
       {
-         n.active = false;
+         scoreMap[c][n].channel = c == 9 ? nullptr : pMelody;
+         scoreMap[c][n].id = n - synth::TUNING_MIDI_ZERO;
       }
+
+   const struct { int nNote; synth::instrument_base* pDrum; } drums[] =
+   {
+      { 35, &instKick }, { 36, &instKick }, { 37, &instSnare }, { 38, &instSnare }, { 40, &instSnare },
+      { 42, &instHiHat }, { 44, &instHiHat }, { 46, &instHiHat },
+   };
+   for (auto& d : drums)
+   {
+      scoreMap[9][d.nNote].channel = d.pDrum;
+      scoreMap[9][d.nNote].id = 64;   // where the drums are voiced, as in the demo pattern
+      if (d.pDrum->pOneShot)
+         d.pDrum->pOneShot->want(64);
    }
+}
 
-   safe_remove<vector<synth::note>>(vecNotes,
-      [](synth::note const& item) { return item.active; });
+// The demo pattern, shared by the realtime and offline paths
+void LoadPattern(synth::sequencer& seq)
+{
+   seq.Chain(seq.AddInstrument(&instKick), seq.AddPattern(synth::pattern::parse(L"X...X...X..X.X..")));
+   seq.Chain(seq.AddInstrument(&instSnare), seq.AddPattern(synth::pattern::parse(L"..X...X...X...X.")));
+   seq.Chain(seq.AddInstrument(&instHiHat), seq.AddPattern(synth::pattern::parse(L"X.X.X.X.X.X.X.XX")));
+
+   // Each loaded patch plays a bass line, a fifth higher than the last,
+   // starting an octave under middle C
+   for (size_t i = 0; i < vecPatches.size(); i++)
+   {
+      synth::pattern p(16);
+      int nRoot = -12 + 7 * (int)i;
+      p.set(0, nRoot, 110, 3);
+      p.set(4, nRoot + 3, 90, 2);
+      p.set(7, nRoot + 7, 100, 2);
+      p.set(10, nRoot + 5, 90, 4);
+      seq.Chain(seq.AddInstrument(vecPatches[i].get()), seq.AddPattern(p));
+   }
 
-   return dMixedOutput * 0.2;
+   // And each sampler kit a broken chord on middle C
+   for (size_t i = 0; i < vecSamplers.size(); i++)
+   {
+      synth::pattern p(16);
+      p.set(0, 0, 100, 6);
+      p.set(2, 4, 90, 4);
+      p.set(4, 7, 90, 4);
+      p.set(8, 12, 110, 8);
+      seq.Chain(seq.AddInstrument(vecSamplers[i].get()), seq.AddPattern(p));
+   }
 }
 
-int main()
+// Renders dSeconds of the pattern to a .wav or raw file as fast as the CPU
+// allows. Same sequencer, instruments and MakeNoise as the realtime path,
+// but the sequencer is stepped by rendered time instead of wall time.
+// Output goes out in fixed chunks of T, so memory use doesn't grow with
+// length.
+template<class T>
+bool RenderOffline(const string& sFile, double dSeconds, unsigned int nChannels, bool bDither)
 {
-   vector<wstring> devices = olcNoiseMaker<short>::Enumerate();
+   const unsigned int nChunkFrames = nBlockFrames * 16;
+   olcBackendFile file(sFile);
+   if (!file.Open(L"", nSampleRate, nChannels, olcSampleFormat<T>::nFormat, 1, nChunkFrames * nChannels * sizeof(T), [](void*) {}, nullptr))
+      return false;
 
-   olcNoiseMaker<short> sound(devices[0], 44100, 1, 8, 256);
+   synth::sequencer seq(90.0);
+   if (pScore == nullptr)
+      LoadPattern(seq);
+   else
+      pScore->seek(0);
+   UpdateOneShots(&seq);
+   voices.Seed(0);
+   pSequencer = &seq;
+
+   synth::bus bus;
+   bus.resize(nChannels, nBlockFrames);
+   vector<FTYPE> vecMix(nBlockFrames * nChannels);
+   vector<T> vecChunk(nChunkFrames * nChannels);
+   unsigned int nChunkUsed = 0;   // frames
+
+   uint64_t nTotal = (uint64_t)(dSeconds * nSampleRate);
+   uint64_t nSample = 0;
+
+   auto tp1 = chrono::steady_clock::now();
+   while (nSample < nTotal)
+   {
+      unsigned int nFrames = (unsigned int)min<uint64_t>(nBlockFrames, nTotal - nSample);
 
-   sound.SetUserFunction(MakeNoise);
+      MakeNoise(bus.planes(), nFrames, nChannels, nSample);
+      synth::simd::active<FTYPE>().interleave(vecMix.data(), bus.planes(), (int)nChannels, (int)nFrames);
+
+      // Chunks are a whole number of blocks, so a block never straddles two
+      olcSampleFormat<T>::Convert(vecChunk.data() + nChunkUsed * nChannels, vecMix.data(), (int)(nFrames * nChannels),
+         (uint32_t)(nSample * nChannels), bDither ? 1.0f : 0.0f);
+      nChunkUsed += nFrames;
+      if (nChunkUsed == nChunkFrames)
+      {
+         file.Submit(0, vecChunk.data(), nChunkUsed * nChannels * sizeof(T));
+         nChunkUsed = 0;
+      }
+
+      nSample += nFrames;
+   }
+
+   if (nChunkUsed > 0)
+      file.Submit(0, vecChunk.data(), nChunkUsed * nChannels * sizeof(T));
+   file.Close();
+   pSequencer = nullptr;
+   auto tp2 = chrono::steady_clock::now();
+
+   double dWall = chrono::duration<double>(tp2 - tp1).count();
+   cout << "rendered " << dSeconds << "s to " << sFile << " in " << dWall << "s, "
+      << (dWall > 0.0 ? dSeconds / dWall : 0.0) << "x realtime" << endl;
+   return true;
+}
+
+// Backend from a --backend spec: waveout, alsa, null, null:<speed> or
+// file:<path>. Returns nullptr for anything not built in.
+olcAudioBackend* CreateBackend(const string& sSpec)
+{
+   string sName = sSpec.substr(0, sSpec.find(':'));
+   string sArg = sSpec.find(':') == string::npos ? "" : sSpec.substr(sSpec.find(':') + 1);
+
+#if defined(_WIN32)
+   if (sName == "waveout") return new olcBackendWaveOut();
+#endif
+#if defined(OLC_BACKEND_ALSA)
+   if (sName == "alsa") return new olcBackendAlsa();
+#endif
+   if (sName == "null") return new olcBackendNull(sArg.empty() ? 1.0 : atof(sArg.c_str()));
+   if (sName == "file" && !sArg.empty()) return new olcBackendFile(sArg);
+   return nullptr;
+}
 
+// Plays the pattern on sDevice in T samples until dRunTime seconds have
+// passed, or for ever when it is negative. Owns pBackend.
+template<class T>
+int PlayLive(olcAudioBackend* pBackend, const wstring& sDevice, synth::sequencer& seq, unsigned int nChannels, double dRunTime, double dStatsPeriod, bool bDither)
+{
+   olcNoiseMaker<T> sound(sDevice, nSampleRate, nChannels, 8, nBlockFrames * nChannels, pBackend);
+
+   sound.SetBusFunction(MakeNoise);
+   sound.SetDither(bDither);
+
+#if defined(_WIN32)
    wchar_t* screen = new wchar_t[80 * 30];
    HANDLE hConsole = CreateConsoleScreenBuffer(GENERIC_READ | GENERIC_WRITE, 0, NULL, CONSOLE_TEXTMODE_BUFFER, NULL);
    SetConsoleActiveScreenBuffer(hConsole);
@@ -475,22 +1495,32 @@ int main()
          for (size_t i = 0; i < s.size(); i++)
             screen[y * 80 + x + i] = s[i];
       };
+#endif
 
    auto clock_old_time = chrono::high_resolution_clock::now();
    auto clock_real_time = chrono::high_resolution_clock::now();
    double dElapsedTime = 0.0;
    double dWallTime = 0.0;
 
-   synth::sequencer seq(90.0);
-   seq.AddInstrument(&instKick);
-   seq.AddInstrument(&instSnare);
-   seq.AddInstrument(&instHiHat);
-
-   seq.vecChannel.at(0).sBeat = L"X...X...X..X.X..";
-   seq.vecChannel.at(1).sBeat = L"..X...X...X...X.";
-   seq.vecChannel.at(2).sBeat = L"X.X.X.X.X.X.X.XX";
-
-   while (1)
+#if defined(_WIN32)
+   bool bKeyDown[16] = { false };
+#else
+   double dLastPrint = 0.0;
+#endif
+   double dLastStats = 0.0;
+   double dLastReload = 0.0;
+
+   // Instrument costs over the last second, one line each
+   const int nInstruments = sizeof(pInstruments) / sizeof(pInstruments[0]);
+   wstring sCost[nInstruments];
+#if !defined(SYNTH_NO_PROFILE)
+   synth::cost_reading costLast[nInstruments];
+   double dLastCost = 0.0;
+   for (int i = 0; i < nInstruments; i++)
+      costLast[i] = pInstruments[i]->cost.read(nSampleRate);
+#endif
+
+   while (dRunTime < 0.0 || dWallTime < dRunTime)
    {
       clock_real_time = chrono::high_resolution_clock::now();
       auto time_last_loop = clock_real_time - clock_old_time;
@@ -498,52 +1528,52 @@ int main()
       dElapsedTime = chrono::duration<FTYPE>(time_last_loop).count();
       dWallTime += dElapsedTime;
       FTYPE dTimeNow = sound.GetTime();
+      FTYPE dPlayNow = sound.GetPlaybackTime();
 
-      int newNotes = seq.Update(dElapsedTime);
-      muxNotes.lock();
-      for (int a = 0; a < newNotes; a++)
+      wstring stats = L"Notes: " + to_wstring(nNotesActive) + L" Wall Time: " + to_wstring(dWallTime) + L" CPU Time: " + to_wstring(dTimeNow) + L" Latency: " + to_wstring(dTimeNow - dPlayNow);
+
+#if !defined(SYNTH_NO_PROFILE)
+      // Share of one core, average voices sounding, and cost per voice sample
+      if (dWallTime - dLastCost >= 1.0)
       {
-         seq.vecNotes[a].on = dTimeNow;
-         vecNotes.emplace_back(seq.vecNotes[a]);
+         double dWindow = dWallTime - dLastCost;
+         dLastCost = dWallTime;
+         for (int i = 0; i < nInstruments; i++)
+         {
+            synth::cost_reading now = pInstruments[i]->cost.read(nSampleRate);
+            synth::cost_reading d = now - costLast[i];
+            costLast[i] = now;
+
+            wchar_t sLine[80];
+            swprintf(sLine, 80, L"%-12ls cpu %5.2f%%  voices %6.2f  %6.1f ns/voice sample", pInstruments[i]->name.c_str(),
+               100.0 * d.dCpuSeconds / dWindow, d.dVoiceSeconds / dWindow,
+               d.dVoiceSeconds > 0.0 ? 1e9 * d.dCpuSeconds / (d.dVoiceSeconds * nSampleRate) : 0.0);
+            sCost[i] = sLine;
+         }
       }
-      muxNotes.unlock();
+#endif
+
+#if defined(_WIN32)
+      // Key presses this iteration share one sample stamp
+      uint64_t nNow = clkEvents.Now(nSampleRate, nBlockFrames);
 
       for (int k = 0; k < 16; k++)
       {
          short nKeyState = GetAsyncKeyState((unsigned char)("ZSXCFVGBNJMK\xbcL\xbe\xbf"[k]));
+         bool bDown = (nKeyState & 0x8000) != 0;
 
-         muxNotes.lock();
-         auto noteFound = find_if(vecNotes.begin(), vecNotes.end(), [&k](synth::note const& item) { return item.id == k + 64 && item.channel == &instHarm; });
-         if (noteFound == vecNotes.end())
+         if (bDown != bKeyDown[k])
          {
-            if (nKeyState & 0x8000)
-            {
-               synth::note n;
-               n.id = k + 64;
-               n.on = dTimeNow;
-               n.active = true;
-               n.channel = &instHarm;
-
-               vecNotes.emplace_back(n);
-            }
+            synth::event e;
+            e.type = bDown ? synth::EVENT_NOTE_ON : synth::EVENT_NOTE_OFF;
+            e.id = k + 64;
+            e.channel = &instHarm;
+            e.nSample = nNow;
+
+            // If the queue is full, try again next time round
+            if (queEvents.Push(e))
+               bKeyDown[k] = bDown;
          }
-         else
-         {
-            if (nKeyState & 0x8000)
-            {
-               if (noteFound->off > noteFound->on)
-               {
-                  noteFound->on = dTimeNow;
-                  noteFound->active = true;
-               }
-            }
-            else
-            {
-               if (noteFound->off < noteFound->on)
-                  noteFound->off = dTimeNow;
-            }
-         }
-         muxNotes.unlock();
       }
 
       for (int i = 0; i < 80 * 30; i++) screen[i] = L' ';
@@ -557,10 +1587,10 @@ int main()
       }
 
       int n = 0;
-      for (auto v : seq.vecChannel)
+      for (auto& v : seq.vecChannel)
       {
          draw(2, 3 + n, v.instrument->name);
-         draw(20, 3 + n, v.sBeat);
+         draw(20, 3 + n, seq.vecPatterns[v.vecChain[0]].text());
          n++;
       }
 
@@ -573,12 +1603,259 @@ int main()
       draw(2, 12, L"|  Z  |  X  |  C  |  V  |  B  |  N  |  M  |  ,  |  .  |  /  |");
       draw(2, 13, L"|_____|_____|_____|_____|_____|_____|_____|_____|_____|_____|");
 
-      wstring stats = L"Notes: " + to_wstring(vecNotes.size()) + L" Wall Time: " + to_wstring(dWallTime) + L" CPU Time: " + to_wstring(dTimeNow) + L" Latency: " + to_wstring(dWallTime - dTimeNow);
       draw(2, 15, stats);
 
+      olcNoiseStats st = sound.GetStats();
+      draw(2, 16, L"Render p99: " + to_wstring((int)st.render.dP99) + L"us of " + to_wstring((int)st.dDeadline) + L"us  Late: " + to_wstring(st.nLate) + L"  XRuns: " + to_wstring(st.nXRuns));
+      for (int i = 0; i < nInstruments; i++)
+         draw(2, 18 + i, sCost[i]);
+
       WriteConsoleOutputCharacter(hConsole, screen, 80 * 30, { 0,0 }, &dwBytesWritten);
-   }
+#else
+      // No console UI here, just the sequencer and a status line
+      if (dWallTime - dLastPrint >= 1.0)
+      {
+         dLastPrint = dWallTime;
+         wcout << stats << endl;
+         for (int i = 0; i < nInstruments; i++)
+            if (!sCost[i].empty())
+               wcout << L"  " << sCost[i] << endl;
+      }
+#endif
 
+      // Render thread health, for telling DSP cost from scheduling trouble
+      if (dStatsPeriod > 0.0 && dWallTime - dLastStats >= dStatsPeriod)
+      {
+         dLastStats = dWallTime;
+         sound.GetStats().Print(wcerr);
+         sound.ResetStats();
+      }
+
+      // Patch files are watched, edits are heard within a second
+      if (dWallTime - dLastReload >= 1.0)
+      {
+         dLastReload = dWallTime;
+         for (size_t i = 0; i < vecPatches.size(); i++)
+         {
+            string sError;
+            int nLoads = vecPatches[i]->nLoads;
+            if (!vecPatches[i]->Load(vecPatchFiles[i], voices.nCapacity, sError))
+               wcerr << L"patch " << wstring(vecPatchFiles[i].begin(), vecPatchFiles[i].end()) << L": " << wstring(sError.begin(), sError.end()) << endl;
+            else if (vecPatches[i]->nLoads != nLoads)
+               wcerr << L"patch " << wstring(vecPatchFiles[i].begin(), vecPatchFiles[i].end()) << L" reloaded" << endl;
+         }
+
+         // And one-shots of notes that missed, or of instruments that changed
+         UpdateOneShots(nullptr);
+      }
+
+      // Timing lives in the renderer now, the UI only needs to keep up with keys
+      this_thread::sleep_for(chrono::milliseconds(5));
+   }
 
    return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char* argv[])
+{
+   if (argc > 1 && string(argv[1]) == "--measure-osc")
+   {
+      MeasureOscillators();
+      return 0;
+   }
+
+   if (argc > 1 && string(argv[1]) == "--bench")
+      return RunBenchmarks(argc > 2 ? argv[2] : "");
+
+   if (argc > 1 && string(argv[1]) == "--selftest")
+   {
+      int nFailures = 0;
+      double dError = synth::simd::selftest<FTYPE>(nFailures);
+      cout << "simd " << synth::simd::isa_name(synth::simd::detect()) << ": max error " << dError
+         << ", " << nFailures << " samples out of tolerance" << endl;
+      return nFailures == 0 ? 0 : 1;
+   }
+
+   olcAudioBackend* pBackend = nullptr;
+   double dRunTime = -1.0;   // seconds to play for, forever if negative
+   string sRenderFile;
+   double dStatsPeriod = -1.0;   // seconds between render statistics dumps, none if negative
+   int nThreads = (int)thread::hardware_concurrency() - 1;   // workers besides the audio thread
+   int nFormat = OLC_FORMAT_S16;   // device sample format
+   unsigned int nChannels = 2;     // output channels, the instruments are panned across them
+   bool bDither = false;
+
+   for (int a = 1; a + 1 < argc; a++)
+   {
+      string sOption = argv[a];
+
+      // Plays everything in a Scala scale, note 0 stays at 256Hz
+      if (sOption == "--tuning")
+      {
+         if (!tunPlay.load_scala(argv[++a]))
+         {
+            cout << "can't load tuning " << argv[a] << endl;
+            return 1;
+         }
+
+         for (synth::instrument_base* inst : pInstruments)
+            inst->pTuning = &tunPlay;
+         for (auto& p : vecPatches)
+            p->pTuning = &tunPlay;
+         for (auto& p : vecSamplers)
+            p->pTuning = &tunPlay;
+      }
+      else if (sOption == "--backend")
+      {
+         delete pBackend;
+         pBackend = CreateBackend(argv[++a]);
+         if (pBackend == nullptr)
+         {
+            cout << "unknown backend " << argv[a] << endl;
+            return 1;
+         }
+      }
+      else if (sOption == "--seconds")
+         dRunTime = atof(argv[++a]);
+      else if (sOption == "--render")
+         sRenderFile = argv[++a];
+      else if (sOption == "--threads")
+         nThreads = atoi(argv[++a]);
+      else if (sOption == "--stats")
+         dStatsPeriod = atof(argv[++a]);
+      else if (sOption == "--patch")
+      {
+         string sError;
+         unique_ptr<synth::instrument_patch> p(new synth::instrument_patch());
+         if (!p->Load(argv[++a], voices.nCapacity, sError))
+         {
+            cout << "can't load patch " << argv[a] << ": " << sError << endl;
+            return 1;
+         }
+
+         p->pTuning = instBell.pTuning;   // whichever of --tuning and --patch comes first
+         p->Update(voices);
+         vecPatches.push_back(move(p));
+         vecPatchFiles.push_back(argv[a]);
+      }
+      else if (sOption == "--sampler")
+      {
+         string sError;
+         unique_ptr<synth::instrument_sampler> p(new synth::instrument_sampler());
+         auto tp1 = chrono::steady_clock::now();
+         if (!p->Load(argv[++a], voices.nCapacity, sError))
+         {
+            cout << "can't load sampler " << argv[a] << ": " << sError << endl;
+            return 1;
+         }
+
+         auto tp2 = chrono::steady_clock::now();
+         p->pTuning = instBell.pTuning;
+         cout << string(p->name.begin(), p->name.end()) << ": " << p->kit.zones() << " zones, " << p->kit.mapped_bytes() / 1024 << " KiB mapped, "
+            << p->kit.resident_bytes() / 1024 << " KiB faulted in, loaded in " << chrono::duration<double>(tp2 - tp1).count() * 1e3 << " ms" << endl;
+         vecSamplers.push_back(move(p));
+      }
+      else if (sOption == "--midi")
+      {
+         // Plays a score instead of the demo pattern
+         string sError;
+         auto tp1 = chrono::steady_clock::now();
+         if (!scoreMidi.load(argv[++a], (FTYPE)nSampleRate, sError))
+         {
+            cout << "can't load " << argv[a] << ": " << sError << endl;
+            return 1;
+         }
+
+         auto tp2 = chrono::steady_clock::now();
+         cout << argv[a] << ": " << scoreMidi.nTracks << " tracks, " << scoreMidi.vecEvents.size() << " notes on and off, "
+            << (double)scoreMidi.nLength / nSampleRate << "s, loaded in " << chrono::duration<double>(tp2 - tp1).count() * 1e3 << " ms" << endl;
+      }
+      else if (sOption == "--channels")
+      {
+         nChannels = (unsigned int)atoi(argv[++a]);
+         if (nChannels < 1 || nChannels > (unsigned int)synth::BUS_MAX_CHANNELS)
+         {
+            cout << "channels must be 1 to " << synth::BUS_MAX_CHANNELS << endl;
+            return 1;
+         }
+      }
+      else if (sOption == "--format")
+      {
+         string sFormat = argv[++a];
+         if (sFormat == "s16") nFormat = OLC_FORMAT_S16;
+         else if (sFormat == "s24") nFormat = OLC_FORMAT_S24_32;
+         else if (sFormat == "f32") nFormat = OLC_FORMAT_F32;
+         else
+         {
+            cout << "unknown format " << sFormat << ", expected s16, s24 or f32" << endl;
+            return 1;
+         }
+      }
+   }
+
+   // These take no argument, so they can come last
+   for (int a = 1; a < argc; a++)
+   {
+      if (string(argv[a]) == "--dither")
+         bDither = true;
+
+      // Drum hits are rendered once per note and played from memory
+      if (string(argv[a]) == "--oneshot")
+         for (synth::instrument_base* inst : { (synth::instrument_base*)&instKick, (synth::instrument_base*)&instSnare, (synth::instrument_base*)&instHiHat })
+            inst->pOneShot.reset(new synth::oneshot_cache());
+   }
+
+   // After the options, whichever order the instruments came in
+   synth::score_cursor curScore(&scoreMidi);
+   if (!scoreMidi.vecEvents.empty())
+   {
+      MapScore();
+      pScore = &curScore;
+   }
+
+   // Declared before the engine so it outlives the render thread
+   unique_ptr<synth::work_pool> pPool(nThreads > 0 ? new synth::work_pool(nThreads) : nullptr);
+   pRenderPool = pPool.get();
+   PrepareRender(nBlockFrames, voices.nCapacity, nChannels);
+
+   // Offline, no device involved
+   if (!sRenderFile.empty())
+   {
+      delete pBackend;
+      double dSeconds = dRunTime >= 0.0 ? dRunTime : pScore ? (double)scoreMidi.nLength / nSampleRate + 2.0 : 60.0;
+      bool bOk = nFormat == OLC_FORMAT_S24_32 ? RenderOffline<int32_t>(sRenderFile, dSeconds, nChannels, bDither)
+         : nFormat == OLC_FORMAT_F32 ? RenderOffline<float>(sRenderFile, dSeconds, nChannels, bDither)
+         : RenderOffline<int16_t>(sRenderFile, dSeconds, nChannels, bDither);
+      if (!bOk)
+      {
+         cout << "can't write " << sRenderFile << endl;
+         return 1;
+      }
+      return 0;
+   }
+
+   if (pBackend == nullptr)
+      pBackend = olcAudioBackend::CreateDefault();
+
+   vector<wstring> devices = pBackend->Enumerate();
+   if (devices.empty())
+   {
+      cout << "no output devices" << endl;
+      delete pBackend;
+      return 1;
+   }
+
+   // The renderer steps the pattern itself, it has to outlive the engine
+   synth::sequencer seq(90.0);
+   if (pScore == nullptr)
+      LoadPattern(seq);
+   UpdateOneShots(&seq);
+   pSequencer = &seq;
+
+   switch (nFormat)
+   {
+   case OLC_FORMAT_S24_32: return PlayLive<int32_t>(pBackend, devices[0], seq, nChannels, dRunTime, dStatsPeriod, bDither);
+   case OLC_FORMAT_F32: return PlayLive<float>(pBackend, devices[0], seq, nChannels, dRunTime, dStatsPeriod, bDither);
+   default: return PlayLive<int16_t>(pBackend, devices[0], seq, nChannels, dRunTime, dStatsPeriod, bDither);
+   }
+}
@@ -0,0 +1,622 @@
+/*
+	Audio output backends for olcNoiseMaker
+
+	The engine owns a ring of nBlocks blocks. It fills a free block, hands it
+	to the backend with Submit() and waits for a free one when none are left.
+	A backend calls the completion function once for every submitted block,
+	from any thread, when that block's memory can be reused. That is the only
+	contract, so every backend keeps the same block and double buffering
+	behaviour the original waveOut code had.
+
+	waveOut     - Windows, the original device path
+	ALSA        - Linux, build with OLC_BACKEND_ALSA defined and link -lasound
+	null        - no device, blocks complete on a clock, optionally faster
+	              than real time. For running the render thread headless.
+	file        - writes the stream to a .wav or raw PCM file
+
+	Every backend takes the three OLC_FORMAT_ sample formats below.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+#if defined(_WIN32)
+#pragma comment(lib, "winmm.lib")
+#ifndef NOMINMAX
+#define NOMINMAX   // std::min and std::max, not the macros
+#endif
+#include <Windows.h>
+#endif
+
+#if defined(OLC_BACKEND_ALSA)
+#include <alsa/asoundlib.h>
+#endif
+
+#if defined(_WIN32) && !defined(WAVE_FORMAT_IEEE_FLOAT)
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#endif
+
+// Sample formats, interleaved and native endian
+const int OLC_FORMAT_S16 = 0;      // signed 16 bit
+const int OLC_FORMAT_S24_32 = 1;   // signed 24 bit in the top of 32, reads as plain 32 bit
+const int OLC_FORMAT_F32 = 2;      // 32 bit float, full scale at +-1
+
+inline unsigned int olcFormatBytes(int nFormat)
+{
+	return nFormat == OLC_FORMAT_S16 ? 2 : 4;
+}
+
+class olcAudioBackend
+{
+public:
+	typedef void(*BlockDone)(void*);
+
+	virtual ~olcAudioBackend() {}
+
+	virtual std::wstring Name() = 0;
+
+	// Names that Open() accepts
+	virtual std::vector<std::wstring> Enumerate() = 0;
+
+	// Prepares the device for nBlocks blocks of nBlockBytes interleaved
+	// samples in nFormat. funcDone(pUser) is called once per completed block.
+	virtual bool Open(const std::wstring& sDevice, unsigned int nSampleRate, unsigned int nChannels, int nFormat,
+		unsigned int nBlocks, unsigned int nBlockBytes, BlockDone funcDone, void* pUser) = 0;
+
+	// Queues block nBlock. pData stays untouched by the engine until the
+	// block completes.
+	virtual bool Submit(unsigned int nBlock, const void* pData, unsigned int nBytes) = 0;
+
+	// Stops the device. Blocks still queued may or may not complete.
+	virtual void Close() = 0;
+
+	// Underruns the device has reported since Open(), -1 when it can't
+	// tell and the engine has to work them out for itself
+	virtual int XRuns() const
+	{
+		return -1;
+	}
+
+	// Platform default: waveOut on Windows, ALSA when enabled, else null
+	static olcAudioBackend* CreateDefault();
+};
+
+
+#if defined(_WIN32)
+class olcBackendWaveOut : public olcAudioBackend
+{
+public:
+	olcBackendWaveOut()
+	{
+		m_hwDevice = nullptr;
+	}
+
+	~olcBackendWaveOut()
+	{
+		Close();
+	}
+
+	std::wstring Name() override
+	{
+		return L"waveout";
+	}
+
+	std::vector<std::wstring> Enumerate() override
+	{
+		int nDeviceCount = waveOutGetNumDevs();
+		std::vector<std::wstring> sDevices;
+		WAVEOUTCAPS woc;
+		for (int n = 0; n < nDeviceCount; n++)
+			if (waveOutGetDevCaps(n, &woc, sizeof(WAVEOUTCAPS)) == S_OK)
+				sDevices.push_back(woc.szPname);
+		return sDevices;
+	}
+
+	bool Open(const std::wstring& sDevice, unsigned int nSampleRate, unsigned int nChannels, int nFormat,
+		unsigned int nBlocks, unsigned int nBlockBytes, BlockDone funcDone, void* pUser) override
+	{
+		std::vector<std::wstring> devices = Enumerate();
+		auto d = std::find(devices.begin(), devices.end(), sDevice);
+		if (d == devices.end())
+			return false;
+
+		m_funcDone = funcDone;
+		m_pUser = pUser;
+
+		int nDeviceID = (int)std::distance(devices.begin(), d);
+		WAVEFORMATEX waveFormat;
+		waveFormat.wFormatTag = nFormat == OLC_FORMAT_F32 ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+		waveFormat.nSamplesPerSec = nSampleRate;
+		waveFormat.wBitsPerSample = (WORD)(olcFormatBytes(nFormat) * 8);
+		waveFormat.nChannels = (WORD)nChannels;
+		waveFormat.nBlockAlign = (waveFormat.wBitsPerSample / 8) * waveFormat.nChannels;
+		waveFormat.nAvgBytesPerSec = waveFormat.nSamplesPerSec * waveFormat.nBlockAlign;
+		waveFormat.cbSize = 0;
+
+		if (waveOutOpen(&m_hwDevice, nDeviceID, &waveFormat, (DWORD_PTR)waveOutProcWrap, (DWORD_PTR)this, CALLBACK_FUNCTION) != S_OK)
+		{
+			m_hwDevice = nullptr;
+			return false;
+		}
+
+		m_vecHeaders.assign(nBlocks, WAVEHDR());
+		for (auto& h : m_vecHeaders)
+			ZeroMemory(&h, sizeof(WAVEHDR));
+		return true;
+	}
+
+	bool Submit(unsigned int nBlock, const void* pData, unsigned int nBytes) override
+	{
+		WAVEHDR& h = m_vecHeaders[nBlock];
+		if (h.dwFlags & WHDR_PREPARED)
+			waveOutUnprepareHeader(m_hwDevice, &h, sizeof(WAVEHDR));
+
+		h.lpData = (LPSTR)pData;
+		h.dwBufferLength = nBytes;
+		h.dwFlags = 0;
+		waveOutPrepareHeader(m_hwDevice, &h, sizeof(WAVEHDR));
+		return waveOutWrite(m_hwDevice, &h, sizeof(WAVEHDR)) == S_OK;
+	}
+
+	void Close() override
+	{
+		if (m_hwDevice == nullptr)
+			return;
+
+		waveOutReset(m_hwDevice);
+		for (auto& h : m_vecHeaders)
+			if (h.dwFlags & WHDR_PREPARED)
+				waveOutUnprepareHeader(m_hwDevice, &h, sizeof(WAVEHDR));
+		waveOutClose(m_hwDevice);
+		m_hwDevice = nullptr;
+	}
+
+private:
+	HWAVEOUT m_hwDevice;
+	std::vector<WAVEHDR> m_vecHeaders;
+	BlockDone m_funcDone;
+	void* m_pUser;
+
+	// Handler for soundcard request for more data
+	void waveOutProc(HWAVEOUT hWaveOut, UINT uMsg, DWORD dwParam1, DWORD dwParam2)
+	{
+		if (uMsg != WOM_DONE) return;
+		m_funcDone(m_pUser);
+	}
+
+	// Static wrapper for sound card handler
+	static void CALLBACK waveOutProcWrap(HWAVEOUT hWaveOut, UINT uMsg, DWORD_PTR dwInstance, DWORD dwParam1, DWORD dwParam2)
+	{
+		((olcBackendWaveOut*)dwInstance)->waveOutProc(hWaveOut, uMsg, dwParam1, dwParam2);
+	}
+};
+#endif
+
+
+#if defined(OLC_BACKEND_ALSA)
+// Writes each block into ALSA's ring with a blocking writei. The ring is
+// sized to the engine's blocks, so once a write returns the block's data
+// is in the device buffer and the block is free again.
+class olcBackendAlsa : public olcAudioBackend
+{
+public:
+	olcBackendAlsa()
+	{
+		m_pcm = nullptr;
+		m_nFrameBytes = 1;
+		m_nXRuns = 0;
+	}
+
+	~olcBackendAlsa()
+	{
+		Close();
+	}
+
+	std::wstring Name() override
+	{
+		return L"alsa";
+	}
+
+	std::vector<std::wstring> Enumerate() override
+	{
+		std::vector<std::wstring> sDevices = { L"default" };
+		void** hints = nullptr;
+		if (snd_device_name_hint(-1, "pcm", &hints) == 0)
+		{
+			for (void** h = hints; *h != nullptr; h++)
+			{
+				char* sName = snd_device_name_get_hint(*h, "NAME");
+				char* sIO = snd_device_name_get_hint(*h, "IOID");
+				if (sName != nullptr && (sIO == nullptr || strcmp(sIO, "Output") == 0))
+				{
+					std::string s(sName);
+					std::wstring w(s.begin(), s.end());
+					if (w != L"default")
+						sDevices.push_back(w);
+				}
+				free(sName);
+				free(sIO);
+			}
+			snd_device_name_free_hint(hints);
+		}
+		return sDevices;
+	}
+
+	bool Open(const std::wstring& sDevice, unsigned int nSampleRate, unsigned int nChannels, int nFormat,
+		unsigned int nBlocks, unsigned int nBlockBytes, BlockDone funcDone, void* pUser) override
+	{
+		snd_pcm_format_t format;
+		if (nFormat == OLC_FORMAT_S16) format = SND_PCM_FORMAT_S16;
+		else if (nFormat == OLC_FORMAT_S24_32) format = SND_PCM_FORMAT_S32;
+		else if (nFormat == OLC_FORMAT_F32) format = SND_PCM_FORMAT_FLOAT;
+		else return false;
+
+		std::string sName(sDevice.begin(), sDevice.end());
+		if (snd_pcm_open(&m_pcm, sName.c_str(), SND_PCM_STREAM_PLAYBACK, 0) < 0)
+		{
+			m_pcm = nullptr;
+			return false;
+		}
+
+		m_nFrameBytes = nChannels * olcFormatBytes(nFormat);
+		unsigned int nLatency = (unsigned int)((uint64_t)nBlocks * (nBlockBytes / m_nFrameBytes) * 1000000 / nSampleRate);
+		if (snd_pcm_set_params(m_pcm, format, SND_PCM_ACCESS_RW_INTERLEAVED, nChannels, nSampleRate, 1, nLatency) < 0)
+		{
+			Close();
+			return false;
+		}
+
+		m_funcDone = funcDone;
+		m_pUser = pUser;
+		return true;
+	}
+
+	bool Submit(unsigned int nBlock, const void* pData, unsigned int nBytes) override
+	{
+		const char* p = (const char*)pData;
+		snd_pcm_uframes_t nLeft = nBytes / m_nFrameBytes;
+		while (nLeft > 0)
+		{
+			snd_pcm_sframes_t n = snd_pcm_writei(m_pcm, p, nLeft);
+			if (n < 0)
+			{
+				// Underrun or suspend, restart the stream and carry on
+				m_nXRuns++;
+				if (snd_pcm_recover(m_pcm, (int)n, 1) < 0)
+					return false;
+				continue;
+			}
+			p += n * m_nFrameBytes;
+			nLeft -= n;
+		}
+
+		m_funcDone(m_pUser);
+		return true;
+	}
+
+	void Close() override
+	{
+		if (m_pcm == nullptr)
+			return;
+
+		snd_pcm_drop(m_pcm);
+		snd_pcm_close(m_pcm);
+		m_pcm = nullptr;
+	}
+
+	int XRuns() const override
+	{
+		return (int)m_nXRuns;
+	}
+
+private:
+	snd_pcm_t* m_pcm;
+	unsigned int m_nFrameBytes;
+	std::atomic<unsigned int> m_nXRuns;
+	BlockDone m_funcDone;
+	void* m_pUser;
+};
+#endif
+
+
+// No device. A pacing thread completes blocks one block length apart, as a
+// sound card would. dSpeed scales the clock, 2.0 runs at twice real time and
+// 0.0 completes every block as soon as it is submitted.
+class olcBackendNull : public olcAudioBackend
+{
+public:
+	olcBackendNull(double dSpeed = 1.0)
+	{
+		m_dSpeed = dSpeed;
+		m_bOpen = false;
+		m_nQueued = 0;
+		m_nXRuns = 0;
+	}
+
+	~olcBackendNull()
+	{
+		Close();
+	}
+
+	std::wstring Name() override
+	{
+		return L"null";
+	}
+
+	std::vector<std::wstring> Enumerate() override
+	{
+		return { L"null" };
+	}
+
+	bool Open(const std::wstring&, unsigned int nSampleRate, unsigned int nChannels, int nFormat,
+		unsigned int, unsigned int nBlockBytes, BlockDone funcDone, void* pUser) override
+	{
+		m_funcDone = funcDone;
+		m_pUser = pUser;
+		m_nQueued = 0;
+		m_nXRuns = 0;
+
+		double dFrames = (double)nBlockBytes / (double)(nChannels * olcFormatBytes(nFormat));
+		double dSeconds = m_dSpeed > 0.0 ? dFrames / (double)nSampleRate / m_dSpeed : 0.0;
+		m_tBlock = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(dSeconds));
+
+		m_bOpen = true;
+		if (m_dSpeed > 0.0)
+			m_thread = std::thread(&olcBackendNull::PaceThread, this);
+		return true;
+	}
+
+	bool Submit(unsigned int, const void*, unsigned int) override
+	{
+		if (m_dSpeed <= 0.0)
+		{
+			m_funcDone(m_pUser);
+			return true;
+		}
+
+		std::unique_lock<std::mutex> lm(m_mux);
+		m_nQueued++;
+		m_cv.notify_one();
+		return true;
+	}
+
+	void Close() override
+	{
+		if (!m_bOpen)
+			return;
+
+		{
+			std::unique_lock<std::mutex> lm(m_mux);
+			m_bOpen = false;
+			m_cv.notify_one();
+		}
+		if (m_thread.joinable())
+			m_thread.join();
+	}
+
+	int XRuns() const override
+	{
+		return (int)m_nXRuns;
+	}
+
+private:
+	double m_dSpeed;
+	std::chrono::steady_clock::duration m_tBlock;
+	bool m_bOpen;
+	unsigned int m_nQueued;
+	std::atomic<unsigned int> m_nXRuns;
+	std::mutex m_mux;
+	std::condition_variable m_cv;
+	std::thread m_thread;
+	BlockDone m_funcDone;
+	void* m_pUser;
+
+	// Plays out queued blocks against the clock. If the queue runs dry the
+	// clock restarts from the next submission, like a device after an underrun.
+	void PaceThread()
+	{
+		std::unique_lock<std::mutex> lm(m_mux);
+		auto tNext = std::chrono::steady_clock::now();
+		bool bPlaying = false;
+		while (m_bOpen)
+		{
+			if (m_nQueued == 0)
+			{
+				if (bPlaying)
+					m_nXRuns++;
+				bPlaying = false;
+				while (m_nQueued == 0 && m_bOpen)
+					m_cv.wait(lm);
+				tNext = std::chrono::steady_clock::now();
+				continue;
+			}
+
+			tNext += m_tBlock;
+			if (m_cv.wait_until(lm, tNext, [this] { return !m_bOpen; }))
+				break;
+
+			m_nQueued--;
+			bPlaying = true;
+			lm.unlock();
+			m_funcDone(m_pUser);
+			lm.lock();
+		}
+	}
+};
+
+
+// Streams every block to disk. A name ending in .wav gets a RIFF header
+// whose sizes are filled in on Close(), anything else is raw interleaved
+// little endian PCM. Blocks complete as soon as they are written, so the
+// engine runs as fast as it can render.
+class olcBackendFile : public olcAudioBackend
+{
+public:
+	olcBackendFile(const std::string& sFile)
+	{
+		m_sFile = sFile;
+		m_bWav = sFile.size() >= 4 && (sFile.compare(sFile.size() - 4, 4, ".wav") == 0 || sFile.compare(sFile.size() - 4, 4, ".WAV") == 0);
+		m_nDataBytes = 0;
+		m_nDataPos = 0;
+		m_nFactPos = 0;
+		m_nFrameBytes = 2;
+	}
+
+	~olcBackendFile()
+	{
+		Close();
+	}
+
+	std::wstring Name() override
+	{
+		return L"file";
+	}
+
+	std::vector<std::wstring> Enumerate() override
+	{
+		return { std::wstring(m_sFile.begin(), m_sFile.end()) };
+	}
+
+	bool Open(const std::wstring&, unsigned int nSampleRate, unsigned int nChannels, int nFormat,
+		unsigned int, unsigned int, BlockDone funcDone, void* pUser) override
+	{
+		m_file.open(m_sFile, std::ios::out | std::ios::binary | std::ios::trunc);
+		if (!m_file.is_open())
+			return false;
+
+		m_funcDone = funcDone;
+		m_pUser = pUser;
+		m_nDataBytes = 0;
+
+		// 16 bit is plain PCM. Float needs the extended header and a fact
+		// chunk, 24 in 32 is WAVE_FORMAT_EXTENSIBLE with 24 valid bits.
+		if (m_bWav)
+		{
+			uint16_t nBits = (uint16_t)(olcFormatBytes(nFormat) * 8);
+			uint16_t nBlockAlign = (uint16_t)(nChannels * olcFormatBytes(nFormat));
+			uint32_t nFmtBytes = nFormat == OLC_FORMAT_S16 ? 16 : nFormat == OLC_FORMAT_F32 ? 18 : 40;
+			m_nFrameBytes = nBlockAlign;
+
+			m_file.write("RIFF", 4);
+			Write32(0);                            // patched on Close
+			m_file.write("WAVEfmt ", 8);
+			Write32(nFmtBytes);
+			Write16(nFormat == OLC_FORMAT_S16 ? 0x0001 : nFormat == OLC_FORMAT_F32 ? 0x0003 : 0xfffe);
+			Write16((uint16_t)nChannels);
+			Write32(nSampleRate);
+			Write32(nSampleRate * nBlockAlign);
+			Write16(nBlockAlign);
+			Write16(nBits);
+			if (nFormat == OLC_FORMAT_F32)
+				Write16(0);
+			if (nFormat == OLC_FORMAT_S24_32)
+			{
+				static const unsigned char guidPCM[16] = { 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 };
+				Write16(22);
+				Write16(24);                        // valid bits
+				Write32(0);                         // no speaker mapping
+				m_file.write((const char*)guidPCM, 16);
+			}
+
+			m_nFactPos = 0;
+			if (nFormat == OLC_FORMAT_F32)
+			{
+				m_file.write("fact", 4);
+				Write32(4);
+				m_nFactPos = (uint32_t)m_file.tellp();
+				Write32(0);                         // frames, patched on Close
+			}
+
+			m_file.write("data", 4);
+			m_nDataPos = (uint32_t)m_file.tellp();
+			Write32(0);                            // patched on Close
+		}
+		return m_file.good();
+	}
+
+	bool Submit(unsigned int, const void* pData, unsigned int nBytes) override
+	{
+		m_file.write((const char*)pData, nBytes);
+		m_nDataBytes += nBytes;
+		m_funcDone(m_pUser);
+		return m_file.good();
+	}
+
+	void Close() override
+	{
+		if (!m_file.is_open())
+			return;
+
+		if (m_bWav)
+		{
+			uint32_t nData = (uint32_t)std::min<uint64_t>(m_nDataBytes, 0xffffffffull - m_nDataPos);
+			m_file.seekp(4);
+			Write32(m_nDataPos - 4 + nData);
+			m_file.seekp(m_nDataPos);
+			Write32(nData);
+			if (m_nFactPos != 0)
+			{
+				m_file.seekp(m_nFactPos);
+				Write32(nData / m_nFrameBytes);
+			}
+		}
+		m_file.close();
+	}
+
+	// Never starved, the engine waits on the disk instead
+	int XRuns() const override
+	{
+		return 0;
+	}
+
+	uint64_t BytesWritten() const
+	{
+		return m_nDataBytes;
+	}
+
+private:
+	std::string m_sFile;
+	std::ofstream m_file;
+	bool m_bWav;
+	uint64_t m_nDataBytes;
+	uint32_t m_nDataPos;     // header offsets of the sizes patched on Close()
+	uint32_t m_nFactPos;
+	uint32_t m_nFrameBytes;
+	BlockDone m_funcDone;
+	void* m_pUser;
+
+	void Write16(uint16_t n)
+	{
+		char b[2] = { (char)(n & 0xff), (char)(n >> 8) };
+		m_file.write(b, 2);
+	}
+
+	void Write32(uint32_t n)
+	{
+		char b[4] = { (char)(n & 0xff), (char)((n >> 8) & 0xff), (char)((n >> 16) & 0xff), (char)(n >> 24) };
+		m_file.write(b, 4);
+	}
+};
+
+
+inline olcAudioBackend* olcAudioBackend::CreateDefault()
+{
+#if defined(_WIN32)
+	return new olcBackendWaveOut();
+#elif defined(OLC_BACKEND_ALSA)
+	return new olcBackendAlsa();
+#else
+	return new olcBackendNull();
+#endif
+}
@@ -41,6 +41,18 @@
 	  on creating and listening to interesting waveforms.
 	- Currently MS Windows only
 
+	1.1
+	- Output goes through olcAudioBackend: waveOut, ALSA, null or file
+
+	1.2
+	- Time base is an integer sample counter, GetTime() is derived from it
+	- Lock free clock: GetSamplePosition(), GetPlaybackPosition()
+	- Render, wait and xrun statistics: GetStats(), ResetStats()
+	- T may be short, int32_t (24 bit) or float, converted a block at a time
+	  by the vector kernels with optional TPDF dither: SetDither()
+	- Planar callback, SetBusFunction(): one buffer per channel, interleaved
+	  for the device once per block
+
 	Documentation
 	~~~~~~~~~~~~~
 
@@ -53,32 +65,77 @@
 
 #pragma once
 
-#pragma comment(lib, "winmm.lib")
-
 #include <iostream>
 #include <cmath>
+#include <chrono>
 #include <fstream>
 #include <vector>
 #include <string>
 #include <thread>
 #include <atomic>
 #include <condition_variable>
-using namespace std;
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
 
-#include <Windows.h>
+#include "olcNoiseBackend.h"
+#include "olcNoiseStats.h"
+
+using namespace std;
 
 #ifndef FTYPE
 #define FTYPE double
 #endif
 
+#include "synthSimd.h"
+#include "synthBus.h"
+
+// Device sample types. T picks the format the backend is opened with and
+// the converter that turns the mix into it.
+template<class S> struct olcSampleFormat;
+
+template<> struct olcSampleFormat<int16_t>
+{
+	static const int nFormat = OLC_FORMAT_S16;
+	static void Convert(int16_t* pOut, const FTYPE* pIn, int n, uint32_t nCounter, float fDither)
+	{
+		synth::simd::active<FTYPE>().to_s16(pOut, pIn, n, nCounter, 0x6d2b79f5, fDither);
+	}
+};
+
+template<> struct olcSampleFormat<int32_t>
+{
+	static const int nFormat = OLC_FORMAT_S24_32;
+	static void Convert(int32_t* pOut, const FTYPE* pIn, int n, uint32_t nCounter, float fDither)
+	{
+		synth::simd::active<FTYPE>().to_s24(pOut, pIn, n, nCounter, 0x6d2b79f5, fDither);
+	}
+};
+
+template<> struct olcSampleFormat<float>
+{
+	static const int nFormat = OLC_FORMAT_F32;
+	static void Convert(float* pOut, const FTYPE* pIn, int n, uint32_t, float)
+	{
+		synth::simd::active<FTYPE>().to_f32(pOut, pIn, n);
+	}
+};
+
 const double PI = 2.0 * acos(0.0);
 
 template<class T>
 class olcNoiseMaker
 {
 public:
-	olcNoiseMaker(wstring sOutputDevice, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512)
+	// pBackend is owned by the engine from here on, nullptr picks the
+	// platform default
+	olcNoiseMaker(wstring sOutputDevice, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512,
+		olcAudioBackend* pBackend = nullptr)
 	{
+		m_pBackend = pBackend;
+		m_pBlockMemory = nullptr;
+		m_pMixBuffer = nullptr;
+		m_bReady = false;
 		Create(sOutputDevice, nSampleRate, nChannels, nBlocks, nBlockSamples);
 	}
 
@@ -97,48 +154,46 @@ public:
 		m_nBlockFree = m_nBlockCount;
 		m_nBlockCurrent = 0;
 		m_pBlockMemory = nullptr;
-		m_pWaveHeaders = nullptr;
+		m_pMixBuffer = nullptr;
+		m_nSamplePosition = 0;
+		m_nSamplesPlayed = 0;
+		m_nPlayedTicks = Ticks();
+		m_nClockSequence = 0;
+		m_nBlocksRendered = 0;
+		m_nBlocksLate = 0;
+		m_nStarved = 0;
+		m_bResetStats = false;
+		m_nXRunsBase = 0;
+		m_bDither = false;
 
 		m_userFunction = nullptr;
+		m_blockFunction = nullptr;
+		m_busFunction = nullptr;
 
-		// Validate device
-		vector<wstring> devices = Enumerate();
-		auto d = std::find(devices.begin(), devices.end(), sOutputDevice);
-		if (d != devices.end())
-		{
-			// Device is available
-			int nDeviceID = distance(devices.begin(), d);
-			WAVEFORMATEX waveFormat;
-			waveFormat.wFormatTag = WAVE_FORMAT_PCM;
-			waveFormat.nSamplesPerSec = m_nSampleRate;
-			waveFormat.wBitsPerSample = sizeof(T) * 8;
-			waveFormat.nChannels = m_nChannels;
-			waveFormat.nBlockAlign = (waveFormat.wBitsPerSample / 8) * waveFormat.nChannels;
-			waveFormat.nAvgBytesPerSec = waveFormat.nSamplesPerSec * waveFormat.nBlockAlign;
-			waveFormat.cbSize = 0;
-
-			// Open Device if valid
-			if (waveOutOpen(&m_hwDevice, nDeviceID, &waveFormat, (DWORD_PTR)waveOutProcWrap, (DWORD_PTR)this, CALLBACK_FUNCTION) != S_OK)
-				return Destroy();
-		}
+		if (m_nChannels == 0 || m_nChannels > (unsigned int)synth::BUS_MAX_CHANNELS)
+			return Destroy();
+
+		if (m_pBackend == nullptr)
+			m_pBackend = olcAudioBackend::CreateDefault();
+
+		// Open the device, it tells us through BlockDone when a block is free
+		if (!m_pBackend->Open(sOutputDevice, m_nSampleRate, m_nChannels, olcSampleFormat<T>::nFormat,
+			m_nBlockCount, m_nBlockSamples * sizeof(T), &olcNoiseMaker::BlockDone, this))
+			return Destroy();
 
 		// Allocate Wave|Block Memory
 		m_pBlockMemory = new T[m_nBlockCount * m_nBlockSamples];
 		if (m_pBlockMemory == nullptr)
 			return Destroy();
-		ZeroMemory(m_pBlockMemory, sizeof(T) * m_nBlockCount * m_nBlockSamples);
+		memset(m_pBlockMemory, 0, sizeof(T) * m_nBlockCount * m_nBlockSamples);
 
-		m_pWaveHeaders = new WAVEHDR[m_nBlockCount];
-		if (m_pWaveHeaders == nullptr)
+		// One block worth of interleaved mix, filled by the block callback
+		m_pMixBuffer = new FTYPE[m_nBlockSamples];
+		if (m_pMixBuffer == nullptr)
 			return Destroy();
-		ZeroMemory(m_pWaveHeaders, sizeof(WAVEHDR) * m_nBlockCount);
 
-		// Link headers to block memory
-		for (unsigned int n = 0; n < m_nBlockCount; n++)
-		{
-			m_pWaveHeaders[n].dwBufferLength = m_nBlockSamples * sizeof(T);
-			m_pWaveHeaders[n].lpData = (LPSTR)(m_pBlockMemory + (n * m_nBlockSamples));
-		}
+		// and the same again one plane per channel, for the bus callback
+		m_bus.resize(m_nChannels, m_nBlockSamples / m_nChannels);
 
 		m_bReady = true;
 
@@ -151,15 +206,36 @@ public:
 		return true;
 	}
 
+	// Stops the thread and releases the device. Returns false so Create()
+	// can bail out through it.
 	bool Destroy()
 	{
+		Stop();
+
+		if (m_pBackend != nullptr)
+		{
+			m_pBackend->Close();
+			delete m_pBackend;
+			m_pBackend = nullptr;
+		}
+
+		delete[] m_pBlockMemory;
+		m_pBlockMemory = nullptr;
+		delete[] m_pMixBuffer;
+		m_pMixBuffer = nullptr;
 		return false;
 	}
 
 	void Stop()
 	{
-		m_bReady = false;
-		m_thread.join();
+		{
+			unique_lock<mutex> lm(m_muxBlockNotZero);
+			m_bReady = false;
+			m_cvBlockNotZero.notify_one();
+		}
+
+		if (m_thread.joinable())
+			m_thread.join();
 	}
 
 	// Override to process current sample
@@ -168,22 +244,119 @@ public:
 		return 0.0;
 	}
 
-	FTYPE GetTime()
+	// Override to process a whole block. pOutput holds nFrames * nChannels
+	// interleaved samples and nStartSample is the index of its first frame.
+	// The default implementation adapts to the per sample UserProcess or
+	// user function, so existing code keeps working unchanged.
+	virtual void UserProcessBlock(FTYPE* pOutput, unsigned int nFrames, unsigned int nChannels, uint64_t nStartSample)
 	{
-		return m_dGlobalTime;
+		for (unsigned int f = 0; f < nFrames; f++)
+		{
+			FTYPE dTime = (FTYPE)(nStartSample + f) / (FTYPE)m_nSampleRate;
+			for (unsigned int c = 0; c < nChannels; c++)
+			{
+				if (m_userFunction == nullptr)
+					pOutput[f * nChannels + c] = UserProcess(c, dTime);
+				else
+					pOutput[f * nChannels + c] = m_userFunction(c, dTime);
+			}
+		}
+	}
+
+	// The clock. The main thread counts frames in a 64 bit integer and
+	// seconds are worked out from that count when asked for, so nothing is
+	// accumulated and time doesn't drift however long the engine runs.
+	// Safe to call from any thread, none of these lock.
+
+	// Frames rendered and handed to the backend so far
+	uint64_t GetSamplePosition() const
+	{
+		return m_nSamplePosition.load(memory_order_acquire);
+	}
+
+	// Same, in seconds
+	FTYPE GetTime() const
+	{
+		return (FTYPE)GetSamplePosition() / (FTYPE)m_nSampleRate;
+	}
+
+	// Estimated frame the device is playing right now: the frames of every
+	// block it has finished, plus the wall time since the last one finished,
+	// never running more than a block past it
+	uint64_t GetPlaybackPosition() const
+	{
+		uint32_t s0, s1;
+		uint64_t nPlayed;
+		int64_t nPlayedTicks;
+		do
+		{
+			s0 = m_nClockSequence.load(memory_order_acquire);
+			nPlayed = m_nSamplesPlayed.load(memory_order_relaxed);
+			nPlayedTicks = m_nPlayedTicks.load(memory_order_relaxed);
+			atomic_thread_fence(memory_order_acquire);
+			s1 = m_nClockSequence.load(memory_order_relaxed);
+		} while (s0 != s1 || (s0 & 1));
+
+		int64_t nElapsed = (Ticks() - nPlayedTicks) * (int64_t)m_nSampleRate / 1000000000;
+		int64_t nBlockFrames = m_nBlockSamples / m_nChannels;
+		if (nElapsed < 0) nElapsed = 0;
+		if (nElapsed > nBlockFrames) nElapsed = nBlockFrames;
+
+		uint64_t nPosition = nPlayed + (uint64_t)nElapsed;
+		uint64_t nRendered = GetSamplePosition();
+		return nPosition < nRendered ? nPosition : nRendered;
+	}
+
+	FTYPE GetPlaybackTime() const
+	{
+		return (FTYPE)GetPlaybackPosition() / (FTYPE)m_nSampleRate;
+	}
+
+	unsigned int GetSampleRate() const
+	{
+		return m_nSampleRate;
+	}
+
+	// What the main thread has measured so far, any thread may poll it
+	olcNoiseStats GetStats() const
+	{
+		olcNoiseStats s;
+		s.render = m_histRender.Read();
+		s.wait = m_histWait.Read();
+		s.available = m_histFree.Read();
+		s.dDeadline = 1e6 * (double)(m_nBlockSamples / m_nChannels) / (double)m_nSampleRate;
+		s.nBlocks = m_nBlocksRendered.load(memory_order_relaxed);
+		s.nLate = m_nBlocksLate.load(memory_order_relaxed);
+
+		// Trust the device if it keeps count, otherwise the main thread's guess.
+		// The device counts from when it opened, so take off where it stood
+		// at the last reset.
+		int nXRuns = m_pBackend != nullptr ? m_pBackend->XRuns() : -1;
+		int nBase = m_nXRunsBase.load(memory_order_relaxed);
+		s.nXRuns = nXRuns >= 0 ? (uint64_t)(nXRuns > nBase ? nXRuns - nBase : 0) : m_nStarved.load(memory_order_relaxed);
+		return s;
+	}
+
+	// Starts the statistics afresh from the next block
+	void ResetStats()
+	{
+		m_histRender.Reset();
+		m_histWait.Reset();
+		m_histFree.Reset();
+		int nXRuns = m_pBackend != nullptr ? m_pBackend->XRuns() : -1;
+		m_nXRunsBase.store(nXRuns > 0 ? nXRuns : 0, memory_order_relaxed);
+		m_bResetStats = true;
 	}
 
 
 
 public:
+	// Devices of the platform default backend
 	static vector<wstring> Enumerate()
 	{
-		int nDeviceCount = waveOutGetNumDevs();
-		vector<wstring> sDevices;
-		WAVEOUTCAPS woc;
-		for (int n = 0; n < nDeviceCount; n++)
-			if (waveOutGetDevCaps(n, &woc, sizeof(WAVEOUTCAPS)) == S_OK)
-				sDevices.push_back(woc.szPname);
+		olcAudioBackend* pBackend = olcAudioBackend::CreateDefault();
+		vector<wstring> sDevices = pBackend->Enumerate();
+		delete pBackend;
 		return sDevices;
 	}
 
@@ -192,17 +365,34 @@ public:
 		m_userFunction = func;
 	}
 
-	FTYPE clip(FTYPE dSample, FTYPE dMax)
+	// Block callback: (output, frames, channels, start sample). Takes
+	// precedence over the per sample user function when set.
+	void SetBlockFunction(void(*func)(FTYPE*, unsigned int, unsigned int, uint64_t))
 	{
-		if (dSample >= 0.0)
-			return fmin(dSample, dMax);
-		else
-			return fmax(dSample, -dMax);
+		m_blockFunction = func;
+	}
+
+	// Planar block callback: (one buffer per channel, frames, channels,
+	// start sample). The engine interleaves the channels itself, so the
+	// callback can render each source once and pan it. Takes precedence
+	// over both of the above.
+	void SetBusFunction(void(*func)(FTYPE**, unsigned int, unsigned int, uint64_t))
+	{
+		m_busFunction = func;
+	}
+
+	// One LSB of triangular dither on the integer formats. Off by default,
+	// so renders of the same input are identical.
+	void SetDither(bool bDither)
+	{
+		m_bDither = bDither;
 	}
 
 
 private:
 	FTYPE(*m_userFunction)(int, FTYPE);
+	void(*m_blockFunction)(FTYPE*, unsigned int, unsigned int, uint64_t);
+	void(*m_busFunction)(FTYPE**, unsigned int, unsigned int, uint64_t);
 
 	unsigned int m_nSampleRate;
 	unsigned int m_nChannels;
@@ -211,8 +401,9 @@ private:
 	unsigned int m_nBlockCurrent;
 
 	T* m_pBlockMemory;
-	WAVEHDR* m_pWaveHeaders;
-	HWAVEOUT m_hwDevice;
+	FTYPE* m_pMixBuffer;
+	synth::bus m_bus;
+	olcAudioBackend* m_pBackend;
 
 	thread m_thread;
 	atomic<bool> m_bReady;
@@ -220,22 +411,43 @@ private:
 	condition_variable m_cvBlockNotZero;
 	mutex m_muxBlockNotZero;
 
-	atomic<FTYPE> m_dGlobalTime;
-
-	// Handler for soundcard request for more data
-	void waveOutProc(HWAVEOUT hWaveOut, UINT uMsg, DWORD dwParam1, DWORD dwParam2)
+	// Clock, see GetSamplePosition(). The played count and the time it was
+	// last advanced are published together under a sequence counter.
+	atomic<uint64_t> m_nSamplePosition;
+	atomic<uint64_t> m_nSamplesPlayed;
+	atomic<int64_t> m_nPlayedTicks;
+	atomic<uint32_t> m_nClockSequence;
+
+	// Statistics, written by the main thread only, see GetStats()
+	olcNoiseHistogram m_histRender;
+	olcNoiseHistogram m_histWait;
+	olcNoiseHistogram m_histFree;
+	atomic<uint64_t> m_nBlocksRendered;
+	atomic<uint64_t> m_nBlocksLate;
+	atomic<uint64_t> m_nStarved;
+	atomic<bool> m_bResetStats;
+	atomic<int> m_nXRunsBase;          // device's xrun count at the last reset
+	atomic<bool> m_bDither;
+
+	static int64_t Ticks()
 	{
-		if (uMsg != WOM_DONE) return;
-
-		m_nBlockFree++;
-		unique_lock<mutex> lm(m_muxBlockNotZero);
-		m_cvBlockNotZero.notify_one();
+		return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
 	}
 
-	// Static wrapper for sound card handler
-	static void CALLBACK waveOutProcWrap(HWAVEOUT hWaveOut, UINT uMsg, DWORD dwInstance, DWORD dwParam1, DWORD dwParam2)
+	// Called by the backend whenever a submitted block has been played
+	static void BlockDone(void* pUser)
 	{
-		((olcNoiseMaker*)dwInstance)->waveOutProc(hWaveOut, uMsg, dwParam1, dwParam2);
+		olcNoiseMaker* p = (olcNoiseMaker*)pUser;
+
+		int64_t t = Ticks();
+		p->m_nClockSequence.fetch_add(1, memory_order_acq_rel);
+		p->m_nSamplesPlayed.store(p->m_nSamplesPlayed.load(memory_order_relaxed) + p->m_nBlockSamples / p->m_nChannels, memory_order_relaxed);
+		p->m_nPlayedTicks.store(t, memory_order_relaxed);
+		p->m_nClockSequence.fetch_add(1, memory_order_release);
+
+		p->m_nBlockFree++;
+		unique_lock<mutex> lm(p->m_muxBlockNotZero);
+		p->m_cvBlockNotZero.notify_one();
 	}
 
 	// Main thread. This loop responds to requests from the soundcard to fill 'blocks'
@@ -244,54 +456,77 @@ private:
 	// and then issued to the soundcard.
 	void MainThread()
 	{
-		m_dGlobalTime = 0.0;
-		FTYPE dTimeStep = 1.0 / (FTYPE)m_nSampleRate;
+		unsigned int nFrames = m_nBlockSamples / m_nChannels;
 
-		// Goofy hack to get maximum integer for a type at run-time
-		T nMaxSample = (T)pow(2, (sizeof(T) * 8) - 1) - 1;
-		FTYPE dMaxSample = (FTYPE)nMaxSample;
-		T nPreviousSample = 0;
+		int64_t nDeadline = 1000000000ll * nFrames / m_nSampleRate;
+		uint64_t nQueued = 0;
+		int64_t tWait = Ticks();
 
 		while (m_bReady)
 		{
+			if (m_bResetStats.exchange(false, memory_order_acq_rel))
+			{
+				m_nBlocksRendered.store(0, memory_order_relaxed);
+				m_nBlocksLate.store(0, memory_order_relaxed);
+				m_nStarved.store(0, memory_order_relaxed);
+			}
+
 			// Wait for block to become available
 			if (m_nBlockFree == 0)
 			{
 				unique_lock<mutex> lm(m_muxBlockNotZero);
-				while (m_nBlockFree == 0) // sometimes, Windows signals incorrectly
+				while (m_nBlockFree == 0 && m_bReady) // sometimes, Windows signals incorrectly
 					m_cvBlockNotZero.wait(lm);
+
+				if (!m_bReady)
+					break;
 			}
 
+			// Every block played out while we weren't looking: once the queue
+			// has been filled that means the device ran dry
+			int64_t tStart = Ticks();
+			unsigned int nFree = m_nBlockFree;
+			m_histWait.Record((uint64_t)(tStart - tWait) / 1000);
+			m_histFree.Record(nFree);
+			if (nQueued >= m_nBlockCount && nFree == m_nBlockCount)
+				m_nStarved.store(m_nStarved.load(memory_order_relaxed) + 1, memory_order_relaxed);
+
 			// Block is here, so use it
 			m_nBlockFree--;
 
-			// Prepare block for processing
-			if (m_pWaveHeaders[m_nBlockCurrent].dwFlags & WHDR_PREPARED)
-				waveOutUnprepareHeader(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
-
-			T nNewSample = 0;
 			int nCurrentBlock = m_nBlockCurrent * m_nBlockSamples;
 
-			for (unsigned int n = 0; n < m_nBlockSamples; n += m_nChannels)
+			// User Process, once for the whole block
+			uint64_t nPosition = m_nSamplePosition.load(memory_order_relaxed);
+			if (m_busFunction != nullptr)
 			{
-				// User Process
-				for (unsigned int c = 0; c < m_nChannels; c++)
-				{
-					if (m_userFunction == nullptr)
-						nNewSample = (T)(clip(UserProcess(c, m_dGlobalTime), 1.0) * dMaxSample);
-					else
-						nNewSample = (T)(clip(m_userFunction(c, m_dGlobalTime), 1.0) * dMaxSample);
-
-					m_pBlockMemory[nCurrentBlock + n + c] = nNewSample;
-					nPreviousSample = nNewSample;
-				}
-
-				m_dGlobalTime = m_dGlobalTime + dTimeStep;
+				m_busFunction(m_bus.planes(), nFrames, m_nChannels, nPosition);
+				synth::simd::active<FTYPE>().interleave(m_pMixBuffer, m_bus.planes(), (int)m_nChannels, (int)nFrames);
 			}
+			else if (m_blockFunction == nullptr)
+				UserProcessBlock(m_pMixBuffer, nFrames, m_nChannels, nPosition);
+			else
+				m_blockFunction(m_pMixBuffer, nFrames, m_nChannels, nPosition);
+
+			// Clip, scale and dither in one pass. The dither counter follows
+			// the sample position, so every sample gets its own draw.
+			olcSampleFormat<T>::Convert(m_pBlockMemory + nCurrentBlock, m_pMixBuffer, (int)(nFrames * m_nChannels),
+				(uint32_t)(nPosition * m_nChannels), m_bDither ? 1.0f : 0.0f);
+
+			m_nSamplePosition.store(nPosition + nFrames, memory_order_release);
+
+			int64_t nRender = Ticks() - tStart;
+			m_histRender.Record((uint64_t)nRender / 1000);
+			if (nRender > nDeadline)
+				m_nBlocksLate.store(m_nBlocksLate.load(memory_order_relaxed) + 1, memory_order_relaxed);
+			m_nBlocksRendered.store(m_nBlocksRendered.load(memory_order_relaxed) + 1, memory_order_relaxed);
+			nQueued++;
+
+			// Blocking backends wait in Submit(), that counts as waiting too
+			tWait = Ticks();
 
 			// Send block to sound device
-			waveOutPrepareHeader(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
-			waveOutWrite(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
+			m_pBackend->Submit(m_nBlockCurrent, m_pBlockMemory + nCurrentBlock, nFrames * m_nChannels * sizeof(T));
 			m_nBlockCurrent++;
 			m_nBlockCurrent %= m_nBlockCount;
 		}
@@ -0,0 +1,158 @@
+#pragma once
+
+// Render thread instrumentation for olcNoiseMaker. The main thread records
+// into histograms as it goes, any other thread reads them whenever it likes.
+// Nothing locks, and recording costs a handful of relaxed atomic stores, so
+// it is always on.
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+// Histogram of non-negative integers, one writer and any number of readers.
+// Values below 8 get a bucket each, above that every power of two is split
+// in 4, so a percentile is within a quarter of an octave of the truth.
+// Count and max are kept exactly.
+class olcNoiseHistogram
+{
+public:
+	static const int BUCKETS = 8 + 4 * 61;
+
+	struct Summary
+	{
+		uint64_t nCount;
+		double dMean;
+		double dP50;
+		double dP99;
+		double dMax;
+	};
+
+	olcNoiseHistogram()
+	{
+		for (int i = 0; i < BUCKETS; i++)
+			m_nBucket[i] = 0;
+		m_nCount = 0;
+		m_nSum = 0;
+		m_nMax = 0;
+		m_bReset = false;
+	}
+
+	// Writer only
+	void Record(uint64_t nValue)
+	{
+		if (m_bReset.load(std::memory_order_acquire))
+			Clear();
+
+		std::atomic<uint64_t>& b = m_nBucket[Bucket(nValue)];
+		b.store(b.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		m_nSum.store(m_nSum.load(std::memory_order_relaxed) + nValue, std::memory_order_relaxed);
+		if (nValue > m_nMax.load(std::memory_order_relaxed))
+			m_nMax.store(nValue, std::memory_order_relaxed);
+		m_nCount.store(m_nCount.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// Any thread. Percentiles are the top of the bucket they land in, so
+	// they err on the high side.
+	Summary Read() const
+	{
+		uint64_t nBucket[BUCKETS];
+		uint64_t nTotal = 0;
+		for (int i = 0; i < BUCKETS; i++)
+		{
+			nBucket[i] = m_nBucket[i].load(std::memory_order_relaxed);
+			nTotal += nBucket[i];
+		}
+
+		Summary s;
+		s.nCount = m_nCount.load(std::memory_order_acquire);
+		s.dMax = (double)m_nMax.load(std::memory_order_relaxed);
+		s.dMean = s.nCount > 0 ? (double)m_nSum.load(std::memory_order_relaxed) / (double)s.nCount : 0.0;
+		s.dP50 = Percentile(nBucket, nTotal, 0.50, s.dMax);
+		s.dP99 = Percentile(nBucket, nTotal, 0.99, s.dMax);
+		return s;
+	}
+
+	// Any thread. The writer clears the histogram before its next record.
+	void Reset()
+	{
+		m_bReset.store(true, std::memory_order_release);
+	}
+
+private:
+	std::atomic<uint64_t> m_nBucket[BUCKETS];
+	std::atomic<uint64_t> m_nCount;
+	std::atomic<uint64_t> m_nSum;
+	std::atomic<uint64_t> m_nMax;
+	std::atomic<bool> m_bReset;
+
+	void Clear()
+	{
+		for (int i = 0; i < BUCKETS; i++)
+			m_nBucket[i].store(0, std::memory_order_relaxed);
+		m_nSum.store(0, std::memory_order_relaxed);
+		m_nMax.store(0, std::memory_order_relaxed);
+		m_nCount.store(0, std::memory_order_relaxed);
+		m_bReset.store(false, std::memory_order_release);
+	}
+
+	static int Bucket(uint64_t nValue)
+	{
+		if (nValue < 8)
+			return (int)nValue;
+
+		int nTop = 3;
+		while (nTop < 63 && (nValue >> (nTop + 1)) != 0)
+			nTop++;
+		return 8 + (nTop - 3) * 4 + (int)((nValue >> (nTop - 2)) & 3);
+	}
+
+	// Largest value that lands in bucket i
+	static double Top(int i)
+	{
+		if (i < 8)
+			return (double)i;
+
+		int nTop = 3 + (i - 8) / 4;
+		int nSub = (i - 8) % 4;
+		return (double)(4 + nSub + 1) * (double)(1ull << (nTop - 2)) - 1.0;
+	}
+
+	static double Percentile(const uint64_t* nBucket, uint64_t nTotal, double dFraction, double dMax)
+	{
+		if (nTotal == 0)
+			return 0.0;
+
+		uint64_t nRank = (uint64_t)(dFraction * (double)(nTotal - 1)) + 1;
+		uint64_t nSeen = 0;
+		for (int i = 0; i < BUCKETS; i++)
+		{
+			nSeen += nBucket[i];
+			if (nSeen >= nRank)
+				return Top(i) < dMax ? Top(i) : dMax;
+		}
+		return dMax;
+	}
+};
+
+
+// What the engine's main thread has seen since it started, or since the
+// last ResetStats(). Times are in microseconds.
+struct olcNoiseStats
+{
+	olcNoiseHistogram::Summary render;      // UserProcess of one block and conversion
+	olcNoiseHistogram::Summary wait;        // asleep waiting for a free block
+	olcNoiseHistogram::Summary available;   // blocks free each time the thread woke
+	double dDeadline;                       // playback length of one block
+	uint64_t nBlocks;                       // blocks rendered
+	uint64_t nLate;                         // blocks that took longer than dDeadline to render
+	uint64_t nXRuns;                        // device underruns, see olcAudioBackend::XRuns()
+
+	// One line per figure, for logs
+	void Print(std::wostream& os) const
+	{
+		os << L"blocks " << nBlocks << L", late " << nLate << L", xruns " << nXRuns << L", deadline " << dDeadline << L" us\n";
+		os << L"render us  p50 " << render.dP50 << L"  p99 " << render.dP99 << L"  max " << render.dMax << L"\n";
+		os << L"wait us    p50 " << wait.dP50 << L"  p99 " << wait.dP99 << L"  max " << wait.dMax << L"\n";
+		os << L"free blks  p50 " << available.dP50 << L"  p99 " << available.dP99 << L"  max " << available.dMax << L"\n";
+	}
+};
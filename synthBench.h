@@ -0,0 +1,90 @@
+#pragma once
+
+// Benchmark plumbing: a timer that repeats a piece of work until the
+// measurement is long enough to trust, and a flat table of results that
+// writes out as CSV or JSON for comparing runs between versions.
+
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace synth
+{
+   namespace bench
+   {
+      // One measurement. nParam is whatever the row varies over, voice
+      // count or sample rate, 0 when nothing does.
+      struct result
+      {
+         std::string group;
+         std::string name;
+         double nParam;
+         double dValue;
+         std::string unit;
+      };
+
+      // Seconds per call of f, the best of nRounds rounds. Each round
+      // repeats f until it has run for at least dMinSeconds, so short
+      // kernels are timed over many calls and one slow round (a page
+      // fault, a context switch) doesn't spoil the figure.
+      template<class F>
+      double seconds_per_call(F f, double dMinSeconds = 0.05, int nRounds = 3)
+      {
+         double dBest = 1e30;
+         for (int r = 0; r < nRounds; r++)
+         {
+            long nCalls = 0;
+            auto tp1 = std::chrono::steady_clock::now();
+            double dElapsed = 0.0;
+            do
+            {
+               f();
+               nCalls++;
+               dElapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - tp1).count();
+            } while (dElapsed < dMinSeconds);
+
+            double d = dElapsed / (double)nCalls;
+            if (d < dBest) dBest = d;
+         }
+         return dBest;
+      }
+
+      class report
+      {
+      public:
+         void add(const std::string& sGroup, const std::string& sName, double nParam, double dValue, const std::string& sUnit)
+         {
+            result r;
+            r.group = sGroup;
+            r.name = sName;
+            r.nParam = nParam;
+            r.dValue = dValue;
+            r.unit = sUnit;
+            vecResults.push_back(r);
+         }
+
+         void write_csv(std::ostream& os) const
+         {
+            os << "group,name,param,value,unit\n";
+            for (auto& r : vecResults)
+               os << r.group << ',' << r.name << ',' << r.nParam << ',' << r.dValue << ',' << r.unit << '\n';
+         }
+
+         void write_json(std::ostream& os) const
+         {
+            os << "[\n";
+            for (size_t i = 0; i < vecResults.size(); i++)
+            {
+               const result& r = vecResults[i];
+               os << "  { \"group\": \"" << r.group << "\", \"name\": \"" << r.name << "\", \"param\": " << r.nParam
+                  << ", \"value\": " << r.dValue << ", \"unit\": \"" << r.unit << "\" }"
+                  << (i + 1 < vecResults.size() ? ",\n" : "\n");
+            }
+            os << "]\n";
+         }
+
+         std::vector<result> vecResults;
+      };
+   }
+}
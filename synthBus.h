@@ -0,0 +1,90 @@
+#pragma once
+
+// Planar mix buses. Each channel is its own contiguous run of samples, so a
+// voice is rendered once and added to every channel it sounds in with the
+// block kernels. The buses are interleaved for the device once per block,
+// at the very end.
+
+#include <cmath>
+#include <vector>
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+namespace synth
+{
+   const int BUS_MAX_CHANNELS = 8;
+
+   struct bus
+   {
+      bus()
+      {
+         nChannels = 0;
+         nStride = 0;
+      }
+
+      // Room for nFrames in each of nChannels, up to BUS_MAX_CHANNELS.
+      // Only allocates when it grows.
+      void resize(int nChannels, int nFrames)
+      {
+         if (nChannels * nFrames > (int)vSamples.size())
+            vSamples.resize(nChannels * nFrames);
+         this->nChannels = nChannels;
+         nStride = nFrames;
+      }
+
+      FTYPE* plane(int c)
+      {
+         return vSamples.data() + c * nStride;
+      }
+
+      // The planes as an array, for interleave() and the block callbacks
+      FTYPE** planes()
+      {
+         for (int c = 0; c < nChannels; c++)
+            pPlane[c] = plane(c);
+         return pPlane;
+      }
+
+      void clear(int nFrom, int nTo)
+      {
+         for (int c = 0; c < nChannels; c++)
+            for (int i = nFrom; i < nTo; i++)
+               plane(c)[i] = 0.0;
+      }
+
+      int nChannels;
+      int nStride;
+      std::vector<FTYPE> vSamples;
+
+   private:
+      FTYPE* pPlane[BUS_MAX_CHANNELS];
+   };
+
+   // Equal power pan. dPan runs from -1, all in the first channel, to 1,
+   // all in the last, and a source sits between the two neighbouring
+   // channels nearest its position. Writes nChannels gains; mono is always
+   // 1 so a mono mix is not touched by panning.
+   inline void pan_gains(FTYPE dPan, int nChannels, FTYPE* pGains)
+   {
+      if (nChannels == 1)
+      {
+         pGains[0] = 1.0;
+         return;
+      }
+
+      for (int c = 0; c < nChannels; c++)
+         pGains[c] = 0.0;
+
+      FTYPE dPan01 = dPan < -1.0 ? (FTYPE)0.0 : dPan > 1.0 ? (FTYPE)1.0 : (FTYPE)((dPan + 1.0) * 0.5);
+      FTYPE dPosition = dPan01 * (FTYPE)(nChannels - 1);
+      int nLeft = (int)dPosition;
+      if (nLeft > nChannels - 2)
+         nLeft = nChannels - 2;
+
+      FTYPE dAngle = (dPosition - (FTYPE)nLeft) * (FTYPE)std::acos(0.0);   // 0..pi/2
+      pGains[nLeft] = std::cos(dAngle);
+      pGains[nLeft + 1] = std::sin(dAngle);
+   }
+}
@@ -0,0 +1,241 @@
+#pragma once
+
+// Envelopes. The time based amplitude() is the reference, the block renderer
+// uses the incremental state machine: each voice carries an envelope_state
+// that is advanced a block at a time.
+
+#include <cmath>
+
+#include "synthSimd.h"
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+namespace synth
+{
+   const int ENV_IDLE = 0;
+   const int ENV_ATTACK = 1;
+   const int ENV_DECAY = 2;
+   const int ENV_SUSTAIN = 3;
+   const int ENV_RELEASE = 4;
+
+   const int RAMP_LINEAR = 0;
+   const int RAMP_EXPONENTIAL = 1;
+
+   // Fraction of the distance still to go when an exponential stage ends
+   // (-60dB). The level then snaps to the target.
+   const double ENV_EXP_RESIDUAL = 0.001;
+
+   // Per voice envelope generator state
+   struct envelope_state
+   {
+      int nStage;
+      int nLeft;     // samples until the next stage
+      FTYPE dLevel;
+      FTYPE dStep;   // per sample increment (linear) or gap ratio (exponential)
+
+      envelope_state()
+      {
+         nStage = ENV_IDLE;
+         nLeft = 0;
+         dLevel = 0.0;
+         dStep = 0.0;
+      }
+   };
+
+   struct envelope
+   {
+      virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff) = 0;
+   };
+
+   struct envelope_adsr : public envelope
+   {
+      FTYPE dAttackTime;
+      FTYPE dDecayTime;
+      FTYPE dReleaseTime;
+      FTYPE dSustainAmplitude;
+      FTYPE dStartAmplitude;
+      int nCurve;
+
+      envelope_adsr()
+      {
+         dAttackTime = 0.1;
+         dDecayTime = 0.1;
+         dSustainAmplitude = 1.0;
+         dReleaseTime = 0.2;
+         dStartAmplitude = 1.0;
+         nCurve = RAMP_LINEAR;
+      }
+
+      virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff)
+      {
+         FTYPE dAmplitude = 0.0;
+         FTYPE dReleaseAmplitude = 0.0;
+
+         if (dTimeOn > dTimeOff)   // note is on
+         {
+            FTYPE dLifeTime = dTime - dTimeOn;
+
+				if (dLifeTime <= dAttackTime)
+					dAmplitude = (dLifeTime / dAttackTime) * dStartAmplitude;
+
+				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
+					dAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
+
+				if (dLifeTime > (dAttackTime + dDecayTime))
+					dAmplitude = dSustainAmplitude;
+
+         }
+         else  // note is off
+         {
+            FTYPE dLifeTime = dTimeOff - dTimeOn;
+
+				if (dLifeTime <= dAttackTime)
+					dReleaseAmplitude = (dLifeTime / dAttackTime) * dStartAmplitude;
+
+				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
+					dReleaseAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
+
+				if (dLifeTime > (dAttackTime + dDecayTime))
+					dReleaseAmplitude = dSustainAmplitude;
+
+				dAmplitude = ((dTime - dTimeOff) / dReleaseTime) * (0.0 - dReleaseAmplitude) + dReleaseAmplitude;
+         }
+
+         if (dAmplitude <= 0.000)
+            dAmplitude = 0.0;
+
+         return dAmplitude;
+      }
+
+      // Gate on, attack from wherever the level is now
+      void start(envelope_state& s, FTYPE dSampleRate) const
+      {
+         enter(s, ENV_ATTACK, dSampleRate);
+      }
+
+      // Gate off, release from wherever the level is now
+      void release(envelope_state& s, FTYPE dSampleRate) const
+      {
+         if (s.nStage != ENV_IDLE)
+            enter(s, ENV_RELEASE, dSampleRate);
+      }
+
+      // Release from full level, for audio that already carries the rest
+      // of the envelope, a pre-rendered one-shot
+      void fade(envelope_state& s, FTYPE dSampleRate) const
+      {
+         s.dLevel = 1.0;
+         enter(s, ENV_RELEASE, dSampleRate);
+      }
+
+      // Multiplies nFrames of pOutput by the envelope times dGain, advancing
+      // the state. Each stage within the block becomes one ramp segment, so
+      // the work per sample is a single vector multiply. Returns true once
+      // the envelope has gone idle, samples after that point are zeroed.
+      bool apply(envelope_state& s, FTYPE dSampleRate, FTYPE* pOutput, int nFrames, FTYPE dGain) const
+      {
+         const simd::kernels<FTYPE>& k = simd::active<FTYPE>();
+         int i = 0;
+         while (i < nFrames)
+         {
+            if (s.nStage == ENV_IDLE)
+            {
+               for (; i < nFrames; i++) pOutput[i] = 0.0;
+               return true;
+            }
+
+            // Sustain holds for as long as it takes, the others count down
+            int n = nFrames - i;
+            if (s.nStage != ENV_SUSTAIN && s.nLeft < n)
+               n = s.nLeft;
+
+            if (s.nStage == ENV_SUSTAIN || nCurve == RAMP_LINEAR)
+            {
+               k.ramp_multiply(pOutput + i, n, s.dLevel, s.dStep, dGain);
+               s.dLevel += s.dStep * (FTYPE)n;
+            }
+            else
+            {
+               // Exponential, closes a fixed fraction of the gap every sample
+               FTYPE dTarget = target(s.nStage);
+               for (int j = 0; j < n; j++)
+               {
+                  pOutput[i + j] *= dGain * s.dLevel;
+                  s.dLevel = dTarget + (s.dLevel - dTarget) * s.dStep;
+               }
+            }
+
+            i += n;
+            if (s.nStage != ENV_SUSTAIN)
+            {
+               s.nLeft -= n;
+               if (s.nLeft <= 0)
+               {
+                  s.dLevel = target(s.nStage);   // land exactly, whatever the curve
+                  enter(s, s.nStage + 1, dSampleRate);
+               }
+            }
+         }
+
+         return s.nStage == ENV_IDLE;
+      }
+
+   private:
+      FTYPE target(int nStage) const
+      {
+         return nStage == ENV_ATTACK ? dStartAmplitude : nStage == ENV_DECAY || nStage == ENV_SUSTAIN ? dSustainAmplitude : 0.0;
+      }
+
+      // Sets up the ramp for a stage. Zero length stages are skipped, and a
+      // silent sustain goes straight to idle, which ends the voice.
+      void enter(envelope_state& s, int nStage, FTYPE dSampleRate) const
+      {
+         for (;;)
+         {
+            s.nStage = nStage;
+            if (nStage == ENV_IDLE || nStage > ENV_RELEASE)
+            {
+               s.nStage = ENV_IDLE;
+               s.dLevel = 0.0;
+               s.dStep = 0.0;
+               return;
+            }
+
+            if (nStage == ENV_SUSTAIN)
+            {
+               s.dLevel = dSustainAmplitude;
+               s.dStep = 0.0;
+               if (dSustainAmplitude <= 0.0)
+               {
+                  nStage = ENV_IDLE;
+                  continue;
+               }
+               return;
+            }
+
+            FTYPE dTime = nStage == ENV_ATTACK ? dAttackTime : nStage == ENV_DECAY ? dDecayTime : dReleaseTime;
+            s.nLeft = (int)(dTime * dSampleRate + 0.5);
+            if (s.nLeft <= 0)
+            {
+               s.dLevel = target(nStage);
+               nStage = nStage + 1;
+               continue;
+            }
+
+            FTYPE dTarget = target(nStage);
+            if (nCurve == RAMP_LINEAR)
+               s.dStep = (dTarget - s.dLevel) / (FTYPE)s.nLeft;
+            else
+               s.dStep = exp(log(ENV_EXP_RESIDUAL) / (FTYPE)s.nLeft);   // gap left at the end of the stage
+            return;
+         }
+      }
+   };
+
+   inline FTYPE env(const FTYPE dTime, envelope& env, const FTYPE dTimeOn, const FTYPE dTimeOff)
+   {
+      return env.amplitude(dTime, dTimeOn, dTimeOff);
+   }
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace synth
+{
+   struct instrument_base;
+
+   const int EVENT_NOTE_ON = 0;
+   const int EVENT_NOTE_OFF = 1;
+
+   // note event, stamped with the sample it should take effect on
+   struct event
+   {
+      int type;
+      int id;
+      int velocity;   // 1..127, note on only
+      instrument_base *channel;
+      uint64_t nSample;
+
+      event()
+      {
+         type = EVENT_NOTE_ON;
+         id = 0;
+         velocity = 127;
+         channel = nullptr;
+         nSample = 0;
+      }
+   };
+
+   // Bounded single producer / single consumer ring. Neither side ever blocks,
+   // Push() simply fails when the ring is full. N must be a power of two.
+   template<class T, unsigned int N>
+   class spsc_queue
+   {
+      static_assert((N & (N - 1)) == 0, "spsc_queue size must be a power of two");
+
+   public:
+      spsc_queue()
+      {
+         nHead = 0;
+         nTail = 0;
+      }
+
+      // Producer side
+      bool Push(const T& item)
+      {
+         unsigned int h = nHead.load(std::memory_order_relaxed);
+         if (h - nTail.load(std::memory_order_acquire) == N)
+            return false;
+
+         buffer[h & (N - 1)] = item;
+         nHead.store(h + 1, std::memory_order_release);
+         return true;
+      }
+
+      // Consumer side, look at the oldest item without removing it
+      bool Peek(T& item) const
+      {
+         unsigned int t = nTail.load(std::memory_order_relaxed);
+         if (t == nHead.load(std::memory_order_acquire))
+            return false;
+
+         item = buffer[t & (N - 1)];
+         return true;
+      }
+
+      // Consumer side, discard the oldest item
+      void Pop()
+      {
+         nTail.store(nTail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+      }
+
+      unsigned int Size() const
+      {
+         return nHead.load(std::memory_order_acquire) - nTail.load(std::memory_order_acquire);
+      }
+
+   private:
+      T buffer[N];
+      std::atomic<unsigned int> nHead;
+      std::atomic<unsigned int> nTail;
+   };
+
+   typedef spsc_queue<event, 1024> event_queue;
+
+   // Maps wall time onto the render clock. The audio thread publishes the first
+   // sample of every block as it starts rendering it, the UI thread extrapolates
+   // from there. Published through a sequence counter so neither side locks.
+   class event_clock
+   {
+   public:
+      event_clock()
+      {
+         nSequence = 0;
+         nSample = 0;
+         nTicks = 0;
+      }
+
+      // Audio thread
+      void Publish(uint64_t nBlockStart)
+      {
+         int64_t t = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+
+         nSequence.fetch_add(1, std::memory_order_acq_rel);
+         nSample.store(nBlockStart, std::memory_order_relaxed);
+         nTicks.store(t, std::memory_order_relaxed);
+         nSequence.fetch_add(1, std::memory_order_release);
+      }
+
+      // Any thread. Estimated sample the renderer is at right now, plus a fixed
+      // schedule latency so the stamp always lands in a block not yet rendered.
+      uint64_t Now(unsigned int nSampleRate, unsigned int nLatency) const
+      {
+         uint32_t s0, s1;
+         uint64_t nBase;
+         int64_t nBaseTicks;
+         do
+         {
+            s0 = nSequence.load(std::memory_order_acquire);
+            nBase = nSample.load(std::memory_order_relaxed);
+            nBaseTicks = nTicks.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            s1 = nSequence.load(std::memory_order_relaxed);
+         } while (s0 != s1 || (s0 & 1));
+
+         int64_t t = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+
+         int64_t nElapsed = (t - nBaseTicks) * (int64_t)nSampleRate / 1000000000;
+         if (nElapsed < 0) nElapsed = 0;
+         if (nElapsed > nLatency) nElapsed = nLatency;   // renderer stalled, don't run ahead of it
+
+         return nBase + (uint64_t)nElapsed + nLatency;
+      }
+
+   private:
+      std::atomic<uint32_t> nSequence;
+      std::atomic<uint64_t> nSample;
+      std::atomic<int64_t> nTicks;
+   };
+}
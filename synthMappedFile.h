@@ -0,0 +1,185 @@
+#pragma once
+
+// Read only memory mapped files. Opening one costs the same whatever its
+// size, pages are read in by the OS as they are first touched. touch()
+// reads a range in ahead of time, so the audio thread doesn't take the
+// fault, and release() drops a range from this process's resident set
+// again; it stays in the OS file cache and comes back on the next touch.
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX   // std::min and std::max, not the macros
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace synth
+{
+   class mapped_file
+   {
+   public:
+      mapped_file()
+      {
+         pData = nullptr;
+         nSize = 0;
+#if defined(_WIN32)
+         hFile = INVALID_HANDLE_VALUE;
+         hMapping = NULL;
+#endif
+      }
+
+      ~mapped_file()
+      {
+         close();
+      }
+
+      mapped_file(const mapped_file&) = delete;
+      mapped_file& operator=(const mapped_file&) = delete;
+
+      bool open(const std::string& sFile)
+      {
+         close();
+#if defined(_WIN32)
+         hFile = CreateFileA(sFile.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+         if (hFile == INVALID_HANDLE_VALUE)
+            return false;
+
+         LARGE_INTEGER nLength;
+         if (!GetFileSizeEx(hFile, &nLength) || nLength.QuadPart == 0)
+         {
+            close();
+            return false;
+         }
+
+         hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+         if (hMapping == NULL)
+         {
+            close();
+            return false;
+         }
+
+         pData = (const unsigned char*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+         if (pData == nullptr)
+         {
+            close();
+            return false;
+         }
+         nSize = (size_t)nLength.QuadPart;
+#else
+         int fd = ::open(sFile.c_str(), O_RDONLY);
+         if (fd < 0)
+            return false;
+
+         struct stat st;
+         if (fstat(fd, &st) != 0 || st.st_size == 0)
+         {
+            ::close(fd);
+            return false;
+         }
+
+         void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         ::close(fd);   // the mapping keeps the file
+         if (p == MAP_FAILED)
+            return false;
+
+         pData = (const unsigned char*)p;
+         nSize = (size_t)st.st_size;
+#endif
+         return true;
+      }
+
+      void close()
+      {
+#if defined(_WIN32)
+         if (pData != nullptr) UnmapViewOfFile(pData);
+         if (hMapping != NULL) CloseHandle(hMapping);
+         if (hFile != INVALID_HANDLE_VALUE) CloseHandle(hFile);
+         hMapping = NULL;
+         hFile = INVALID_HANDLE_VALUE;
+#else
+         if (pData != nullptr) munmap((void*)pData, nSize);
+#endif
+         pData = nullptr;
+         nSize = 0;
+      }
+
+      const unsigned char* data() const
+      {
+         return pData;
+      }
+
+      size_t size() const
+      {
+         return nSize;
+      }
+
+      // Faults in nBytes from nOffset by reading a byte of every page
+      void touch(size_t nOffset, size_t nBytes) const
+      {
+         if (!clip(nOffset, nBytes))
+            return;
+#if !defined(_WIN32)
+         size_t nStart = nOffset & ~(page() - 1);
+         madvise((void*)(pData + nStart), nOffset + nBytes - nStart, MADV_WILLNEED);
+#endif
+         volatile unsigned char nSink = 0;
+         for (size_t i = 0; i < nBytes; i += page())
+            nSink += pData[nOffset + i];
+         nSink += pData[nOffset + nBytes - 1];
+      }
+
+      // Drops the whole pages inside nBytes from nOffset out of the
+      // resident set. Reading them again is always safe, just slower.
+      void release(size_t nOffset, size_t nBytes) const
+      {
+         if (!clip(nOffset, nBytes))
+            return;
+
+         size_t nStart = (nOffset + page() - 1) & ~(page() - 1);
+         size_t nEnd = (nOffset + nBytes) & ~(page() - 1);
+         if (nEnd <= nStart)
+            return;
+#if defined(_WIN32)
+         VirtualUnlock((void*)(pData + nStart), nEnd - nStart);   // on unlocked pages, trims them from the working set
+#else
+         madvise((void*)(pData + nStart), nEnd - nStart, MADV_DONTNEED);
+#endif
+      }
+
+      static size_t page()
+      {
+#if defined(_WIN32)
+         static const size_t nPage = []() { SYSTEM_INFO si; GetSystemInfo(&si); return (size_t)si.dwPageSize; }();
+#else
+         static const size_t nPage = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+         return nPage;
+      }
+
+   private:
+      const unsigned char* pData;
+      size_t nSize;
+#if defined(_WIN32)
+      HANDLE hFile;
+      HANDLE hMapping;
+#endif
+
+      bool clip(size_t nOffset, size_t& nBytes) const
+      {
+         if (pData == nullptr || nOffset >= nSize || nBytes == 0)
+            return false;
+         if (nBytes > nSize - nOffset)
+            nBytes = nSize - nOffset;
+         return true;
+      }
+   };
+}
@@ -0,0 +1,317 @@
+#pragma once
+
+// Standard MIDI Files. A file is parsed once into a flat array of note
+// events, every track merged into one sample ordered list with the tempo
+// map already applied, so playing it is a walk along the array. A cursor
+// hands each block the run of events that falls inside it, and seeks by
+// binary search.
+//
+// Formats 0 and 1 are read; the tracks of a format 2 file are played
+// together as if it were format 1. Only notes are kept, and the tempo
+// changes that place them.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "synthEvents.h"
+#include "synthMappedFile.h"
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+namespace synth
+{
+   // One note event of a score, on the output's sample clock
+   struct score_event
+   {
+      uint64_t nSample;
+      uint8_t nType;       // EVENT_NOTE_ON or EVENT_NOTE_OFF
+      uint8_t nChannel;    // MIDI channel, 0..15
+      uint8_t nNote;       // MIDI note number, 60 is middle C
+      uint8_t nVelocity;
+   };
+
+   class midi_score
+   {
+   public:
+      midi_score()
+      {
+         nLength = 0;
+         nTracks = 0;
+      }
+
+      // Reads a .mid file straight from its mapping, with its events
+      // placed for dSampleRate. On failure sError says why.
+      bool load(const std::string& sFile, FTYPE dSampleRate, std::string& sError)
+      {
+         mapped_file f;
+         if (!f.open(sFile))
+         {
+            sError = "can't open " + sFile;
+            return false;
+         }
+         return parse(f.data(), f.size(), dSampleRate, sError);
+      }
+
+      bool parse(const unsigned char* p, size_t nSize, FTYPE dSampleRate, std::string& sError)
+      {
+         vecEvents.clear();
+         nLength = 0;
+         nTracks = 0;
+
+         if (nSize < 14 || memcmp(p, "MThd", 4) != 0 || be(p + 4, 4) < 6)
+         {
+            sError = "not a MIDI file";
+            return false;
+         }
+
+         int nDivision = (int)be(p + 12, 2);
+         if (nDivision == 0)
+         {
+            sError = "division is 0";
+            return false;
+         }
+
+         // Each track's notes come out in tick order, one run after another
+         // in a single array, merged below. A note takes at least three
+         // bytes, which bounds how many there can be.
+         std::vector<score_event> vecNotes;
+         std::vector<size_t> vecRuns(1, 0);   // where each run starts, and the end
+         std::vector<std::pair<uint64_t, uint32_t>> vecTempo;   // tick, microseconds per quarter note
+         vecNotes.reserve(nSize / 3);
+         size_t nPos = 8 + be(p + 4, 4);
+         while (nPos + 8 <= nSize)
+         {
+            size_t nChunk = be(p + nPos + 4, 4);
+            if (nChunk > nSize - nPos - 8)
+               nChunk = nSize - nPos - 8;   // truncated, read what is there
+
+            if (memcmp(p + nPos, "MTrk", 4) == 0)
+            {
+               if (!track(p + nPos + 8, nChunk, vecNotes, vecTempo, sError))
+               {
+                  sError = "track " + std::to_string(nTracks) + ": " + sError;
+                  return false;
+               }
+               vecRuns.push_back(vecNotes.size());
+               nTracks++;
+            }
+            nPos += 8 + nChunk;
+         }
+
+         if (nTracks == 0)
+         {
+            sError = "no tracks";
+            return false;
+         }
+
+         // Pairwise merges back and forth between two buffers, earlier
+         // tracks first on a shared tick
+         auto earlier = [](const score_event& a, const score_event& b) { return a.nSample < b.nSample; };
+         std::vector<score_event> vecMerged(vecNotes.size());
+         while (vecRuns.size() > 2)
+         {
+            std::vector<size_t> vecNext(1, 0);
+            for (size_t r = 0; r + 1 < vecRuns.size(); r += 2)
+            {
+               size_t nMid = vecRuns[r + 1];
+               size_t nEnd = r + 2 < vecRuns.size() ? vecRuns[r + 2] : nMid;
+               std::merge(vecNotes.begin() + vecRuns[r], vecNotes.begin() + nMid, vecNotes.begin() + nMid, vecNotes.begin() + nEnd,
+                  vecMerged.begin() + vecRuns[r], earlier);
+               vecNext.push_back(nEnd);
+            }
+            vecNotes.swap(vecMerged);
+            vecRuns.swap(vecNext);
+         }
+         vecEvents.swap(vecNotes);
+
+         // Ticks to samples. SMPTE divisions are a fixed number of ticks a
+         // second, otherwise it is ticks per quarter note at the tempo in
+         // force, 120 bpm until the first change.
+         std::stable_sort(vecTempo.begin(), vecTempo.end(),
+            [](const std::pair<uint64_t, uint32_t>& a, const std::pair<uint64_t, uint32_t>& b) { return a.first < b.first; });
+
+         double dTickSeconds;
+         if (nDivision & 0x8000)
+         {
+            int nFrames = -(int)(int8_t)(nDivision >> 8);
+            double dFrames = nFrames == 29 ? 30000.0 / 1001.0 : (double)nFrames;
+            dTickSeconds = 1.0 / (dFrames * (double)(nDivision & 0xff));
+            vecTempo.clear();
+         }
+         else
+            dTickSeconds = 0.5 / (double)nDivision;
+
+         size_t nNextTempo = 0;
+         uint64_t nTempoTick = 0;      // where the tempo in force started
+         double dTempoSeconds = 0.0;
+         for (score_event& e : vecEvents)
+         {
+            uint64_t nTick = e.nSample;
+            while (nNextTempo < vecTempo.size() && vecTempo[nNextTempo].first <= nTick)
+            {
+               dTempoSeconds += (double)(vecTempo[nNextTempo].first - nTempoTick) * dTickSeconds;
+               nTempoTick = vecTempo[nNextTempo].first;
+               dTickSeconds = (double)vecTempo[nNextTempo].second * 1e-6 / (double)nDivision;
+               nNextTempo++;
+            }
+            e.nSample = (uint64_t)((dTempoSeconds + (double)(nTick - nTempoTick) * dTickSeconds) * dSampleRate + 0.5);
+         }
+
+         nLength = vecEvents.empty() ? 0 : vecEvents.back().nSample;
+         return true;
+      }
+
+      std::vector<score_event> vecEvents;   // sample order
+      uint64_t nLength;                     // sample of the last event
+      int nTracks;
+
+   private:
+      static uint32_t be(const unsigned char* p, int nBytes)
+      {
+         uint32_t n = 0;
+         for (int i = 0; i < nBytes; i++)
+            n = (n << 8) | p[i];
+         return n;
+      }
+
+      // One MTrk chunk. Notes go to vecNotes with their tick in nSample,
+      // tempo changes to vecTempo.
+      static bool track(const unsigned char* p, size_t nSize, std::vector<score_event>& vecNotes,
+         std::vector<std::pair<uint64_t, uint32_t>>& vecTempo, std::string& sError)
+      {
+         size_t i = 0;
+         uint64_t nTick = 0;
+         int nStatus = 0;   // running status
+
+         auto number = [&](uint32_t& n)
+         {
+            n = 0;
+            for (int b = 0; b < 4; b++)
+            {
+               if (i >= nSize) return false;
+               n = (n << 7) | (p[i] & 0x7f);
+               if (!(p[i++] & 0x80)) return true;
+            }
+            return false;
+         };
+
+         while (i < nSize)
+         {
+            uint32_t nDelta;
+            if (!number(nDelta))
+            {
+               sError = "bad delta time";
+               return false;
+            }
+            nTick += nDelta;
+
+            if (i >= nSize)
+               break;
+            if (p[i] & 0x80)
+               nStatus = p[i++];
+            else if (nStatus == 0)
+            {
+               sError = "data byte without a status";
+               return false;
+            }
+
+            if (nStatus == 0xff || nStatus == 0xf0 || nStatus == 0xf7)
+            {
+               int nMeta = nStatus == 0xff && i < nSize ? p[i++] : -1;
+               uint32_t nLength;
+               if (!number(nLength) || nLength > nSize - i)
+               {
+                  sError = "bad meta or sysex length";
+                  return false;
+               }
+
+               if (nMeta == 0x51 && nLength == 3)
+                  vecTempo.push_back(std::make_pair(nTick, be(p + i, 3)));
+               i += nLength;
+               nStatus = 0;   // running status doesn't carry over these
+               if (nMeta == 0x2f)
+                  break;      // end of track
+               continue;
+            }
+
+            int nKind = nStatus & 0xf0;
+            size_t nData = nKind == 0xc0 || nKind == 0xd0 ? 1 : 2;
+            if (nData > nSize - i)
+            {
+               sError = "truncated event";
+               return false;
+            }
+
+            if (nKind == 0x80 || nKind == 0x90)
+            {
+               score_event e;
+               e.nSample = nTick;
+               e.nType = (uint8_t)(nKind == 0x90 && p[i + 1] != 0 ? EVENT_NOTE_ON : EVENT_NOTE_OFF);
+               e.nChannel = (uint8_t)(nStatus & 0x0f);
+               e.nNote = p[i] & 0x7f;
+               e.nVelocity = p[i + 1] & 0x7f;
+               vecNotes.push_back(e);
+            }
+            i += nData;
+         }
+         return true;
+      }
+   };
+
+   // Where playback is in a score. take() is called once per render block
+   // with contiguous sample ranges; a range that doesn't start where the
+   // last one ended seeks first. Notes sounding across a seek are the
+   // caller's to stop.
+   class score_cursor
+   {
+   public:
+      score_cursor(const midi_score* pScore = nullptr)
+      {
+         this->pScore = pScore;
+         nNext = 0;
+         nExpected = 0;
+      }
+
+      // Next event is the first at or after nSample
+      void seek(uint64_t nSample)
+      {
+         const std::vector<score_event>& v = pScore->vecEvents;
+         nNext = std::lower_bound(v.begin(), v.end(), nSample,
+            [](const score_event& e, uint64_t n) { return e.nSample < n; }) - v.begin();
+         nExpected = nSample;
+      }
+
+      // The events in [nStart, nStart + nFrames), from pFirst on; returns
+      // how many, and moves past them
+      int take(uint64_t nStart, unsigned int nFrames, const score_event*& pFirst)
+      {
+         if (nStart != nExpected)
+            seek(nStart);
+
+         const std::vector<score_event>& v = pScore->vecEvents;
+         size_t nFrom = nNext;
+         while (nNext < v.size() && v[nNext].nSample < nStart + nFrames)
+            nNext++;
+
+         nExpected = nStart + nFrames;
+         pFirst = v.data() + nFrom;
+         return (int)(nNext - nFrom);
+      }
+
+      bool finished() const
+      {
+         return nNext >= pScore->vecEvents.size();
+      }
+
+   private:
+      const midi_score* pScore;
+      size_t nNext;
+      uint64_t nExpected;
+   };
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+// Noise sources. Replaces rand(), which is slow, shares one global state and
+// in most C runtimes takes a lock per call. A noise_state is a key and a
+// sample counter, white noise is a hash of the two, so any number of voices
+// can render on any number of threads and a given seed always gives the
+// same output.
+
+#include <atomic>
+#include <cstdint>
+
+#include "synthSimd.h"
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+namespace synth
+{
+   const int NOISE_WHITE = 0;
+   const int NOISE_PINK = 1;    // -3dB per octave
+   const int NOISE_BROWN = 2;   // -6dB per octave
+
+   struct noise_state
+   {
+      uint32_t nKey;
+      uint32_t nCounter;
+      FTYPE dPink[7];   // pink filter poles
+      FTYPE dBrown;     // brown integrator
+
+      noise_state()
+      {
+         nKey = 0;
+         nCounter = 0;
+         for (int i = 0; i < 7; i++) dPink[i] = 0.0;
+         dBrown = 0.0;
+      }
+   };
+
+   // Stream nStream of seed nSeed. splitmix64 finaliser, so neighbouring
+   // streams get unrelated keys.
+   inline noise_state noise_seed(uint64_t nSeed, uint64_t nStream = 0)
+   {
+      uint64_t z = nSeed + (nStream + 1) * 0x9e3779b97f4a7c15ull;
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+      z ^= z >> 31;
+
+      noise_state s;
+      s.nKey = (uint32_t)z;
+      s.nCounter = (uint32_t)(z >> 32);
+      return s;
+   }
+
+   // One white sample in [-1, 1), advances the stream
+   inline FTYPE noise_next(noise_state& s)
+   {
+      return (FTYPE)((double)(int32_t)simd::noise_hash(s.nCounter++, s.nKey) * simd::NOISE_SCALE);
+   }
+
+   // Adds dGain * noise to nFrames samples of pOutput. White noise goes
+   // straight through the vector kernel. Pink (Paul Kellet's filter) and
+   // brown (leaky integrator) shape it a chunk at a time, those filters are
+   // recursive so they run per sample, but without any calls.
+   inline void noise_block(FTYPE* pOutput, int nFrames, int nColour, FTYPE dGain, noise_state& s)
+   {
+      const simd::kernels<FTYPE>& k = simd::active<FTYPE>();
+
+      if (nColour == NOISE_WHITE)
+      {
+         k.noise_add(pOutput, nFrames, s.nCounter, s.nKey, dGain);
+         s.nCounter += (uint32_t)nFrames;
+         return;
+      }
+
+      const int nChunk = 64;
+      FTYPE white[nChunk];
+      for (int nDone = 0; nDone < nFrames; nDone += nChunk)
+      {
+         int n = nFrames - nDone < nChunk ? nFrames - nDone : nChunk;
+         for (int i = 0; i < n; i++) white[i] = 0.0;
+         k.noise_add(white, n, s.nCounter, s.nKey, 1.0);
+         s.nCounter += (uint32_t)n;
+
+         FTYPE* pOut = pOutput + nDone;
+         if (nColour == NOISE_PINK)
+         {
+            FTYPE* b = s.dPink;
+            for (int i = 0; i < n; i++)
+            {
+               FTYPE x = white[i];
+               b[0] = 0.99886 * b[0] + x * 0.0555179;
+               b[1] = 0.99332 * b[1] + x * 0.0750759;
+               b[2] = 0.96900 * b[2] + x * 0.1538520;
+               b[3] = 0.86650 * b[3] + x * 0.3104856;
+               b[4] = 0.55000 * b[4] + x * 0.5329522;
+               b[5] = -0.7616 * b[5] - x * 0.0168980;
+               FTYPE dPink = b[0] + b[1] + b[2] + b[3] + b[4] + b[5] + b[6] + x * 0.5362;
+               b[6] = x * 0.115926;
+               pOut[i] += dGain * dPink * 0.11;   // roughly unit peak
+            }
+         }
+         else
+         {
+            FTYPE dBrown = s.dBrown;
+            for (int i = 0; i < n; i++)
+            {
+               dBrown = (dBrown + 0.02 * white[i]) / 1.02;
+               pOut[i] += dGain * dBrown * 3.5;
+            }
+            s.dBrown = dBrown;
+         }
+      }
+   }
+
+   // Stream for callers that don't carry their own state, one per thread
+   inline noise_state& thread_noise()
+   {
+      static std::atomic<uint64_t> nThreads(0);
+      static thread_local noise_state s = noise_seed(0x5eed, nThreads++);
+      return s;
+   }
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+// Pre-rendered one-shots. An instrument whose hits always sound the same
+// for a given note can be rendered once per note and played back from
+// memory. Each note keeps a few takes rendered with different noise seeds,
+// and a hit picks one from its own noise key, so repeated hits still vary
+// and a given seed still gives the same mix. A hit decides on note on
+// whether it plays a take and which, and keeps to it for the whole note.
+// A note off fades the take out over the instrument's release. For the
+// drums, which release at once, that cuts the hit on the same sample the
+// synthesised note would stop; a longer release is close but not exact,
+// as the take keeps its own decay under the fade.
+//
+// The audio thread owns the installed takes. New ones are rendered on
+// another thread and handed over through a queue, the audio thread installs
+// them between blocks and hands the old ones back to be deleted. Voices
+// only keep a take number and a play position and look the take up every
+// block, so a rebuild is picked up mid note without anything dangling.
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "synthEvents.h"
+#include "synthTuning.h"
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+namespace synth
+{
+   struct oneshot_entry
+   {
+      int nId;
+      uint64_t nFingerprint;                  // what it was rendered from, see oneshot_cache::built()
+      std::vector<std::vector<FTYPE>> vTakes;
+   };
+
+   class oneshot_cache
+   {
+   public:
+      oneshot_cache(int nTakes = 4)
+      {
+         this->nTakes = nTakes;
+         for (int i = 0; i < TUNING_NOTES; i++)
+         {
+            vEntries[i] = nullptr;
+            vWanted[i] = false;
+            vBuilt[i] = 0;
+         }
+      }
+
+      ~oneshot_cache()
+      {
+         collect();
+         oneshot_entry* e;
+         while (queIncoming.Peek(e))
+         {
+            queIncoming.Pop();
+            delete e;
+         }
+         for (int i = 0; i < TUNING_NOTES; i++)
+            delete vEntries[i];
+      }
+
+      int takes() const
+      {
+         return nTakes;
+      }
+
+      // Audio thread, on note on. The take a hit of note nId with
+      // nVariation plays, or -1 when there is none yet, in which case the
+      // note is flagged for notes() and the caller synthesises it as usual.
+      int pick(int nId, uint32_t nVariation)
+      {
+         int i = slot(nId);
+         if (i < 0)
+            return -1;
+
+         const oneshot_entry* e = vEntries[i];
+         if (e == nullptr)
+         {
+            if (!vWanted[i].load(std::memory_order_relaxed))
+               vWanted[i].store(true, std::memory_order_relaxed);
+            return -1;
+         }
+         return (int)(nVariation % e->vTakes.size());
+      }
+
+      // Audio thread and render workers. Take nTake of note nId, as pick()
+      // gave it. Installed notes are only ever replaced, with as many takes.
+      const std::vector<FTYPE>* take(int nId, int nTake) const
+      {
+         const oneshot_entry* e = vEntries[slot(nId)];
+         return &e->vTakes[nTake % e->vTakes.size()];
+      }
+
+      // Audio thread, between blocks
+      void update()
+      {
+         oneshot_entry* e;
+         while (queIncoming.Peek(e))
+         {
+            queIncoming.Pop();
+            int i = slot(e->nId);
+            if (vEntries[i] != nullptr && !queRetired.Push(vEntries[i]))
+               delete vEntries[i];   // can't happen, retired is sized for everything in flight
+            vEntries[i] = e;
+         }
+      }
+
+      // Not the audio thread. Hands a freshly rendered note over, false if
+      // too many are already waiting; try again later.
+      bool publish(oneshot_entry* e)
+      {
+         collect();
+         if (slot(e->nId) < 0 || !queIncoming.Push(e))
+            return false;
+         vBuilt[slot(e->nId)] = e->nFingerprint;
+         return true;
+      }
+
+      // Not the audio thread. Notes that were asked for and aren't built,
+      // plus every note built so far, for checking against the instrument.
+      std::vector<int> notes()
+      {
+         std::vector<int> vNotes;
+         for (int i = 0; i < TUNING_NOTES; i++)
+            if (vBuilt[i] != 0 || vWanted[i].exchange(false, std::memory_order_relaxed))
+               vNotes.push_back(i + TUNING_LOWEST_NOTE);
+         return vNotes;
+      }
+
+      // Not the audio thread. Fingerprint note nId was last built from, 0
+      // if never.
+      uint64_t built(int nId) const
+      {
+         int i = slot(nId);
+         return i < 0 ? 0 : vBuilt[i];
+      }
+
+      void want(int nId)
+      {
+         int i = slot(nId);
+         if (i >= 0)
+            vWanted[i] = true;
+      }
+
+   private:
+      int nTakes;
+      oneshot_entry* vEntries[TUNING_NOTES];           // audio thread
+      std::atomic<bool> vWanted[TUNING_NOTES];         // set by the audio thread, cleared by notes()
+      uint64_t vBuilt[TUNING_NOTES];                   // publishing thread
+      spsc_queue<oneshot_entry*, 64> queIncoming;
+      spsc_queue<oneshot_entry*, 128> queRetired;
+
+      static int slot(int nId)
+      {
+         int i = nId - TUNING_LOWEST_NOTE;
+         return i >= 0 && i < TUNING_NOTES ? i : -1;
+      }
+
+      void collect()
+      {
+         oneshot_entry* e;
+         while (queRetired.Peek(e))
+         {
+            queRetired.Pop();
+            delete e;
+         }
+      }
+   };
+
+   // FNV-1a over raw bytes, for fingerprinting what a one-shot was rendered from
+   inline uint64_t fingerprint_add(uint64_t h, const void* p, size_t nBytes)
+   {
+      const unsigned char* b = (const unsigned char*)p;
+      for (size_t i = 0; i < nBytes; i++)
+         h = (h ^ b[i]) * 0x100000001b3ull;
+      return h;
+   }
+
+   const uint64_t FINGERPRINT_START = 0xcbf29ce484222325ull;
+}
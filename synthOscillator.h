@@ -0,0 +1,380 @@
+#pragma once
+
+// Oscillators. Expects FTYPE and PI from olcNoiseMaker.h.
+
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+#include <chrono>
+#include <ratio>
+
+#include "synthNoise.h"
+#include "synthSimd.h"
+
+namespace synth
+{
+   // converts freq to angular velocity
+   inline FTYPE w(FTYPE dHertz)
+   {
+      return dHertz * 2.0 * PI;
+   }
+
+   const int OSC_SINE = 0;
+   const int OSC_SQUARE = 1;
+   const int OSC_TRIANGLE = 2;
+   const int OSC_SAW_ANA = 3;
+   const int OSC_SAW_DIG = 4;
+   const int OSC_NOISE = 5;
+   const int OSC_SAW_BLEP = 6;      // band limited saw, O(1) per sample
+   const int OSC_SQUARE_BLEP = 7;   // band limited square
+   const int OSC_PULSE_BLEP = 8;    // band limited pulse, width set by dWidth
+   const int OSC_NOISE_PINK = 9;
+   const int OSC_NOISE_BROWN = 10;
+
+   // Stateless reference oscillator, evaluated from absolute time. Kept for
+   // comparing against the phase accumulator engine below, it is not used by
+   // the block renderer.
+   inline FTYPE osc(const FTYPE dHertz, const FTYPE dTime, const int nType = OSC_SINE,
+      const FTYPE dLFOHertz = 0.0, const FTYPE dLFOAmplitude = 0.0, FTYPE dCustom = 50.0)
+   {
+      FTYPE dFreq = w(dHertz) * dTime + dLFOAmplitude * dHertz * (sin(w(dLFOHertz) * dTime));
+
+      switch (nType)
+      {
+      case OSC_SINE:  // sin
+         return sin(dFreq);
+
+      case OSC_SQUARE:  // square
+         return sin(dFreq) > 0.0 ? 1.0 : -1.0;
+
+      case OSC_TRIANGLE:  // triangle
+         return asin(sin(dFreq) * (2.0 / PI));
+
+      case OSC_SAW_ANA:  // saw (analogue / warm / slow)
+      {
+         FTYPE dOutput = 0.0;
+
+         for (FTYPE n = 1.0; n < 10.0; n++)
+            dOutput += (sin(n * dFreq)) / n;
+
+         return dOutput * (2.0 / PI);
+      }
+
+      case OSC_SAW_DIG:  // saw (optimised / harsh / fast)
+      case OSC_SAW_BLEP: // needs a sample rate to band limit, reference is the naive shape
+         return (2.0 / PI) * (dHertz * PI * fmod(dTime, 1.0 / dHertz) - (PI / 2.0));
+
+      case OSC_SQUARE_BLEP:
+      case OSC_PULSE_BLEP:
+         return sin(dFreq) > 0.0 ? 1.0 : -1.0;
+
+      case OSC_NOISE:  // pseudo random noise
+         return noise_next(thread_noise());
+
+      case OSC_NOISE_PINK:
+      case OSC_NOISE_BROWN:
+      {
+         FTYPE dOutput = 0.0;
+         noise_block(&dOutput, 1, nType == OSC_NOISE_PINK ? NOISE_PINK : NOISE_BROWN, 1.0, thread_noise());
+         return dOutput;
+      }
+
+      default:
+         return 0.0;
+      }
+   }
+
+   // Band limited single cycle tables. Each shape has one table per octave,
+   // table L holds only the harmonics that stay below Nyquist for any
+   // phase increment up to (2^L / WAVETABLE_SIZE) cycles per sample, so the
+   // right table is picked once per block from the pitch alone.
+   const int WAVETABLE_SIZE = 2048;
+   const int WAVETABLE_LEVELS = 11;   // WAVETABLE_SIZE / 2 harmonics down to 1
+
+   struct wavetables
+   {
+      // [shape][level], two guard samples so interpolation never wraps
+      std::vector<FTYPE> table[4][WAVETABLE_LEVELS];
+
+      wavetables()
+      {
+         for (int nLevel = 0; nLevel < WAVETABLE_LEVELS; nLevel++)
+         {
+            int nHarmonics = (WAVETABLE_SIZE / 2) >> nLevel;
+            for (int s = 0; s < 4; s++)
+               table[s][nLevel].assign(WAVETABLE_SIZE + 2, 0.0);
+
+            for (int i = 0; i < WAVETABLE_SIZE + 2; i++)
+            {
+               double x = 2.0 * PI * (double)i / (double)WAVETABLE_SIZE;
+               double dSquare = 0.0, dTriangle = 0.0, dSaw = 0.0;
+
+               // sin(h * x) by recurrence, one sin/cos per sample instead of per harmonic
+               double dCos2 = 2.0 * cos(x), s0 = 0.0, s1 = sin(x);
+               for (int h = 1; h <= nHarmonics; h++)
+               {
+                  dSaw += s1 / h;
+                  if (h & 1)
+                  {
+                     dSquare += s1 / h;
+                     dTriangle += ((h & 2) ? -s1 : s1) / ((double)h * h);
+                  }
+
+                  double s2 = dCos2 * s1 - s0;
+                  s0 = s1;
+                  s1 = s2;
+               }
+
+               table[OSC_SINE][nLevel][i] = (FTYPE)sin(x);
+               table[OSC_SQUARE][nLevel][i] = (FTYPE)(dSquare * 4.0 / PI);
+               table[OSC_TRIANGLE][nLevel][i] = (FTYPE)(dTriangle * 8.0 / (PI * PI));
+               table[OSC_SAW_ANA][nLevel][i] = (FTYPE)(dSaw * 2.0 / PI);
+            }
+         }
+      }
+
+      // Table for a shape at a given increment in cycles per sample
+      const FTYPE* lookup(int nShape, FTYPE dIncrement) const
+      {
+         int nLevel = 0;
+         FTYPE dLimit = 1.0 / (FTYPE)WAVETABLE_SIZE;
+         while (nLevel < WAVETABLE_LEVELS - 1 && fabs(dIncrement) > dLimit)
+         {
+            dLimit *= 2.0;
+            nLevel++;
+         }
+         return table[nShape][nLevel].data();
+      }
+
+      // Built on first use, shared by every voice
+      static const wavetables& get()
+      {
+         static wavetables tables;
+         return tables;
+      }
+   };
+
+   // Linear interpolated read, dPhase in cycles [0, 1)
+   inline FTYPE wavetable_read(const FTYPE* pTable, FTYPE dPhase)
+   {
+      FTYPE dIndex = dPhase * (FTYPE)WAVETABLE_SIZE;
+      int i = (int)dIndex;
+      FTYPE dFrac = dIndex - (FTYPE)i;
+      return pTable[i] + (pTable[i + 1] - pTable[i]) * dFrac;
+   }
+
+   // Wraps a phase back into [0, 1). Normally it has just stepped past 1.0
+   // by less than a cycle, so the floor() is rarely reached.
+   inline FTYPE wrap_phase(FTYPE dPhase)
+   {
+      if (dPhase >= 1.0)
+      {
+         dPhase -= 1.0;
+         if (dPhase >= 1.0) dPhase -= floor(dPhase);
+      }
+      else if (dPhase < 0.0)
+      {
+         dPhase -= floor(dPhase);
+         if (dPhase >= 1.0) dPhase = 0.0;
+      }
+      return dPhase;
+   }
+
+   // Polynomial band limited step. Residual to add to a naive waveform at a
+   // discontinuity of height 2, t is the phase in cycles since the step and
+   // dt the phase increment. Non zero only within one sample of the edge.
+   inline FTYPE poly_blep(FTYPE t, FTYPE dt)
+   {
+      if (t < dt)
+      {
+         t /= dt;
+         return t + t - t * t - 1.0;
+      }
+      else if (t > 1.0 - dt)
+      {
+         t = (t - 1.0) / dt;
+         return t * t + t + t + 1.0;
+      }
+      return 0.0;
+   }
+
+   // Phase accumulator oscillator. Adds dGain * waveform to nFrames samples of
+   // pOutput, advancing dPhase (and dLFOPhase when an LFO is used). Phases are
+   // kept in cycles and wrapped every sample, so pitch does not depend on how
+   // long the engine has been running. The LFO is a vibrato with the same
+   // depth semantics as osc(). dWidth is the duty cycle of OSC_PULSE_BLEP.
+   // Noise draws from pNoise, or this thread's stream if there is none.
+   // The waveform is a template argument here, so the switch below folds
+   // away; osc_block() further down picks one at run time.
+   template<int nType>
+   inline void osc_block_t(FTYPE* pOutput, int nFrames, const FTYPE dHertz, const FTYPE dSampleRate,
+      FTYPE dGain, FTYPE& dPhase, FTYPE& dLFOPhase, const FTYPE dLFOHertz = 0.0, const FTYPE dLFOAmplitude = 0.0,
+      const FTYPE dWidth = 0.5, noise_state* pNoise = nullptr)
+   {
+      const wavetables& tables = wavetables::get();
+      FTYPE dIncrement = dHertz / dSampleRate;
+      FTYPE p = dPhase;
+
+      switch (nType)
+      {
+      case OSC_SINE:
+      case OSC_SQUARE:
+      case OSC_TRIANGLE:
+      case OSC_SAW_ANA:
+      {
+         FTYPE dDepth = dLFOAmplitude * dLFOHertz;
+         const FTYPE* pTable = tables.lookup(nType, dIncrement * (1.0 + fabs(dDepth)));
+
+         if (dDepth == 0.0)
+         {
+            // Fixed pitch, every sample's phase is known up front so the
+            // whole block goes through the vector kernels
+            const simd::kernels<FTYPE>& k = simd::active<FTYPE>();
+            if (nType == OSC_SINE)
+               k.sine_add(pOutput, nFrames, p, dIncrement, dGain);
+            else
+               k.table_add(pOutput, nFrames, pTable, WAVETABLE_SIZE, p, dIncrement, dGain);
+            p = wrap_phase(p + (FTYPE)nFrames * dIncrement);
+         }
+         else
+         {
+            const FTYPE* pSine = tables.table[OSC_SINE][0].data();
+            FTYPE dLFOIncrement = dLFOHertz / dSampleRate;
+            FTYPE q = dLFOPhase;
+            for (int i = 0; i < nFrames; i++)
+            {
+               pOutput[i] += dGain * wavetable_read(pTable, p);
+               FTYPE dCos = wavetable_read(pSine, wrap_phase(q + 0.25));
+               p = wrap_phase(p + dIncrement * (1.0 + dDepth * dCos));
+               q = wrap_phase(q + dLFOIncrement);
+            }
+            dLFOPhase = q;
+         }
+         break;
+      }
+
+      case OSC_SAW_DIG:   // naive ramp, harsh by design
+         for (int i = 0; i < nFrames; i++)
+         {
+            pOutput[i] += dGain * (2.0 * p - 1.0);
+            p = wrap_phase(p + dIncrement);
+         }
+         break;
+
+      case OSC_SAW_BLEP:
+      {
+         FTYPE dt = fabs(dIncrement);
+         for (int i = 0; i < nFrames; i++)
+         {
+            pOutput[i] += dGain * (2.0 * p - 1.0 - poly_blep(p, dt));
+            p = wrap_phase(p + dIncrement);
+         }
+         break;
+      }
+
+      case OSC_SQUARE_BLEP:
+      case OSC_PULSE_BLEP:
+      {
+         FTYPE dt = fabs(dIncrement);
+         FTYPE dDuty = nType == OSC_SQUARE_BLEP ? 0.5 : fmin(fmax(dWidth, dt), 1.0 - dt);
+         for (int i = 0; i < nFrames; i++)
+         {
+            FTYPE dNaive = p < dDuty ? 1.0 : -1.0;
+            pOutput[i] += dGain * (dNaive + poly_blep(p, dt) - poly_blep(wrap_phase(p + 1.0 - dDuty), dt));
+            p = wrap_phase(p + dIncrement);
+         }
+         break;
+      }
+
+      case OSC_NOISE:
+      case OSC_NOISE_PINK:
+      case OSC_NOISE_BROWN:
+         noise_block(pOutput, nFrames, nType == OSC_NOISE ? NOISE_WHITE : nType == OSC_NOISE_PINK ? NOISE_PINK : NOISE_BROWN,
+            dGain, pNoise ? *pNoise : thread_noise());
+         break;
+
+      default:
+         break;
+      }
+
+      dPhase = p;
+   }
+
+   inline void osc_block(FTYPE* pOutput, int nFrames, const int nType, const FTYPE dHertz, const FTYPE dSampleRate,
+      FTYPE dGain, FTYPE& dPhase, FTYPE& dLFOPhase, const FTYPE dLFOHertz = 0.0, const FTYPE dLFOAmplitude = 0.0,
+      const FTYPE dWidth = 0.5, noise_state* pNoise = nullptr)
+   {
+      switch (nType)
+      {
+      case OSC_SINE: osc_block_t<OSC_SINE>(pOutput, nFrames, dHertz, dSampleRate, dGain, dPhase, dLFOPhase, dLFOHertz, dLFOAmplitude, dWidth, pNoise); break;
+      case OSC_SQUARE: osc_block_t<OSC_SQUARE>(pOutput, nFrames, dHertz, dSampleRate, dGain, dPhase, dLFOPhase, dLFOHertz, dLFOAmplitude, dWidth, pNoise); break;
+      case OSC_TRIANGLE: osc_block_t<OSC_TRIANGLE>(pOutput, nFrames, dHertz, dSampleRate, dGain, dPhase, dLFOPhase, dLFOHertz, dLFOAmplitude, dWidth, pNoise); break;
+      case OSC_SAW_ANA: osc_block_t<OSC_SAW_ANA>(pOutput, nFrames, dHertz, dSampleRate, dGain, dPhase, dLFOPhase, dLFOHertz, dLFOAmplitude, dWidth, pNoise); break;
+      case OSC_SAW_DIG: osc_block_t<OSC_SAW_DIG>(pOutput, nFrames, dHertz, dSampleRate, dGain, dPhase, dLFOPhase, dLFOHertz, dLFOAmplitude, dWidth, pNoise); break;
+      case OSC_NOISE: osc_block_t<OSC_NOISE>(pOutput, nFrames, dHertz, dSampleRate, dGain, dPhase, dLFOPhase, dLFOHertz, dLFOAmplitude, dWidth, pNoise); break;
+      case OSC_SAW_BLEP: osc_block_t<OSC_SAW_BLEP>(pOutput, nFrames, dHertz, dSampleRate, dGain, dPhase, dLFOPhase, dLFOHertz, dLFOAmplitude, dWidth, pNoise); break;
+      case OSC_SQUARE_BLEP: osc_block_t<OSC_SQUARE_BLEP>(pOutput, nFrames, dHertz, dSampleRate, dGain, dPhase, dLFOPhase, dLFOHertz, dLFOAmplitude, dWidth, pNoise); break;
+      case OSC_PULSE_BLEP: osc_block_t<OSC_PULSE_BLEP>(pOutput, nFrames, dHertz, dSampleRate, dGain, dPhase, dLFOPhase, dLFOHertz, dLFOAmplitude, dWidth, pNoise); break;
+      case OSC_NOISE_PINK: osc_block_t<OSC_NOISE_PINK>(pOutput, nFrames, dHertz, dSampleRate, dGain, dPhase, dLFOPhase, dLFOHertz, dLFOAmplitude, dWidth, pNoise); break;
+      case OSC_NOISE_BROWN: osc_block_t<OSC_NOISE_BROWN>(pOutput, nFrames, dHertz, dSampleRate, dGain, dPhase, dLFOPhase, dLFOHertz, dLFOAmplitude, dWidth, pNoise); break;
+      default: break;
+      }
+   }
+
+   // One oscillator layer fixed at compile time, for instrument_graph:
+   // waveform, offset in scale steps from the note, gain, and vibrato rate
+   // and depth as in osc(). The numbers are std::ratio so they can be
+   // template arguments; ratio<1, 2> is 0.5.
+   template<int nType, int nOffset, class Gain = std::ratio<1>, class LFOHertz = std::ratio<0>, class LFODepth = std::ratio<0>>
+   struct static_layer
+   {
+      static const int type = nType;
+      static const int offset = nOffset;
+
+      // Adds the layer to pOutput, dHertz already includes the offset
+      static void render(FTYPE* pOutput, int nFrames, FTYPE dHertz, FTYPE dSampleRate, FTYPE& dPhase, FTYPE& dLFOPhase, noise_state* pNoise)
+      {
+         osc_block_t<nType>(pOutput, nFrames, dHertz, dSampleRate, value<Gain>(), dPhase, dLFOPhase,
+            value<LFOHertz>(), value<LFODepth>(), 0.5, pNoise);
+      }
+
+      template<class R>
+      static FTYPE value()
+      {
+         return (FTYPE)R::num / (FTYPE)R::den;
+      }
+   };
+
+   // Cost of one oscillator in ns per sample: the reference osc() when
+   // bReference is set, osc_block() otherwise. Renders dSeconds of a 440Hz
+   // tone in blocks of 256.
+   inline double measure_osc(int nType, bool bReference, FTYPE dSampleRate = 44100.0, FTYPE dSeconds = 2.0)
+   {
+      const int nBlock = 256;
+      FTYPE buffer[nBlock];
+      FTYPE dPhase = 0.0, dLFOPhase = 0.0, dSink = 0.0;
+      int nBlocks = (int)(dSeconds * dSampleRate) / nBlock;
+
+      wavetables::get();   // don't time the table build
+      auto tp1 = std::chrono::steady_clock::now();
+      for (int b = 0; b < nBlocks; b++)
+      {
+         if (bReference)
+         {
+            for (int i = 0; i < nBlock; i++)
+               buffer[i] = osc(440.0, (FTYPE)(b * nBlock + i) / dSampleRate, nType);
+         }
+         else
+         {
+            for (int i = 0; i < nBlock; i++) buffer[i] = 0.0;
+            osc_block(buffer, nBlock, nType, 440.0, dSampleRate, 1.0, dPhase, dLFOPhase);
+         }
+         dSink += buffer[b % nBlock];
+      }
+      auto tp2 = std::chrono::steady_clock::now();
+
+      volatile FTYPE dKeep = dSink;   // stop the loop being optimised away
+      (void)dKeep;
+      return std::chrono::duration<double, std::nano>(tp2 - tp1).count() / ((double)nBlocks * nBlock);
+   }
+}
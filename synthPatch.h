@@ -0,0 +1,361 @@
+#pragma once
+
+// Instruments from text patches. A patch is compiled once, when it is
+// loaded, into a flat list of block operations, and a small interpreter runs
+// that list over a voice's buffer a block at a time. Waveforms are resolved
+// to their specialised oscillator up front, so the interpreter's own cost is
+// one switch per operation per block.
+//
+// Patch files are line based, '#' starts a comment:
+//
+//    name      8-Bit Bell
+//    volume    1.0
+//    pan       0.4                 -1 left .. 1 right
+//    lifetime  3.0                 seconds, 0 or less lets the envelope decide
+//    envelope  attack 0.01 decay 0.5 sustain 0.8 release 1.0 curve linear
+//    osc       square offset 0 gain 1.0 lfo 5.0 0.001 width 0.5
+//    osc       sine offset 12 gain 0.5
+//    noise     white 0.05          white, pink or brown, then the gain
+//
+// Offsets are in scale steps from the note. There may be any number of
+// layers; every noise layer of a voice draws from the voice's noise stream.
+
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "synthEnvelope.h"
+#include "synthOscillator.h"
+#include "synthTuning.h"
+#include "synthVoicePool.h"
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+namespace synth
+{
+   const int PATCH_OP_CLEAR = 0;      // zero the voice buffer
+   const int PATCH_OP_OSC = 1;        // add one oscillator layer
+   const int PATCH_OP_ENVELOPE = 2;   // envelope times volume times velocity
+   const int PATCH_OP_LIFETIME = 3;   // finish the note after a fixed time
+
+   const int PATCH_OSC_SLOTS = 3;     // voice state per layer: phase, LFO phase, pitch
+
+   typedef void(*osc_block_function)(FTYPE*, int, FTYPE, FTYPE, FTYPE, FTYPE&, FTYPE&, FTYPE, FTYPE, FTYPE, noise_state*);
+
+   inline osc_block_function osc_block_for(int nType)
+   {
+      switch (nType)
+      {
+      case OSC_SINE: return osc_block_t<OSC_SINE>;
+      case OSC_SQUARE: return osc_block_t<OSC_SQUARE>;
+      case OSC_TRIANGLE: return osc_block_t<OSC_TRIANGLE>;
+      case OSC_SAW_ANA: return osc_block_t<OSC_SAW_ANA>;
+      case OSC_SAW_DIG: return osc_block_t<OSC_SAW_DIG>;
+      case OSC_NOISE: return osc_block_t<OSC_NOISE>;
+      case OSC_SAW_BLEP: return osc_block_t<OSC_SAW_BLEP>;
+      case OSC_SQUARE_BLEP: return osc_block_t<OSC_SQUARE_BLEP>;
+      case OSC_PULSE_BLEP: return osc_block_t<OSC_PULSE_BLEP>;
+      case OSC_NOISE_PINK: return osc_block_t<OSC_NOISE_PINK>;
+      case OSC_NOISE_BROWN: return osc_block_t<OSC_NOISE_BROWN>;
+      default: return nullptr;
+      }
+   }
+
+   struct patch_op
+   {
+      int nCode;
+      int nOffset;                // PATCH_OP_OSC, scale steps from the note
+      int nState;                 // PATCH_OP_OSC, first of its slots in the voice state
+      osc_block_function pOsc;
+      FTYPE dGain;
+      FTYPE dLFOHertz;
+      FTYPE dLFODepth;
+      FTYPE dWidth;
+   };
+
+   class patch_program
+   {
+   public:
+      patch_program()
+      {
+         sName = L"Patch";
+         dVolume = 1.0;
+         dPan = 0.0;
+         dLifeTime = -1.0;
+         nStride = 0;
+         nVoices = 0;
+      }
+
+      // Reads a patch file's text for compile(). On failure sError says why.
+      static bool read(const std::string& sFile, std::string& sText, std::string& sError)
+      {
+         std::ifstream f(sFile);
+         if (!f.is_open())
+         {
+            sError = "can't open " + sFile;
+            return false;
+         }
+
+         std::stringstream ss;
+         ss << f.rdbuf();
+         sText = ss.str();
+         return true;
+      }
+
+      // Compiles patch text for a voice pool of nMaxVoices
+      bool compile(const std::string& sText, int nMaxVoices, std::string& sError)
+      {
+         patch_program p;
+         std::vector<patch_op> vecLayers;
+
+         std::istringstream ssText(sText);
+         std::string sLine;
+         int nLine = 0;
+         while (getline(ssText, sLine))
+         {
+            nLine++;
+            sLine = sLine.substr(0, sLine.find('#'));
+            std::istringstream ss(sLine);
+            std::string sKey;
+            if (!(ss >> sKey))
+               continue;
+
+            auto fail = [&](const std::string& sWhat) { sError = "line " + std::to_string(nLine) + ": " + sWhat; return false; };
+            auto number = [&](FTYPE& d) { double x; if (!(ss >> x)) return false; d = (FTYPE)x; return true; };
+
+            if (sKey == "name")
+            {
+               std::string sRest;
+               getline(ss >> std::ws, sRest);
+               while (!sRest.empty() && (sRest.back() == ' ' || sRest.back() == '\t' || sRest.back() == '\r'))
+                  sRest.pop_back();
+               p.sName.assign(sRest.begin(), sRest.end());
+            }
+            else if (sKey == "volume")
+            {
+               if (!number(p.dVolume)) return fail("volume needs a number");
+            }
+            else if (sKey == "pan")
+            {
+               if (!number(p.dPan)) return fail("pan needs a number");
+            }
+            else if (sKey == "lifetime")
+            {
+               if (!number(p.dLifeTime)) return fail("lifetime needs a number");
+            }
+            else if (sKey == "envelope")
+            {
+               std::string sField;
+               while (ss >> sField)
+               {
+                  bool bOk = true;
+                  if (sField == "attack") bOk = number(p.env.dAttackTime);
+                  else if (sField == "decay") bOk = number(p.env.dDecayTime);
+                  else if (sField == "sustain") bOk = number(p.env.dSustainAmplitude);
+                  else if (sField == "release") bOk = number(p.env.dReleaseTime);
+                  else if (sField == "curve")
+                  {
+                     std::string sCurve;
+                     ss >> sCurve;
+                     if (sCurve == "linear") p.env.nCurve = RAMP_LINEAR;
+                     else if (sCurve == "exp") p.env.nCurve = RAMP_EXPONENTIAL;
+                     else return fail("curve is linear or exp");
+                  }
+                  else
+                     return fail("unknown envelope field " + sField);
+
+                  if (!bOk) return fail(sField + " needs a number");
+               }
+            }
+            else if (sKey == "osc" || sKey == "noise")
+            {
+               patch_op op;
+               op.nCode = PATCH_OP_OSC;
+               op.nOffset = 0;
+               op.nState = 0;
+               op.dGain = 1.0;
+               op.dLFOHertz = 0.0;
+               op.dLFODepth = 0.0;
+               op.dWidth = 0.5;
+
+               std::string sType;
+               ss >> sType;
+               int nType = sKey == "noise" ? noise_type(sType) : waveform(sType);
+               if (nType < 0)
+                  return fail("unknown " + sKey + " type '" + sType + "'");
+               op.pOsc = osc_block_for(nType);
+
+               if (sKey == "noise")
+               {
+                  if (!number(op.dGain)) return fail("noise needs a gain");
+               }
+               else
+               {
+                  std::string sField;
+                  while (ss >> sField)
+                  {
+                     bool bOk = true;
+                     if (sField == "offset") bOk = (bool)(ss >> op.nOffset);
+                     else if (sField == "gain") bOk = number(op.dGain);
+                     else if (sField == "width") bOk = number(op.dWidth);
+                     else if (sField == "lfo") bOk = number(op.dLFOHertz) && number(op.dLFODepth);
+                     else return fail("unknown osc field " + sField);
+
+                     if (!bOk) return fail(sField + " needs a value");
+                  }
+               }
+
+               vecLayers.push_back(op);
+            }
+            else
+               return fail("unknown keyword " + sKey);
+         }
+
+         if (vecLayers.empty())
+         {
+            sError = "no osc or noise layers";
+            return false;
+         }
+
+         // Layers one after another, then the envelope, then the life time
+         patch_op clear = patch_op();
+         clear.nCode = PATCH_OP_CLEAR;
+         p.vecCode.push_back(clear);
+
+         for (size_t l = 0; l < vecLayers.size(); l++)
+         {
+            vecLayers[l].nState = (int)l * PATCH_OSC_SLOTS;
+            p.vecCode.push_back(vecLayers[l]);
+         }
+
+         patch_op env = patch_op();
+         env.nCode = PATCH_OP_ENVELOPE;
+         p.vecCode.push_back(env);
+
+         if (p.dLifeTime > 0.0)
+         {
+            patch_op life = patch_op();
+            life.nCode = PATCH_OP_LIFETIME;
+            p.vecCode.push_back(life);
+         }
+
+         p.nStride = (int)vecLayers.size() * PATCH_OSC_SLOTS;
+         p.nVoices = nMaxVoices;
+         p.vState.assign((size_t)p.nStride * nMaxVoices, 0.0);
+
+         *this = std::move(p);
+         return true;
+      }
+
+      // Gate on for voice v: resets its layers and resolves their pitch
+      void note_on(voice_pool& voices, int v, const tuning& t, FTYPE dSampleRate)
+      {
+         FTYPE* s = state(v);
+         for (const patch_op& op : vecCode)
+            if (op.nCode == PATCH_OP_OSC)
+            {
+               s[op.nState] = 0.0;
+               s[op.nState + 1] = 0.0;
+               s[op.nState + 2] = t.hertz(voices.vId[v] + op.nOffset);
+            }
+
+         voices.vPan[v] = dPan;
+         env.start(voices.vEnv[v], dSampleRate);
+      }
+
+      void note_off(voice_pool& voices, int v, FTYPE dSampleRate)
+      {
+         env.release(voices.vEnv[v], dSampleRate);
+      }
+
+      // The interpreter. Renders nFrames of voice v into pOutput.
+      void render(voice_pool& voices, int v, FTYPE dTime, FTYPE dTimeStep, FTYPE* pOutput, int nFrames, bool& bNoteFinished)
+      {
+         FTYPE* s = state(v);
+         FTYPE dSampleRate = 1.0 / dTimeStep;
+
+         for (const patch_op& op : vecCode)
+         {
+            switch (op.nCode)
+            {
+            case PATCH_OP_CLEAR:
+               for (int i = 0; i < nFrames; i++) pOutput[i] = 0.0;
+               break;
+
+            case PATCH_OP_OSC:
+               op.pOsc(pOutput, nFrames, s[op.nState + 2], dSampleRate, op.dGain, s[op.nState], s[op.nState + 1],
+                  op.dLFOHertz, op.dLFODepth, op.dWidth, &voices.vNoise[v]);
+               break;
+
+            case PATCH_OP_ENVELOPE:
+               if (env.apply(voices.vEnv[v], dSampleRate, pOutput, nFrames, dVolume * voices.vVelocity[v]))
+                  bNoteFinished = true;
+               break;
+
+            case PATCH_OP_LIFETIME:
+               if (dTime + nFrames * dTimeStep - voices.vOn[v] >= dLifeTime)
+                  bNoteFinished = true;
+               break;
+            }
+         }
+      }
+
+      // Takes over the voices of pChannel that are sounding with program
+      // old: layers both programs have keep their phase, every layer gets
+      // its pitch from this program. Called on the audio thread when this
+      // program replaces old, allocates nothing.
+      void adopt(const patch_program& old, voice_pool& voices, const void* pChannel, const tuning& t)
+      {
+         int nShared = nStride < old.nStride ? nStride : old.nStride;
+         for (int i = 0; i < voices.nActive; i++)
+         {
+            int v = voices.vActiveList[i];
+            if (voices.vChannel[v] != pChannel || v >= nVoices || v >= old.nVoices)
+               continue;
+
+            FTYPE* s = state(v);
+            const FTYPE* o = old.vState.data() + (size_t)v * old.nStride;
+            for (int j = 0; j < nShared; j++)
+               s[j] = o[j];
+            for (const patch_op& op : vecCode)
+               if (op.nCode == PATCH_OP_OSC)
+                  s[op.nState + 2] = t.hertz(voices.vId[v] + op.nOffset);
+         }
+      }
+
+      std::wstring sName;
+      FTYPE dVolume;
+      FTYPE dPan;
+      FTYPE dLifeTime;
+      envelope_adsr env;
+      std::vector<patch_op> vecCode;
+      int nStride;                  // state slots per voice
+      int nVoices;
+      std::vector<FTYPE> vState;    // voice v's slots start at v * nStride
+
+   private:
+      FTYPE* state(int v)
+      {
+         return vState.data() + (size_t)v * nStride;
+      }
+
+      static int waveform(const std::string& s)
+      {
+         const char* sNames[] = { "sine", "square", "triangle", "saw_ana", "saw_dig", "noise", "saw_blep", "square_blep", "pulse_blep", "noise_pink", "noise_brown" };
+         for (int i = 0; i < (int)(sizeof(sNames) / sizeof(sNames[0])); i++)
+            if (s == sNames[i])
+               return i;
+         return -1;
+      }
+
+      static int noise_type(const std::string& s)
+      {
+         return s == "white" ? OSC_NOISE : s == "pink" ? OSC_NOISE_PINK : s == "brown" ? OSC_NOISE_BROWN : -1;
+      }
+   };
+}
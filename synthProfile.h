@@ -0,0 +1,91 @@
+#pragma once
+
+// Per instrument CPU accounting. Each block an instrument renders for one of
+// its voices is timed and added to the instrument's running totals, which
+// any thread can read while the render threads keep adding. Define
+// SYNTH_NO_PROFILE to compile the timers out; the totals then stay at zero.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace synth
+{
+   // Totals at one moment. Subtract two to get the figures for the time
+   // between them.
+   struct cost_reading
+   {
+      double dCpuSeconds;     // spent inside render()
+      double dVoiceSeconds;   // audio produced, summed over voices
+      uint64_t nBlocks;       // render() calls
+
+      cost_reading operator-(const cost_reading& r) const
+      {
+         cost_reading d;
+         d.dCpuSeconds = dCpuSeconds - r.dCpuSeconds;
+         d.dVoiceSeconds = dVoiceSeconds - r.dVoiceSeconds;
+         d.nBlocks = nBlocks - r.nBlocks;
+         return d;
+      }
+   };
+
+   class instrument_cost
+   {
+   public:
+      instrument_cost()
+      {
+         nNanoseconds = 0;
+         nVoiceFrames = 0;
+         nBlocks = 0;
+      }
+
+      // Render threads, any number at once
+      void add(uint64_t nTime, unsigned int nFrames)
+      {
+         nNanoseconds.fetch_add(nTime, std::memory_order_relaxed);
+         nVoiceFrames.fetch_add(nFrames, std::memory_order_relaxed);
+         nBlocks.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      // Any thread
+      cost_reading read(unsigned int nSampleRate) const
+      {
+         cost_reading r;
+         r.dCpuSeconds = (double)nNanoseconds.load(std::memory_order_relaxed) * 1e-9;
+         r.dVoiceSeconds = (double)nVoiceFrames.load(std::memory_order_relaxed) / (double)nSampleRate;
+         r.nBlocks = nBlocks.load(std::memory_order_relaxed);
+         return r;
+      }
+
+   private:
+      std::atomic<uint64_t> nNanoseconds;
+      std::atomic<uint64_t> nVoiceFrames;
+      std::atomic<uint64_t> nBlocks;
+   };
+
+   // Charges the time until the end of its scope to an instrument
+   class scoped_cost
+   {
+   public:
+#if !defined(SYNTH_NO_PROFILE)
+      scoped_cost(instrument_cost& c, unsigned int nFrames) : cost(c)
+      {
+         this->nFrames = nFrames;
+         tStart = std::chrono::steady_clock::now();
+      }
+
+      ~scoped_cost()
+      {
+         auto t = std::chrono::steady_clock::now() - tStart;
+         cost.add((uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(t).count(), nFrames);
+      }
+
+   private:
+      instrument_cost& cost;
+      unsigned int nFrames;
+      std::chrono::steady_clock::time_point tStart;
+#else
+      scoped_cost(instrument_cost&, unsigned int) {}
+#endif
+   };
+}
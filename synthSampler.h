@@ -0,0 +1,657 @@
+#pragma once
+
+// Instruments that play recordings. A kit maps WAV files into memory rather
+// than loading them, so opening a kit of any size takes about as long as
+// reading its headers. The start of every file is faulted in on load, so the
+// first hit doesn't wait on the disk, and a streaming thread reads ahead of
+// every playing voice while dropping what nothing has played for a while.
+// What stays resident is the heads plus a window per voice, not the kit.
+//
+// Kit files are line based, '#' starts a comment:
+//
+//    name      Piano
+//    volume    0.8
+//    pan       0.0                 -1 left .. 1 right
+//    envelope  attack 0.002 decay 0 sustain 1 release 0.3 curve linear
+//    head      0.25                seconds of every file faulted in on load
+//    readahead 0.5                 seconds streamed ahead of a playing voice
+//    zone      piano_c3.wav root 48 low 40 high 55 gain 1.0
+//    zone      piano_c4.wav root 60
+//
+// File names are relative to the kit. Notes are MIDI numbers, 60 is middle
+// C; the loader moves them to note ids. A zone plays its file at its own
+// pitch on note root, 60 if not given, and resamples it for the others. A
+// note goes to the zone with the nearest root among those whose low..high
+// holds it; without low and high a zone covers every note.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "synthEnvelope.h"
+#include "synthMappedFile.h"
+#include "synthTuning.h"
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+namespace synth
+{
+   const int SAMPLE_S16 = 0;
+   const int SAMPLE_S24 = 1;   // packed, three bytes
+   const int SAMPLE_S32 = 2;
+   const int SAMPLE_F32 = 3;
+
+   // A WAV file's audio, in place in its mapping
+   struct sample_data
+   {
+      const unsigned char* pFrames;
+      int64_t nFrames;
+      int nChannels;
+      int nFormat;
+      int nFrameBytes;
+      FTYPE dRate;
+      size_t nOffset;   // of the first frame in the file
+   };
+
+   inline uint32_t read_le(const unsigned char* p, int nBytes)
+   {
+      uint32_t n = 0;
+      for (int i = nBytes - 1; i >= 0; i--)
+         n = (n << 8) | p[i];
+      return n;
+   }
+
+   // Finds the format and audio of a WAV file: PCM at 16, 24 or 32 bits,
+   // or 32 bit float, either plain or WAVE_FORMAT_EXTENSIBLE
+   inline bool parse_wav(const unsigned char* p, size_t nSize, sample_data& s, std::string& sError)
+   {
+      if (nSize < 12 || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0)
+      {
+         sError = "not a WAV file";
+         return false;
+      }
+
+      int nTag = -1, nBits = 0;
+      s.pFrames = nullptr;
+      size_t nPos = 12;
+      while (nPos + 8 <= nSize)
+      {
+         size_t nChunk = read_le(p + nPos + 4, 4);
+         const unsigned char* pChunk = p + nPos + 8;
+         size_t nAvailable = nSize - nPos - 8;
+
+         if (memcmp(p + nPos, "fmt ", 4) == 0 && nChunk >= 16 && nAvailable >= 16)
+         {
+            nTag = (int)read_le(pChunk, 2);
+            s.nChannels = (int)read_le(pChunk + 2, 2);
+            s.dRate = (FTYPE)read_le(pChunk + 4, 4);
+            s.nFrameBytes = (int)read_le(pChunk + 12, 2);
+            nBits = (int)read_le(pChunk + 14, 2);
+            if (nTag == 0xfffe && nChunk >= 26 && nAvailable >= 26)
+               nTag = (int)read_le(pChunk + 24, 2);   // first two bytes of the sub format GUID
+         }
+         else if (memcmp(p + nPos, "data", 4) == 0)
+         {
+            s.pFrames = pChunk;
+            s.nOffset = nPos + 8;
+            if (nChunk > nAvailable)
+               nChunk = nAvailable;   // truncated, or a streamed header that never got its size
+            s.nFrames = nTag >= 0 && s.nFrameBytes > 0 ? (int64_t)(nChunk / s.nFrameBytes) : 0;
+            break;
+         }
+
+         nPos += 8 + nChunk + (nChunk & 1);
+      }
+
+      if (nTag < 0 || s.pFrames == nullptr)
+      {
+         sError = "no fmt or data chunk";
+         return false;
+      }
+
+      if (nTag == 1 && nBits == 16) s.nFormat = SAMPLE_S16;
+      else if (nTag == 1 && nBits == 24) s.nFormat = SAMPLE_S24;
+      else if (nTag == 1 && nBits == 32) s.nFormat = SAMPLE_S32;
+      else if (nTag == 3 && nBits == 32) s.nFormat = SAMPLE_F32;
+      else
+      {
+         sError = "unsupported format " + std::to_string(nTag) + " at " + std::to_string(nBits) + " bits";
+         return false;
+      }
+
+      if (s.nChannels < 1 || s.nFrameBytes != s.nChannels * nBits / 8 || s.dRate <= 0.0)
+      {
+         sError = "inconsistent fmt chunk";
+         return false;
+      }
+      return true;
+   }
+
+   template<int nFormat>
+   inline FTYPE sample_value(const unsigned char* p)
+   {
+      switch (nFormat)
+      {
+      case SAMPLE_S16: { int16_t n; memcpy(&n, p, 2); return (FTYPE)n * (FTYPE)(1.0 / 32768.0); }
+      case SAMPLE_S24: return (FTYPE)((int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24) >> 8) * (FTYPE)(1.0 / 8388608.0);
+      case SAMPLE_S32: { int32_t n; memcpy(&n, p, 4); return (FTYPE)n * (FTYPE)(1.0 / 2147483648.0); }
+      default: { float f; memcpy(&f, p, 4); return (FTYPE)f; }
+      }
+   }
+
+   // One frame as mono, the channels averaged
+   template<int nFormat>
+   inline FTYPE sample_mix(const unsigned char* p, int nChannels)
+   {
+      if (nChannels == 1)
+         return sample_value<nFormat>(p);
+
+      const int nBytes = nFormat == SAMPLE_S16 ? 2 : nFormat == SAMPLE_S24 ? 3 : 4;
+      FTYPE dSum = 0.0;
+      for (int c = 0; c < nChannels; c++)
+         dSum += sample_value<nFormat>(p + c * nBytes);
+      return dSum / (FTYPE)nChannels;
+   }
+
+   // The same, zero outside the file
+   template<int nFormat>
+   inline FTYPE sample_frame(const sample_data& s, int64_t nFrame)
+   {
+      if (nFrame < 0 || nFrame >= s.nFrames)
+         return 0.0;
+      return sample_mix<nFormat>(s.pFrames + nFrame * s.nFrameBytes, s.nChannels);
+   }
+
+   // Playback positions and rates are fixed point frames, 32.32, so
+   // stepping through the file is one integer add per sample
+   const int SAMPLE_FRACTION_BITS = 32;
+
+   inline uint64_t sample_fixed(double dFrames)
+   {
+      return (uint64_t)(dFrames * 4294967296.0 + 0.5);
+   }
+
+   // Plays s into pOutput from nPosition, moving nStep per output sample,
+   // with 4 point Hermite interpolation. Past the end the output is zero
+   // and it returns false.
+   template<int nFormat>
+   bool sample_play_t(const sample_data& s, uint64_t& nPosition, uint64_t nStep, FTYPE* pOutput, int nFrames)
+   {
+      const FTYPE dFraction = (FTYPE)(1.0 / 4294967296.0);
+      for (int i = 0; i < nFrames; i++, nPosition += nStep)
+      {
+         int64_t nFrame = (int64_t)(nPosition >> SAMPLE_FRACTION_BITS);
+         if (nFrame >= s.nFrames)
+         {
+            for (; i < nFrames; i++) pOutput[i] = 0.0;
+            return false;
+         }
+
+         // All four points inside the file, which is nearly always
+         FTYPE y0, y1, y2, y3;
+         if (nFrame >= 1 && nFrame + 2 < s.nFrames)
+         {
+            const unsigned char* p = s.pFrames + (nFrame - 1) * s.nFrameBytes;
+            y0 = sample_mix<nFormat>(p, s.nChannels);
+            y1 = sample_mix<nFormat>(p + s.nFrameBytes, s.nChannels);
+            y2 = sample_mix<nFormat>(p + 2 * s.nFrameBytes, s.nChannels);
+            y3 = sample_mix<nFormat>(p + 3 * s.nFrameBytes, s.nChannels);
+         }
+         else
+         {
+            y0 = sample_frame<nFormat>(s, nFrame - 1);
+            y1 = sample_frame<nFormat>(s, nFrame);
+            y2 = sample_frame<nFormat>(s, nFrame + 1);
+            y3 = sample_frame<nFormat>(s, nFrame + 2);
+         }
+         FTYPE t = (FTYPE)(uint32_t)nPosition * dFraction;
+
+         FTYPE c1 = (FTYPE)0.5 * (y2 - y0);
+         FTYPE c2 = y0 - (FTYPE)2.5 * y1 + (FTYPE)2.0 * y2 - (FTYPE)0.5 * y3;
+         FTYPE c3 = (FTYPE)0.5 * (y3 - y0) + (FTYPE)1.5 * (y1 - y2);
+         pOutput[i] = ((c3 * t + c2) * t + c1) * t + y1;
+      }
+      return (int64_t)(nPosition >> SAMPLE_FRACTION_BITS) < s.nFrames;
+   }
+
+   typedef bool(*sample_play_function)(const sample_data&, uint64_t&, uint64_t, FTYPE*, int);
+
+   inline sample_play_function sample_play_for(int nFormat)
+   {
+      switch (nFormat)
+      {
+      case SAMPLE_S16: return sample_play_t<SAMPLE_S16>;
+      case SAMPLE_S24: return sample_play_t<SAMPLE_S24>;
+      case SAMPLE_S32: return sample_play_t<SAMPLE_S32>;
+      case SAMPLE_F32: return sample_play_t<SAMPLE_F32>;
+      default: return nullptr;
+      }
+   }
+
+   // Streaming, at namespace scope like the other constants so passing
+   // one by reference doesn't need a definition somewhere
+   const size_t STREAM_CHUNK = 64 * 1024;   // what the streamer faults in and drops at a time
+   const int STREAM_PERIOD_MS = 5;
+   const uint32_t STREAM_LINGER = 200;      // periods a chunk stays after it was last wanted
+
+   struct sample_zone
+   {
+      int nSample;    // file it plays
+      int nRoot;      // note id the file plays at its own pitch
+      int nLow;
+      int nHigh;
+      FTYPE dGain;
+   };
+
+   class sampler
+   {
+   public:
+      sampler()
+      {
+         sName = L"Sampler";
+         dVolume = 1.0;
+         dPan = 0.0;
+         env.dAttackTime = 0.002;
+         env.dDecayTime = 0.0;
+         env.dSustainAmplitude = 1.0;
+         env.dReleaseTime = 0.3;
+         dHead = 0.25;
+         dReadAhead = 0.5;
+         nResident = 0;
+         bStop = false;
+         for (int i = 0; i < TUNING_NOTES; i++)
+            vZoneOf[i] = -1;
+      }
+
+      ~sampler()
+      {
+         stop();
+      }
+
+      sampler(const sampler&) = delete;
+      sampler& operator=(const sampler&) = delete;
+
+      // Reads a kit file and maps its samples, for a voice pool of
+      // nMaxVoices. Once only, before the kit plays.
+      bool load(const std::string& sFile, int nMaxVoices, std::string& sError)
+      {
+         std::ifstream f(sFile);
+         if (!f.is_open())
+         {
+            sError = "can't open " + sFile;
+            return false;
+         }
+
+         std::stringstream ss;
+         ss << f.rdbuf();
+         size_t nSlash = sFile.find_last_of("/\\");
+         return compile(ss.str(), nSlash == std::string::npos ? "" : sFile.substr(0, nSlash + 1), nMaxVoices, sError);
+      }
+
+      // Kit text, its file names relative to sDirectory
+      bool compile(const std::string& sText, const std::string& sDirectory, int nMaxVoices, std::string& sError)
+      {
+         stop();
+         vecSamples.clear();
+         vecZones.clear();
+         nResident = 0;
+
+         std::istringstream ssText(sText);
+         std::string sLine;
+         int nLine = 0;
+         while (getline(ssText, sLine))
+         {
+            nLine++;
+            sLine = sLine.substr(0, sLine.find('#'));
+            std::istringstream ss(sLine);
+            std::string sKey;
+            if (!(ss >> sKey))
+               continue;
+
+            auto fail = [&](const std::string& sWhat) { sError = "line " + std::to_string(nLine) + ": " + sWhat; return false; };
+            auto number = [&](FTYPE& d) { double x; if (!(ss >> x)) return false; d = (FTYPE)x; return true; };
+            auto note = [&](int& n) { if (!(ss >> n)) return false; n -= TUNING_MIDI_ZERO; return true; };   // MIDI number to note id
+
+            if (sKey == "name")
+            {
+               std::string sRest;
+               getline(ss >> std::ws, sRest);
+               while (!sRest.empty() && (sRest.back() == ' ' || sRest.back() == '\t' || sRest.back() == '\r'))
+                  sRest.pop_back();
+               sName.assign(sRest.begin(), sRest.end());
+            }
+            else if (sKey == "volume")
+            {
+               if (!number(dVolume)) return fail("volume needs a number");
+            }
+            else if (sKey == "pan")
+            {
+               if (!number(dPan)) return fail("pan needs a number");
+            }
+            else if (sKey == "head")
+            {
+               if (!number(dHead)) return fail("head needs a number");
+            }
+            else if (sKey == "readahead")
+            {
+               if (!number(dReadAhead)) return fail("readahead needs a number");
+            }
+            else if (sKey == "envelope")
+            {
+               std::string sField;
+               while (ss >> sField)
+               {
+                  bool bOk = true;
+                  if (sField == "attack") bOk = number(env.dAttackTime);
+                  else if (sField == "decay") bOk = number(env.dDecayTime);
+                  else if (sField == "sustain") bOk = number(env.dSustainAmplitude);
+                  else if (sField == "release") bOk = number(env.dReleaseTime);
+                  else if (sField == "curve")
+                  {
+                     std::string sCurve;
+                     ss >> sCurve;
+                     if (sCurve == "linear") env.nCurve = RAMP_LINEAR;
+                     else if (sCurve == "exp") env.nCurve = RAMP_EXPONENTIAL;
+                     else return fail("curve is linear or exp");
+                  }
+                  else
+                     return fail("unknown envelope field " + sField);
+
+                  if (!bOk) return fail(sField + " needs a number");
+               }
+            }
+            else if (sKey == "zone")
+            {
+               sample_zone z;
+               z.nRoot = 0;   // middle C
+               z.nLow = TUNING_LOWEST_NOTE;
+               z.nHigh = TUNING_LOWEST_NOTE + TUNING_NOTES - 1;
+               z.dGain = 1.0;
+
+               std::string sSample;
+               if (!(ss >> sSample))
+                  return fail("zone needs a file");
+
+               std::string sField;
+               while (ss >> sField)
+               {
+                  bool bOk = true;
+                  if (sField == "root") bOk = note(z.nRoot);
+                  else if (sField == "low") bOk = note(z.nLow);
+                  else if (sField == "high") bOk = note(z.nHigh);
+                  else if (sField == "gain") bOk = number(z.dGain);
+                  else return fail("unknown zone field " + sField);
+
+                  if (!bOk) return fail(sField + " needs a value");
+               }
+
+               // The same file in several zones is mapped once
+               z.nSample = -1;
+               for (size_t i = 0; i < vecSamples.size(); i++)
+                  if (vecSamples[i].sFile == sDirectory + sSample)
+                     z.nSample = (int)i;
+
+               if (z.nSample < 0)
+               {
+                  sample s;
+                  s.sFile = sDirectory + sSample;
+                  s.pFile.reset(new mapped_file());
+                  if (!s.pFile->open(s.sFile))
+                     return fail("can't map " + s.sFile);
+
+                  std::string sWhy;
+                  if (!parse_wav(s.pFile->data(), s.pFile->size(), s.data, sWhy))
+                     return fail(s.sFile + ": " + sWhy);
+
+                  s.pPlay = sample_play_for(s.data.nFormat);
+                  z.nSample = (int)vecSamples.size();
+                  vecSamples.push_back(std::move(s));
+               }
+
+               vecZones.push_back(z);
+            }
+            else
+               return fail("unknown keyword " + sKey);
+         }
+
+         if (vecZones.empty())
+         {
+            sError = "no zones";
+            return false;
+         }
+
+         // Nearest root among the zones that hold the note, looked up once here
+         for (int i = 0; i < TUNING_NOTES; i++)
+         {
+            int nId = i + TUNING_LOWEST_NOTE;
+            vZoneOf[i] = -1;
+            for (size_t z = 0; z < vecZones.size(); z++)
+            {
+               const sample_zone& zone = vecZones[z];
+               if (nId < zone.nLow || nId > zone.nHigh)
+                  continue;
+               if (vZoneOf[i] < 0 || std::abs(nId - zone.nRoot) < std::abs(nId - vecZones[vZoneOf[i]].nRoot))
+                  vZoneOf[i] = (int)z;
+            }
+         }
+
+         // The heads stay resident for good, everything after them is streamed
+         for (sample& s : vecSamples)
+         {
+            size_t nHead = s.data.nOffset + (size_t)(dHead * s.data.dRate) * s.data.nFrameBytes;
+            size_t nChunks = (s.pFile->size() + STREAM_CHUNK - 1) / STREAM_CHUNK;
+            s.nHeadChunks = (nHead + STREAM_CHUNK - 1) / STREAM_CHUNK;
+            if (s.nHeadChunks > nChunks)
+               s.nHeadChunks = nChunks;
+            s.vTouched.assign(nChunks, 0);
+
+            s.pFile->touch(0, s.nHeadChunks * STREAM_CHUNK);
+            nResident += s.nHeadChunks * STREAM_CHUNK < s.pFile->size() ? s.nHeadChunks * STREAM_CHUNK : s.pFile->size();
+         }
+
+         vVoices.assign(nMaxVoices, voice());
+         vPlaying.reset(new std::atomic<uint64_t>[nMaxVoices]);
+         for (int v = 0; v < nMaxVoices; v++)
+            vPlaying[v] = 0;
+         nVoices = nMaxVoices;
+
+         bStop = false;
+         thStream = std::thread(&sampler::stream, this);
+         return true;
+      }
+
+      // Audio thread. Picks voice v's zone and playback rate.
+      void note_on(int v, int nId, const tuning& t, FTYPE dSampleRate)
+      {
+         voice& vc = vVoices[v];
+         int i = nId - TUNING_LOWEST_NOTE;
+         vc.nZone = i >= 0 && i < TUNING_NOTES ? vZoneOf[i] : -1;
+         vc.nPosition = 0;
+         if (vc.nZone < 0)
+            return;
+
+         const sample_zone& z = vecZones[vc.nZone];
+         vc.nStep = sample_fixed((double)(t.hertz(nId) / t.hertz(z.nRoot) * vecSamples[z.nSample].data.dRate / dSampleRate));
+         publish(v);
+      }
+
+      // Audio thread and render workers. Voice v's next nFrames, before
+      // envelope and volume; finished at the end of its file.
+      void render(int v, FTYPE* pOutput, int nFrames, bool& bNoteFinished)
+      {
+         voice& vc = vVoices[v];
+         if (vc.nZone < 0)
+         {
+            for (int i = 0; i < nFrames; i++) pOutput[i] = 0.0;
+            bNoteFinished = true;
+            return;
+         }
+
+         const sample_zone& z = vecZones[vc.nZone];
+         const sample& s = vecSamples[z.nSample];
+         bool bPlaying = s.pPlay(s.data, vc.nPosition, vc.nStep, pOutput, nFrames);
+         if (z.dGain != 1.0)
+            for (int i = 0; i < nFrames; i++) pOutput[i] *= z.dGain;
+
+         if (bPlaying)
+            publish(v);
+         else
+         {
+            bNoteFinished = true;
+            finish(v);
+         }
+      }
+
+      // Voice v stopped for some other reason, nothing to stream for it
+      void finish(int v)
+      {
+         vPlaying[v].store(0, std::memory_order_relaxed);
+      }
+
+      size_t mapped_bytes() const
+      {
+         size_t n = 0;
+         for (const sample& s : vecSamples)
+            n += s.pFile->size();
+         return n;
+      }
+
+      // Bytes kept faulted in: the heads, plus what is streamed ahead of
+      // the playing voices and not yet dropped
+      size_t resident_bytes() const
+      {
+         return nResident;
+      }
+
+      size_t zones() const
+      {
+         return vecZones.size();
+      }
+
+      std::wstring sName;
+      FTYPE dVolume;
+      FTYPE dPan;
+      envelope_adsr env;
+      FTYPE dHead;          // seconds
+      FTYPE dReadAhead;     // seconds
+
+   private:
+      struct sample
+      {
+         std::string sFile;
+         std::unique_ptr<mapped_file> pFile;
+         sample_data data;
+         sample_play_function pPlay;
+         size_t nHeadChunks;
+         std::vector<uint32_t> vTouched;   // streamer: period each chunk was last wanted, 0 if not resident
+      };
+
+      struct voice
+      {
+         int nZone;
+         uint64_t nPosition;   // fixed point frames, see sample_fixed()
+         uint64_t nStep;
+      };
+
+      std::vector<sample> vecSamples;
+      std::vector<sample_zone> vecZones;
+      int vZoneOf[TUNING_NOTES];
+      std::vector<voice> vVoices;
+      int nVoices;
+
+      // Where each voice is, for the streamer: sample + 1 in the top 16
+      // bits, frame in the rest; 0 when it isn't playing
+      std::unique_ptr<std::atomic<uint64_t>[]> vPlaying;
+      std::thread thStream;
+      std::atomic<bool> bStop;
+      std::atomic<size_t> nResident;
+
+      void publish(int v)
+      {
+         const voice& vc = vVoices[v];
+         uint64_t nSample = (uint64_t)vecZones[vc.nZone].nSample + 1;
+         vPlaying[v].store(nSample << 48 | (vc.nPosition >> SAMPLE_FRACTION_BITS), std::memory_order_relaxed);
+      }
+
+      void stop()
+      {
+         bStop = true;
+         if (thStream.joinable())
+            thStream.join();
+      }
+
+      // Streaming thread. Faults in the chunks ahead of every playing voice
+      // and drops streamed chunks nothing has wanted for STREAM_LINGER
+      // periods. A voice whose position hasn't moved for that long is
+      // taken to be gone.
+      void stream()
+      {
+         std::vector<uint64_t> vLast(nVoices, 0);
+         std::vector<uint32_t> vMoved(nVoices, 0);
+         std::vector<std::pair<int, size_t>> vecStreamed;   // resident chunks past the heads
+         uint32_t nPeriod = 0;
+
+         while (!bStop)
+         {
+            nPeriod++;
+            for (int v = 0; v < nVoices; v++)
+            {
+               uint64_t nAt = vPlaying[v].load(std::memory_order_relaxed);
+               if (nAt != vLast[v])
+               {
+                  vLast[v] = nAt;
+                  vMoved[v] = nPeriod;
+               }
+               if (nAt == 0 || nPeriod - vMoved[v] > STREAM_LINGER)
+                  continue;
+
+               int nSample = (int)(nAt >> 48) - 1;
+               sample& s = vecSamples[nSample];
+               size_t nFrom = s.data.nOffset + (size_t)(nAt & 0xffffffffffffull) * s.data.nFrameBytes;
+               size_t nTo = nFrom + (size_t)(dReadAhead * s.data.dRate) * s.data.nFrameBytes;
+               for (size_t c = nFrom / STREAM_CHUNK; c <= nTo / STREAM_CHUNK && c < s.vTouched.size(); c++)
+               {
+                  if (c < s.nHeadChunks)
+                     continue;
+                  if (s.vTouched[c] == 0)
+                  {
+                     s.pFile->touch(c * STREAM_CHUNK, STREAM_CHUNK);
+                     vecStreamed.push_back(std::make_pair(nSample, c));
+                     nResident += STREAM_CHUNK;
+                  }
+                  s.vTouched[c] = nPeriod;
+               }
+            }
+
+            for (size_t i = 0; i < vecStreamed.size();)
+            {
+               sample& s = vecSamples[vecStreamed[i].first];
+               size_t c = vecStreamed[i].second;
+               if (nPeriod - s.vTouched[c] <= STREAM_LINGER)
+               {
+                  i++;
+                  continue;
+               }
+
+               s.pFile->release(c * STREAM_CHUNK, STREAM_CHUNK);
+               s.vTouched[c] = 0;
+               nResident -= STREAM_CHUNK;
+               vecStreamed[i] = vecStreamed.back();
+               vecStreamed.pop_back();
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(STREAM_PERIOD_MS));
+         }
+      }
+   };
+}
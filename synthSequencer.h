@@ -0,0 +1,435 @@
+#pragma once
+
+// Step sequencer. Patterns keep their triggers in a bitset, with note,
+// velocity and length stored once per trigger rather than once per step.
+// Channels play a chain of patterns of any length. The renderer asks for a
+// block's worth of events at a time; channels wait in a heap ordered by
+// their next trigger, so the cost of a block depends on how many notes it
+// holds, not on how many channels or steps there are.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "synthEvents.h"
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+namespace synth
+{
+   // Index of the lowest set bit, n must not be 0
+   inline int bit_scan(uint64_t n)
+   {
+#if defined(_MSC_VER) && defined(_M_X64)
+      unsigned long i;
+      _BitScanForward64(&i, n);
+      return (int)i;
+#elif defined(_MSC_VER)
+      unsigned long i;
+      if (_BitScanForward(&i, (unsigned long)n))
+         return (int)i;
+      _BitScanForward(&i, (unsigned long)(n >> 32));
+      return (int)i + 32;
+#else
+      return __builtin_ctzll(n);
+#endif
+   }
+
+   inline int bit_count(uint64_t n)
+   {
+#if defined(_MSC_VER)
+      return (int)__popcnt((unsigned int)n) + (int)__popcnt((unsigned int)(n >> 32));
+#else
+      return __builtin_popcountll(n);
+#endif
+   }
+
+   struct pattern
+   {
+      pattern(int nLength = 16)
+      {
+         nSteps = nLength;
+         vBits.assign((nLength + 63) / 64, 0);
+      }
+
+      // Puts a trigger on nStep, replacing any already there. nLength is
+      // in steps until the note off, 0 leaves the note to end by itself.
+      void set(int nStep, int nNote, int nVelocity = 127, int nLength = 0)
+      {
+         int r = rank(nStep);
+         if (has(nStep))
+         {
+            vNote[r] = (int16_t)nNote;
+            vVelocity[r] = (uint8_t)nVelocity;
+            vLength[r] = (uint16_t)nLength;
+            return;
+         }
+
+         vBits[nStep >> 6] |= 1ull << (nStep & 63);
+         vNote.insert(vNote.begin() + r, (int16_t)nNote);
+         vVelocity.insert(vVelocity.begin() + r, (uint8_t)nVelocity);
+         vLength.insert(vLength.begin() + r, (uint16_t)nLength);
+      }
+
+      void clear(int nStep)
+      {
+         if (!has(nStep))
+            return;
+
+         int r = rank(nStep);
+         vBits[nStep >> 6] &= ~(1ull << (nStep & 63));
+         vNote.erase(vNote.begin() + r);
+         vVelocity.erase(vVelocity.begin() + r);
+         vLength.erase(vLength.begin() + r);
+      }
+
+      bool has(int nStep) const
+      {
+         return (vBits[nStep >> 6] >> (nStep & 63)) & 1;
+      }
+
+      // Triggers before nStep, which is where nStep's data lives
+      int rank(int nStep) const
+      {
+         int r = 0;
+         for (int w = 0; w < (nStep >> 6); w++)
+            r += bit_count(vBits[w]);
+         if (nStep & 63)
+            r += bit_count(vBits[nStep >> 6] & ((1ull << (nStep & 63)) - 1));
+         return r;
+      }
+
+      // First trigger at or after nFrom, -1 if there is none
+      int next(int nFrom) const
+      {
+         if (nFrom >= nSteps)
+            return -1;
+
+         int w = nFrom >> 6;
+         uint64_t bits = vBits[w] & (~0ull << (nFrom & 63));
+         for (;;)
+         {
+            if (bits != 0)
+               return (w << 6) + bit_scan(bits);
+            if (++w >= (int)vBits.size())
+               return -1;
+            bits = vBits[w];
+         }
+      }
+
+      int triggers() const
+      {
+         return (int)vNote.size();
+      }
+
+      // 'X' marks a trigger, anything else a rest
+      static pattern parse(const std::wstring& sSteps, int nNote = 64, int nVelocity = 127, int nLength = 0)
+      {
+         pattern p((int)sSteps.size());
+         for (int s = 0; s < (int)sSteps.size(); s++)
+            if (sSteps[s] == L'X')
+               p.set(s, nNote, nVelocity, nLength);
+         return p;
+      }
+
+      std::wstring text() const
+      {
+         std::wstring s(nSteps, L'.');
+         for (int t = next(0); t >= 0; t = next(t + 1))
+            s[t] = L'X';
+         return s;
+      }
+
+      int nSteps;
+      std::vector<uint64_t> vBits;
+      std::vector<int16_t> vNote;        // per trigger, in step order
+      std::vector<uint8_t> vVelocity;
+      std::vector<uint16_t> vLength;
+   };
+
+   struct sequencer
+   {
+   public:
+      struct channel
+      {
+         instrument_base* instrument;
+         std::vector<int> vecChain;   // patterns, played in order
+         bool bLoop;                  // back to the start of the chain at the end
+
+         // Playback position
+         int nLink;
+         uint64_t nPatternStart;      // step the current pattern began on
+         int nTrigger;                // next trigger to play in it
+         int nTriggerStep;
+      };
+
+      // Pending note off
+      struct release
+      {
+         uint64_t nStep;
+         int nChannel;
+         int nNote;
+      };
+
+   public:
+      sequencer(float tempo = 120.0f, int beats = 4, int subbeats = 4)
+      {
+         nBeats = beats;
+         nSubBeats = subbeats;
+         fTempo = tempo;
+         fBeatTime = (60.0f / fTempo) / (float)nSubBeats;
+         nCurrentBeat = 0;
+         nTotalBeats = nSubBeats * nBeats;
+         nOrigin = 0;
+         bStarted = false;
+         nBlockFrames = 0;
+         nDropped = 0;
+      }
+
+      int AddPattern(const pattern& p)
+      {
+         vecPatterns.push_back(p);
+         return (int)vecPatterns.size() - 1;
+      }
+
+      // New channel with an empty chain, returns its index
+      int AddInstrument(instrument_base* inst, bool bLoop = true)
+      {
+         channel c;
+         c.instrument = inst;
+         c.bLoop = bLoop;
+         c.nLink = 0;
+         c.nPatternStart = 0;
+         c.nTrigger = 0;
+         c.nTriggerStep = 0;
+         vecChannel.push_back(c);
+         return (int)vecChannel.size() - 1;
+      }
+
+      // Appends pattern nPattern to channel nChannel's song
+      void Chain(int nChannel, int nPattern)
+      {
+         vecChannel[nChannel].vecChain.push_back(nPattern);
+      }
+
+      // Called by the renderer for every block. Collects the note ons and
+      // offs that fall in [nBlockStart, nBlockStart + nFrames) into
+      // vecEvents in sample order. Step k is at k * 60 / (tempo * subbeats)
+      // seconds from the first block, rounded to the nearest sample, so
+      // steps never drift whatever the block size.
+      int Schedule(uint64_t nBlockStart, unsigned int nFrames, unsigned int nSampleRate)
+      {
+         vecEvents.clear();
+
+         double dStepSamples = 60.0 / (double)fTempo / (double)nSubBeats * (double)nSampleRate;
+         if (!bStarted)
+            Start(nBlockStart);
+         if (nFrames > nBlockFrames)
+            Reserve(nFrames, dStepSamples);   // only if the block grew
+         uint64_t nBlockEnd = nBlockStart + nFrames;
+         auto sample = [&](uint64_t nStep) { return nOrigin + (uint64_t)((double)nStep * dStepSamples + 0.5); };
+         auto later = [](const heap_entry& a, const heap_entry& b) { return a.nStep > b.nStep || (a.nStep == b.nStep && a.nChannel > b.nChannel); };
+         auto later_release = [](const release& a, const release& b) { return a.nStep > b.nStep; };
+
+         for (;;)
+         {
+            bool bOn = !vecHeap.empty() && sample(vecHeap.front().nStep) < nBlockEnd;
+            bool bOff = !vecReleases.empty() && sample(vecReleases.front().nStep) < nBlockEnd;
+            if (!bOn && !bOff)
+               break;
+
+            // Offs first on a shared step, so a repeated note retriggers
+            if (bOff && (!bOn || vecReleases.front().nStep <= vecHeap.front().nStep))
+            {
+               std::pop_heap(vecReleases.begin(), vecReleases.end(), later_release);
+               release r = vecReleases.back();
+               vecReleases.pop_back();
+
+               event e;
+               e.type = EVENT_NOTE_OFF;
+               e.id = r.nNote;
+               e.channel = vecChannel[r.nChannel].instrument;
+               e.nSample = std::max(sample(r.nStep), nBlockStart);
+               if (vecEvents.size() < vecEvents.capacity())
+                  vecEvents.push_back(e);
+               else
+                  nDropped++;
+               continue;
+            }
+
+            std::pop_heap(vecHeap.begin(), vecHeap.end(), later);
+            heap_entry h = vecHeap.back();
+            vecHeap.pop_back();
+
+            channel& c = vecChannel[h.nChannel];
+            const pattern& p = vecPatterns[c.vecChain[c.nLink]];
+
+            event e;
+            e.type = EVENT_NOTE_ON;
+            e.id = p.vNote[c.nTrigger];
+            e.velocity = p.vVelocity[c.nTrigger];
+            e.channel = c.instrument;
+            e.nSample = std::max(sample(h.nStep), nBlockStart);
+            // A note that can't have its release is dropped whole rather
+            // than left hanging
+            bool bHold = p.vLength[c.nTrigger] > 0;
+            if (vecEvents.size() == vecEvents.capacity() || (bHold && vecReleases.size() == vecReleases.capacity()))
+               nDropped++;
+            else
+            {
+               vecEvents.push_back(e);
+               if (bHold)
+               {
+                  release r;
+                  r.nStep = h.nStep + p.vLength[c.nTrigger];
+                  r.nChannel = h.nChannel;
+                  r.nNote = e.id;
+                  vecReleases.push_back(r);
+                  std::push_heap(vecReleases.begin(), vecReleases.end(), later_release);
+               }
+            }
+
+            c.nTrigger++;
+            if (Advance(c, c.nTriggerStep + 1))
+            {
+               vecHeap.push_back({ c.nPatternStart + (uint64_t)c.nTriggerStep, h.nChannel });
+               std::push_heap(vecHeap.begin(), vecHeap.end(), later);
+            }
+         }
+
+         // Step under the end of the block, for the display
+         if (nBlockEnd > nOrigin)
+            nCurrentBeat = (int)((uint64_t)((double)(nBlockEnd - 1 - nOrigin) / dStepSamples) % (uint64_t)nTotalBeats);
+
+         return (int)vecEvents.size();
+      }
+
+   public:
+      int nBeats;
+      int nSubBeats;
+      FTYPE fTempo;
+      FTYPE fBeatTime;
+      std::atomic<int> nCurrentBeat;   // written by the renderer, drawn by the UI
+      int nTotalBeats;
+      int nDropped;                    // events past the capacity Start() worked out, only if patterns change while playing
+
+   public:
+      std::vector<pattern> vecPatterns;
+      std::vector<channel> vecChannel;
+      std::vector<event> vecEvents;
+
+   private:
+      struct heap_entry
+      {
+         uint64_t nStep;
+         int nChannel;
+      };
+
+      std::vector<heap_entry> vecHeap;     // channels by next trigger, earliest on top
+      std::vector<release> vecReleases;    // note offs by step, earliest on top
+      uint64_t nOrigin;
+      bool bStarted;
+      unsigned int nBlockFrames;           // largest block sized for
+
+      // Moves c to its first trigger at or after nFrom in the current
+      // pattern, following the chain. False when the song has ended, or
+      // has no triggers at all.
+      bool Advance(channel& c, int nFrom)
+      {
+         int nEmpty = 0;
+         for (;;)
+         {
+            const pattern& p = vecPatterns[c.vecChain[c.nLink]];
+            int t = p.next(nFrom);
+            if (t >= 0)
+            {
+               c.nTriggerStep = t;
+               return true;
+            }
+
+            if (++nEmpty > (int)c.vecChain.size())
+               return false;
+
+            c.nPatternStart += (uint64_t)p.nSteps;
+            c.nTrigger = 0;
+            nFrom = 0;
+            if (++c.nLink >= (int)c.vecChain.size())
+            {
+               if (!c.bLoop)
+                  return false;
+               c.nLink = 0;
+            }
+         }
+      }
+
+      // Most releases a channel can have pending at once. Its triggers sit
+      // on distinct steps and a release is pending for at most the longest
+      // length in its chain, so it is the most triggers any window of that
+      // many steps can hold.
+      int Pending(const channel& c) const
+      {
+         int nLongest = 0, nTriggers = 0, nSteps = 0;
+         for (int n : c.vecChain)
+         {
+            const pattern& p = vecPatterns[n];
+            for (uint16_t l : p.vLength)
+               nLongest = std::max(nLongest, (int)l);
+            nTriggers += p.triggers();
+            nSteps += p.nSteps;
+         }
+
+         if (nLongest == 0 || nSteps == 0)
+            return 0;
+         int nLoops = c.bLoop ? nLongest / nSteps + 1 : 1;
+         return std::min(nLongest, nTriggers * nLoops);
+      }
+
+      // Sizes the event list for blocks of up to nFrames. Every channel can
+      // trigger at most once a step, and every pending release can fall due.
+      void Reserve(unsigned int nFrames, double dStepSamples)
+      {
+         size_t nSteps = (size_t)((double)nFrames / dStepSamples) + 2;
+         vecEvents.reserve(vecChannel.size() * nSteps + vecReleases.capacity());
+         nBlockFrames = nFrames;
+      }
+
+      // Everything is sized here, so Schedule() doesn't allocate
+      void Start(uint64_t nBlockStart)
+      {
+         nOrigin = nBlockStart;
+         bStarted = true;
+
+         size_t nPending = 0;
+         for (const channel& c : vecChannel)
+            nPending += (size_t)Pending(c);
+
+         vecHeap.clear();
+         vecHeap.reserve(vecChannel.size());
+         vecReleases.clear();
+         vecReleases.reserve(nPending);
+         nBlockFrames = 0;
+
+         auto later = [](const heap_entry& a, const heap_entry& b) { return a.nStep > b.nStep || (a.nStep == b.nStep && a.nChannel > b.nChannel); };
+         for (int i = 0; i < (int)vecChannel.size(); i++)
+         {
+            channel& c = vecChannel[i];
+            c.nLink = 0;
+            c.nPatternStart = 0;
+            c.nTrigger = 0;
+            if (!c.vecChain.empty() && Advance(c, 0))
+            {
+               vecHeap.push_back({ c.nPatternStart + (uint64_t)c.nTriggerStep, i });
+               std::push_heap(vecHeap.begin(), vecHeap.end(), later);
+            }
+         }
+      }
+   };
+}
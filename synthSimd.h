@@ -0,0 +1,1387 @@
+#pragma once
+
+// Vectorised block kernels. Every kernel has a portable scalar version and,
+// on x86, SSE2 and AVX2 versions chosen once at run time from what the CPU
+// supports. The vector versions perform the same operations in the same
+// order as the scalar ones (no FMA contraction), so they agree to within
+// rounding of the sine polynomial. selftest() checks that.
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SYNTH_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define SYNTH_TARGET_AVX2
+#else
+#define SYNTH_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace synth
+{
+   namespace simd
+   {
+      const int ISA_SCALAR = 0;
+      const int ISA_SSE2 = 1;
+      const int ISA_AVX2 = 2;
+
+      // Adds 2^52 + 2^51 and takes it away again, which rounds to the nearest
+      // integer under the default rounding mode. Used by every path so they
+      // agree; relies on IEEE arithmetic, so don't build with fast-math.
+      const double ROUND_MAGIC = 6755399441055744.0;
+
+      // sin(2 pi x) Taylor terms, |2 pi x| <= pi / 2 after folding
+      const double SIN_C1 = 6.283185307179586;
+      const double SIN_C3 = -1.0 / 6.0;
+      const double SIN_C5 = 1.0 / 120.0;
+      const double SIN_C7 = -1.0 / 5040.0;
+      const double SIN_C9 = 1.0 / 362880.0;
+      const double SIN_C11 = -1.0 / 39916800.0;
+      const double SIN_C13 = 1.0 / 6227020800.0;
+
+      // Noise hash constants. The counter is spread with the golden ratio
+      // before mixing, so streams with different keys don't line up.
+      const uint32_t NOISE_WEYL = 0x9e3779b9u;
+      const uint32_t NOISE_M1 = 0x7feb352du;
+      const uint32_t NOISE_M2 = 0x846ca68bu;
+      const double NOISE_SCALE = 1.0 / 2147483648.0;
+
+      // Highest instruction set both the build and the CPU support
+      inline int detect()
+      {
+#if defined(SYNTH_SIMD_X86)
+#if defined(_MSC_VER)
+         int info[4];
+         __cpuid(info, 0);
+         int nIds = info[0];
+         if (nIds >= 7)
+         {
+            __cpuid(info, 1);
+            bool bOSXSave = (info[2] & (1 << 27)) != 0;
+            bool bAVX = (info[2] & (1 << 28)) != 0;
+            __cpuidex(info, 7, 0);
+            bool bAVX2 = (info[1] & (1 << 5)) != 0;
+            if (bOSXSave && bAVX && bAVX2 && (_xgetbv(0) & 6) == 6)
+               return ISA_AVX2;
+         }
+         return ISA_SSE2;
+#else
+         __builtin_cpu_init();
+         if (__builtin_cpu_supports("avx2"))
+            return ISA_AVX2;
+         if (__builtin_cpu_supports("sse2"))
+            return ISA_SSE2;
+         return ISA_SCALAR;
+#endif
+#else
+         return ISA_SCALAR;
+#endif
+      }
+
+      // ------------------------------------------------------------------
+      // Scalar kernels, for any sample type
+      // ------------------------------------------------------------------
+      template<class T>
+      inline T round_scalar(T x)
+      {
+         double r = (double)x + ROUND_MAGIC;
+         return (T)(r - ROUND_MAGIC);
+      }
+
+      // sin(2 pi p) for any p
+      template<class T>
+      inline T sine_scalar(T p)
+      {
+         double x = (double)p - (double)round_scalar(p);   // [-0.5, 0.5]
+         double a = fabs(x);
+         double b = 0.5 - a;
+         a = b < a ? b : a;                                   // fold to [0, 0.25]
+         x = x < 0.0 ? -a : a;
+
+         double y = x * SIN_C1;
+         double y2 = y * y;
+         double r = SIN_C13;
+         r = r * y2 + SIN_C11;
+         r = r * y2 + SIN_C9;
+         r = r * y2 + SIN_C7;
+         r = r * y2 + SIN_C5;
+         r = r * y2 + SIN_C3;
+         r = r * y2;
+         return (T)(y + y * r);
+      }
+
+      // pOut[i] += g * sin(2 pi (p + i * inc))
+      template<class T>
+      void sine_add_scalar(T* pOut, int n, double dPhase, double dIncrement, T dGain)
+      {
+         for (int i = 0; i < n; i++)
+            pOut[i] += dGain * (T)sine_scalar<double>(dPhase + (double)i * dIncrement);
+      }
+
+      // pOut[i] += g * table(p + i * inc), linear interpolation, nSize a power of two
+      template<class T>
+      void table_add_scalar(T* pOut, int n, const T* pTable, int nSize, double dPhase, double dIncrement, T dGain)
+      {
+         for (int i = 0; i < n; i++)
+         {
+            double p = dPhase + (double)i * dIncrement;
+            double f = round_scalar(p);
+            if (f > p) f -= 1.0;
+            double x = (p - f) * (double)nSize;
+            int k = (int)x;
+            double dFrac = x - (double)k;
+            pOut[i] += dGain * (T)((double)pTable[k] + ((double)pTable[k + 1] - (double)pTable[k]) * dFrac);
+         }
+      }
+
+      // pOut[i] += g * pIn[i]
+      template<class T>
+      void scale_add_scalar(T* pOut, const T* pIn, int n, T dGain)
+      {
+         for (int i = 0; i < n; i++)
+            pOut[i] += dGain * pIn[i];
+      }
+
+      // pOut[i] *= g * pIn[i]
+      template<class T>
+      void multiply_scalar(T* pOut, const T* pIn, int n, T dGain)
+      {
+         for (int i = 0; i < n; i++)
+            pOut[i] *= dGain * pIn[i];
+      }
+
+      // pOut[i] *= g * (start + i * step), an envelope segment
+      template<class T>
+      void ramp_multiply_scalar(T* pOut, int n, T dStart, T dStep, T dGain)
+      {
+         for (int i = 0; i < n; i++)
+            pOut[i] *= dGain * (dStart + (T)i * dStep);
+      }
+
+      // max |pIn[i]|
+      template<class T>
+      T peak_scalar(const T* pIn, int n)
+      {
+         T dPeak = 0;
+         for (int i = 0; i < n; i++)
+            dPeak = fabs(pIn[i]) > dPeak ? fabs(pIn[i]) : dPeak;
+         return dPeak;
+      }
+
+      // Counter based integer hash (lowbias32, C. Wellons). Each sample only
+      // depends on its own counter, so there is no serial chain to vectorise
+      // around and no shared state to lock.
+      inline uint32_t noise_hash(uint32_t nCounter, uint32_t nKey)
+      {
+         uint32_t x = (nCounter * NOISE_WEYL) ^ nKey;
+         x ^= x >> 16;
+         x *= NOISE_M1;
+         x ^= x >> 15;
+         x *= NOISE_M2;
+         x ^= x >> 16;
+         return x;
+      }
+
+      // pOut[i] += g * white noise in [-1, 1), sample i drawn from counter c + i
+      template<class T>
+      void noise_add_scalar(T* pOut, int n, uint32_t nCounter, uint32_t nKey, T dGain)
+      {
+         for (int i = 0; i < n; i++)
+            pOut[i] += dGain * (T)((double)(int32_t)noise_hash(nCounter + (uint32_t)i, nKey) * NOISE_SCALE);
+      }
+
+      // Output conversion. Every format goes through single precision, which
+      // carries 24 bits and so covers all of them. Samples are clipped to
+      // [-1, 1], scaled, given fDither LSBs of TPDF dither and rounded to
+      // nearest. The dither for sample i is the two 16 bit halves of one
+      // noise hash added together, triangular over (-1, 1).
+      inline float tpdf_scalar(uint32_t nCounter, uint32_t nKey)
+      {
+         uint32_t x = noise_hash(nCounter, nKey);
+         return (float)(int)((x & 0xffff) + (x >> 16)) * (1.0f / 65536.0f) - (65535.0f / 65536.0f);
+      }
+
+      inline float clip_scalar(float x, float fLow, float fHigh)
+      {
+         return x < fLow ? fLow : (x > fHigh ? fHigh : x);
+      }
+
+      // Signed 16 bit
+      template<class T>
+      void to_s16_scalar(int16_t* pOut, const T* pIn, int n, uint32_t nCounter, uint32_t nKey, float fDither)
+      {
+         for (int i = 0; i < n; i++)
+         {
+            float x = clip_scalar((float)pIn[i], -1.0f, 1.0f) * 32767.0f + fDither * tpdf_scalar(nCounter + (uint32_t)i, nKey);
+            pOut[i] = (int16_t)round_scalar(clip_scalar(x, -32768.0f, 32767.0f));
+         }
+      }
+
+      // Signed 24 bit in the top of a 32 bit word, as WAVE_FORMAT_EXTENSIBLE
+      // expects; readers that don't know about 24 bits see plain 32 bit
+      template<class T>
+      void to_s24_scalar(int32_t* pOut, const T* pIn, int n, uint32_t nCounter, uint32_t nKey, float fDither)
+      {
+         for (int i = 0; i < n; i++)
+         {
+            float x = clip_scalar((float)pIn[i], -1.0f, 1.0f) * 8388607.0f + fDither * tpdf_scalar(nCounter + (uint32_t)i, nKey);
+            pOut[i] = (int32_t)((uint32_t)(int32_t)round_scalar(clip_scalar(x, -8388608.0f, 8388607.0f)) << 8);
+         }
+      }
+
+      // 32 bit float, clipped only
+      template<class T>
+      void to_f32_scalar(float* pOut, const T* pIn, int n)
+      {
+         for (int i = 0; i < n; i++)
+            pOut[i] = clip_scalar((float)pIn[i], -1.0f, 1.0f);
+      }
+
+      // pOut[i * c + ch] = ppIn[ch][i], planar buses into one interleaved
+      // buffer. The vector versions handle stereo and fall back to this for
+      // any other channel count.
+      template<class T>
+      void interleave_scalar(T* pOut, const T* const* ppIn, int nChannels, int n)
+      {
+         for (int ch = 0; ch < nChannels; ch++)
+         {
+            const T* pIn = ppIn[ch];
+            for (int i = 0; i < n; i++)
+               pOut[i * nChannels + ch] = pIn[i];
+         }
+      }
+
+#if defined(SYNTH_SIMD_X86)
+      // ------------------------------------------------------------------
+      // SSE2, two doubles per instruction
+      // ------------------------------------------------------------------
+      inline __m128d round_sse2(__m128d x)
+      {
+         __m128d m = _mm_set1_pd(ROUND_MAGIC);
+         return _mm_sub_pd(_mm_add_pd(x, m), m);
+      }
+
+      inline __m128d sine_sse2(__m128d p)
+      {
+         __m128d sign = _mm_set1_pd(-0.0);
+         __m128d x = _mm_sub_pd(p, round_sse2(p));
+         __m128d a = _mm_andnot_pd(sign, x);
+         __m128d b = _mm_sub_pd(_mm_set1_pd(0.5), a);
+         a = _mm_min_pd(b, a);
+         x = _mm_or_pd(a, _mm_and_pd(sign, x));
+
+         __m128d y = _mm_mul_pd(x, _mm_set1_pd(SIN_C1));
+         __m128d y2 = _mm_mul_pd(y, y);
+         __m128d r = _mm_set1_pd(SIN_C13);
+         r = _mm_add_pd(_mm_mul_pd(r, y2), _mm_set1_pd(SIN_C11));
+         r = _mm_add_pd(_mm_mul_pd(r, y2), _mm_set1_pd(SIN_C9));
+         r = _mm_add_pd(_mm_mul_pd(r, y2), _mm_set1_pd(SIN_C7));
+         r = _mm_add_pd(_mm_mul_pd(r, y2), _mm_set1_pd(SIN_C5));
+         r = _mm_add_pd(_mm_mul_pd(r, y2), _mm_set1_pd(SIN_C3));
+         r = _mm_mul_pd(r, y2);
+         return _mm_add_pd(y, _mm_mul_pd(y, r));
+      }
+
+      inline void sine_add_sse2(double* pOut, int n, double dPhase, double dIncrement, double dGain)
+      {
+         __m128d vIndex = _mm_set_pd(1.0, 0.0);
+         __m128d vTwo = _mm_set1_pd(2.0);
+         __m128d vPhase = _mm_set1_pd(dPhase), vInc = _mm_set1_pd(dIncrement), vGain = _mm_set1_pd(dGain);
+         int i = 0;
+         for (; i + 2 <= n; i += 2)
+         {
+            __m128d p = _mm_add_pd(vPhase, _mm_mul_pd(vIndex, vInc));
+            __m128d o = _mm_loadu_pd(pOut + i);
+            _mm_storeu_pd(pOut + i, _mm_add_pd(o, _mm_mul_pd(vGain, sine_sse2(p))));
+            vIndex = _mm_add_pd(vIndex, vTwo);
+         }
+         for (; i < n; i++)
+            pOut[i] += dGain * sine_scalar<double>(dPhase + (double)i * dIncrement);
+      }
+
+      inline void table_add_sse2(double* pOut, int n, const double* pTable, int nSize, double dPhase, double dIncrement, double dGain)
+      {
+         __m128d vIndex = _mm_set_pd(1.0, 0.0);
+         __m128d vTwo = _mm_set1_pd(2.0), vOne = _mm_set1_pd(1.0);
+         __m128d vPhase = _mm_set1_pd(dPhase), vInc = _mm_set1_pd(dIncrement), vGain = _mm_set1_pd(dGain);
+         __m128d vSize = _mm_set1_pd((double)nSize);
+         int i = 0;
+         for (; i + 2 <= n; i += 2)
+         {
+            __m128d p = _mm_add_pd(vPhase, _mm_mul_pd(vIndex, vInc));
+            __m128d f = round_sse2(p);
+            f = _mm_sub_pd(f, _mm_and_pd(_mm_cmpgt_pd(f, p), vOne));
+            __m128d x = _mm_mul_pd(_mm_sub_pd(p, f), vSize);
+            __m128i k = _mm_cvttpd_epi32(x);
+            __m128d dFrac = _mm_sub_pd(x, _mm_cvtepi32_pd(k));
+
+            int k0 = _mm_cvtsi128_si32(k);
+            int k1 = _mm_cvtsi128_si32(_mm_shuffle_epi32(k, 1));
+            __m128d t0 = _mm_set_pd(pTable[k1], pTable[k0]);
+            __m128d t1 = _mm_set_pd(pTable[k1 + 1], pTable[k0 + 1]);
+            __m128d s = _mm_add_pd(t0, _mm_mul_pd(_mm_sub_pd(t1, t0), dFrac));
+
+            __m128d o = _mm_loadu_pd(pOut + i);
+            _mm_storeu_pd(pOut + i, _mm_add_pd(o, _mm_mul_pd(vGain, s)));
+            vIndex = _mm_add_pd(vIndex, vTwo);
+         }
+         if (i < n)
+            table_add_scalar<double>(pOut + i, n - i, pTable, nSize, dPhase + (double)i * dIncrement, dIncrement, dGain);
+      }
+
+      inline void scale_add_sse2(double* pOut, const double* pIn, int n, double dGain)
+      {
+         __m128d vGain = _mm_set1_pd(dGain);
+         int i = 0;
+         for (; i + 2 <= n; i += 2)
+            _mm_storeu_pd(pOut + i, _mm_add_pd(_mm_loadu_pd(pOut + i), _mm_mul_pd(vGain, _mm_loadu_pd(pIn + i))));
+         for (; i < n; i++)
+            pOut[i] += dGain * pIn[i];
+      }
+
+      inline void multiply_sse2(double* pOut, const double* pIn, int n, double dGain)
+      {
+         __m128d vGain = _mm_set1_pd(dGain);
+         int i = 0;
+         for (; i + 2 <= n; i += 2)
+            _mm_storeu_pd(pOut + i, _mm_mul_pd(_mm_loadu_pd(pOut + i), _mm_mul_pd(vGain, _mm_loadu_pd(pIn + i))));
+         for (; i < n; i++)
+            pOut[i] *= dGain * pIn[i];
+      }
+
+      inline void ramp_multiply_sse2(double* pOut, int n, double dStart, double dStep, double dGain)
+      {
+         __m128d vIndex = _mm_set_pd(1.0, 0.0);
+         __m128d vTwo = _mm_set1_pd(2.0);
+         __m128d vStart = _mm_set1_pd(dStart), vStep = _mm_set1_pd(dStep), vGain = _mm_set1_pd(dGain);
+         int i = 0;
+         for (; i + 2 <= n; i += 2)
+         {
+            __m128d a = _mm_add_pd(vStart, _mm_mul_pd(vIndex, vStep));
+            _mm_storeu_pd(pOut + i, _mm_mul_pd(_mm_loadu_pd(pOut + i), _mm_mul_pd(vGain, a)));
+            vIndex = _mm_add_pd(vIndex, vTwo);
+         }
+         for (; i < n; i++)
+            pOut[i] *= dGain * (dStart + (double)i * dStep);
+      }
+
+      inline double peak_sse2(const double* pIn, int n)
+      {
+         __m128d sign = _mm_set1_pd(-0.0);
+         __m128d vPeak = _mm_setzero_pd();
+         int i = 0;
+         for (; i + 2 <= n; i += 2)
+            vPeak = _mm_max_pd(vPeak, _mm_andnot_pd(sign, _mm_loadu_pd(pIn + i)));
+         double d[2];
+         _mm_storeu_pd(d, vPeak);
+         double dPeak = d[0] > d[1] ? d[0] : d[1];
+         for (; i < n; i++)
+            dPeak = fabs(pIn[i]) > dPeak ? fabs(pIn[i]) : dPeak;
+         return dPeak;
+      }
+
+      // SSE2 has no 32 bit multiply, build it from two 32x32->64 ones
+      inline __m128i mullo_sse2(__m128i a, __m128i b)
+      {
+         __m128i lo = _mm_mul_epu32(a, b);
+         __m128i hi = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+         return _mm_unpacklo_epi32(_mm_shuffle_epi32(lo, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(hi, _MM_SHUFFLE(0, 0, 2, 0)));
+      }
+
+      // noise_hash() of four counters, already multiplied by NOISE_WEYL
+      inline __m128i hash_sse2(__m128i vSpread, __m128i vKey)
+      {
+         __m128i x = _mm_xor_si128(vSpread, vKey);
+         x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+         x = mullo_sse2(x, _mm_set1_epi32((int)NOISE_M1));
+         x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+         x = mullo_sse2(x, _mm_set1_epi32((int)NOISE_M2));
+         return _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+      }
+
+      // Spread counters c .. c + 3
+      inline __m128i spread_sse2(uint32_t nCounter)
+      {
+         __m128i vWeyl = _mm_set_epi32((int)(3 * NOISE_WEYL), (int)(2 * NOISE_WEYL), (int)NOISE_WEYL, 0);
+         return _mm_add_epi32(_mm_set1_epi32((int)(nCounter * NOISE_WEYL)), vWeyl);
+      }
+
+      inline void noise_add_sse2(double* pOut, int n, uint32_t nCounter, uint32_t nKey, double dGain)
+      {
+         __m128i vSpread = spread_sse2(nCounter);
+         __m128i vStep = _mm_set1_epi32((int)(4 * NOISE_WEYL));
+         __m128i vKey = _mm_set1_epi32((int)nKey);
+         __m128d vScale = _mm_set1_pd(NOISE_SCALE), vGain = _mm_set1_pd(dGain);
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+         {
+            __m128i x = hash_sse2(vSpread, vKey);
+
+            __m128d a = _mm_mul_pd(vGain, _mm_mul_pd(_mm_cvtepi32_pd(x), vScale));
+            __m128d b = _mm_mul_pd(vGain, _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(x, 8)), vScale));
+            _mm_storeu_pd(pOut + i, _mm_add_pd(_mm_loadu_pd(pOut + i), a));
+            _mm_storeu_pd(pOut + i + 2, _mm_add_pd(_mm_loadu_pd(pOut + i + 2), b));
+            vSpread = _mm_add_epi32(vSpread, vStep);
+         }
+         if (i < n)
+            noise_add_scalar<double>(pOut + i, n - i, nCounter + (uint32_t)i, nKey, dGain);
+      }
+
+      // Single precision, four floats per instruction. Phases stay in double
+      // until they have been folded into [-0.5, 0.5], the rest runs in float.
+      inline __m128 sine_fold_sse2(__m128d p0, __m128d p1)
+      {
+         __m128 x = _mm_movelh_ps(_mm_cvtpd_ps(_mm_sub_pd(p0, round_sse2(p0))), _mm_cvtpd_ps(_mm_sub_pd(p1, round_sse2(p1))));
+         __m128 sign = _mm_set1_ps(-0.0f);
+         __m128 a = _mm_andnot_ps(sign, x);
+         __m128 b = _mm_sub_ps(_mm_set1_ps(0.5f), a);
+         a = _mm_min_ps(b, a);
+         x = _mm_or_ps(a, _mm_and_ps(sign, x));
+
+         __m128 y = _mm_mul_ps(x, _mm_set1_ps((float)SIN_C1));
+         __m128 y2 = _mm_mul_ps(y, y);
+         __m128 r = _mm_set1_ps((float)SIN_C13);
+         r = _mm_add_ps(_mm_mul_ps(r, y2), _mm_set1_ps((float)SIN_C11));
+         r = _mm_add_ps(_mm_mul_ps(r, y2), _mm_set1_ps((float)SIN_C9));
+         r = _mm_add_ps(_mm_mul_ps(r, y2), _mm_set1_ps((float)SIN_C7));
+         r = _mm_add_ps(_mm_mul_ps(r, y2), _mm_set1_ps((float)SIN_C5));
+         r = _mm_add_ps(_mm_mul_ps(r, y2), _mm_set1_ps((float)SIN_C3));
+         r = _mm_mul_ps(r, y2);
+         return _mm_add_ps(y, _mm_mul_ps(y, r));
+      }
+
+      inline void sine_add_sse2f(float* pOut, int n, double dPhase, double dIncrement, float dGain)
+      {
+         __m128d vIndex = _mm_set_pd(1.0, 0.0);
+         __m128d vTwo = _mm_set1_pd(2.0), vFour = _mm_set1_pd(4.0);
+         __m128d vPhase = _mm_set1_pd(dPhase), vInc = _mm_set1_pd(dIncrement);
+         __m128 vGain = _mm_set1_ps(dGain);
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+         {
+            __m128d p0 = _mm_add_pd(vPhase, _mm_mul_pd(vIndex, vInc));
+            __m128d p1 = _mm_add_pd(vPhase, _mm_mul_pd(_mm_add_pd(vIndex, vTwo), vInc));
+            _mm_storeu_ps(pOut + i, _mm_add_ps(_mm_loadu_ps(pOut + i), _mm_mul_ps(vGain, sine_fold_sse2(p0, p1))));
+            vIndex = _mm_add_pd(vIndex, vFour);
+         }
+         for (; i < n; i++)
+            pOut[i] += dGain * (float)sine_scalar<double>(dPhase + (double)i * dIncrement);
+      }
+
+      inline void scale_add_sse2f(float* pOut, const float* pIn, int n, float dGain)
+      {
+         __m128 vGain = _mm_set1_ps(dGain);
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+            _mm_storeu_ps(pOut + i, _mm_add_ps(_mm_loadu_ps(pOut + i), _mm_mul_ps(vGain, _mm_loadu_ps(pIn + i))));
+         for (; i < n; i++)
+            pOut[i] += dGain * pIn[i];
+      }
+
+      inline void multiply_sse2f(float* pOut, const float* pIn, int n, float dGain)
+      {
+         __m128 vGain = _mm_set1_ps(dGain);
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+            _mm_storeu_ps(pOut + i, _mm_mul_ps(_mm_loadu_ps(pOut + i), _mm_mul_ps(vGain, _mm_loadu_ps(pIn + i))));
+         for (; i < n; i++)
+            pOut[i] *= dGain * pIn[i];
+      }
+
+      inline void ramp_multiply_sse2f(float* pOut, int n, float dStart, float dStep, float dGain)
+      {
+         __m128 vIndex = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+         __m128 vFour = _mm_set1_ps(4.0f);
+         __m128 vStart = _mm_set1_ps(dStart), vStep = _mm_set1_ps(dStep), vGain = _mm_set1_ps(dGain);
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+         {
+            __m128 a = _mm_add_ps(vStart, _mm_mul_ps(vIndex, vStep));
+            _mm_storeu_ps(pOut + i, _mm_mul_ps(_mm_loadu_ps(pOut + i), _mm_mul_ps(vGain, a)));
+            vIndex = _mm_add_ps(vIndex, vFour);
+         }
+         for (; i < n; i++)
+            pOut[i] *= dGain * (dStart + (float)i * dStep);
+      }
+
+      inline float peak_sse2f(const float* pIn, int n)
+      {
+         __m128 sign = _mm_set1_ps(-0.0f);
+         __m128 vPeak = _mm_setzero_ps();
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+            vPeak = _mm_max_ps(vPeak, _mm_andnot_ps(sign, _mm_loadu_ps(pIn + i)));
+         float d[4];
+         _mm_storeu_ps(d, vPeak);
+         float dPeak = 0.0f;
+         for (int j = 0; j < 4; j++)
+            dPeak = d[j] > dPeak ? d[j] : dPeak;
+         for (; i < n; i++)
+            dPeak = fabs(pIn[i]) > dPeak ? fabs(pIn[i]) : dPeak;
+         return dPeak;
+      }
+
+      inline void noise_add_sse2f(float* pOut, int n, uint32_t nCounter, uint32_t nKey, float dGain)
+      {
+         __m128i vSpread = spread_sse2(nCounter);
+         __m128i vStep = _mm_set1_epi32((int)(4 * NOISE_WEYL));
+         __m128i vKey = _mm_set1_epi32((int)nKey);
+         __m128 vScale = _mm_set1_ps((float)NOISE_SCALE), vGain = _mm_set1_ps(dGain);
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+         {
+            __m128 a = _mm_mul_ps(vGain, _mm_mul_ps(_mm_cvtepi32_ps(hash_sse2(vSpread, vKey)), vScale));
+            _mm_storeu_ps(pOut + i, _mm_add_ps(_mm_loadu_ps(pOut + i), a));
+            vSpread = _mm_add_epi32(vSpread, vStep);
+         }
+         if (i < n)
+            noise_add_scalar<float>(pOut + i, n - i, nCounter + (uint32_t)i, nKey, dGain);
+      }
+
+      // Output conversion, four samples at a time
+      inline __m128 load4_sse2(const double* p)
+      {
+         return _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(p)), _mm_cvtpd_ps(_mm_loadu_pd(p + 2)));
+      }
+
+      inline __m128 load4_sse2(const float* p)
+      {
+         return _mm_loadu_ps(p);
+      }
+
+      inline __m128 tpdf_sse2(__m128i vSpread, __m128i vKey)
+      {
+         __m128i x = hash_sse2(vSpread, vKey);
+         __m128i s = _mm_add_epi32(_mm_and_si128(x, _mm_set1_epi32(0xffff)), _mm_srli_epi32(x, 16));
+         return _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(s), _mm_set1_ps(1.0f / 65536.0f)), _mm_set1_ps(65535.0f / 65536.0f));
+      }
+
+      // clip(x) * fScale + fDither * tpdf, clamped to the integer range
+      inline __m128i quantise_sse2(__m128 x, __m128 vScale, __m128 vDither, __m128 vLow, __m128 vHigh, __m128i vSpread, __m128i vKey)
+      {
+         x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f));
+         x = _mm_add_ps(_mm_mul_ps(x, vScale), _mm_mul_ps(vDither, tpdf_sse2(vSpread, vKey)));
+         return _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(x, vLow), vHigh));
+      }
+
+      template<class T>
+      void to_s16_sse2(int16_t* pOut, const T* pIn, int n, uint32_t nCounter, uint32_t nKey, float fDither)
+      {
+         __m128i vSpread = spread_sse2(nCounter);
+         __m128i vStep = _mm_set1_epi32((int)(4 * NOISE_WEYL));
+         __m128i vKey = _mm_set1_epi32((int)nKey);
+         __m128 vScale = _mm_set1_ps(32767.0f), vDither = _mm_set1_ps(fDither);
+         __m128 vLow = _mm_set1_ps(-32768.0f), vHigh = _mm_set1_ps(32767.0f);
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+         {
+            __m128i v = quantise_sse2(load4_sse2(pIn + i), vScale, vDither, vLow, vHigh, vSpread, vKey);
+            _mm_storel_epi64((__m128i*)(pOut + i), _mm_packs_epi32(v, v));
+            vSpread = _mm_add_epi32(vSpread, vStep);
+         }
+         if (i < n)
+            to_s16_scalar<T>(pOut + i, pIn + i, n - i, nCounter + (uint32_t)i, nKey, fDither);
+      }
+
+      template<class T>
+      void to_s24_sse2(int32_t* pOut, const T* pIn, int n, uint32_t nCounter, uint32_t nKey, float fDither)
+      {
+         __m128i vSpread = spread_sse2(nCounter);
+         __m128i vStep = _mm_set1_epi32((int)(4 * NOISE_WEYL));
+         __m128i vKey = _mm_set1_epi32((int)nKey);
+         __m128 vScale = _mm_set1_ps(8388607.0f), vDither = _mm_set1_ps(fDither);
+         __m128 vLow = _mm_set1_ps(-8388608.0f), vHigh = _mm_set1_ps(8388607.0f);
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+         {
+            __m128i v = quantise_sse2(load4_sse2(pIn + i), vScale, vDither, vLow, vHigh, vSpread, vKey);
+            _mm_storeu_si128((__m128i*)(pOut + i), _mm_slli_epi32(v, 8));
+            vSpread = _mm_add_epi32(vSpread, vStep);
+         }
+         if (i < n)
+            to_s24_scalar<T>(pOut + i, pIn + i, n - i, nCounter + (uint32_t)i, nKey, fDither);
+      }
+
+      template<class T>
+      void to_f32_sse2(float* pOut, const T* pIn, int n)
+      {
+         __m128 vLow = _mm_set1_ps(-1.0f), vHigh = _mm_set1_ps(1.0f);
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+            _mm_storeu_ps(pOut + i, _mm_min_ps(_mm_max_ps(load4_sse2(pIn + i), vLow), vHigh));
+         if (i < n)
+            to_f32_scalar<T>(pOut + i, pIn + i, n - i);
+      }
+
+      inline void interleave_sse2(double* pOut, const double* const* ppIn, int nChannels, int n)
+      {
+         if (nChannels != 2)
+            return interleave_scalar<double>(pOut, ppIn, nChannels, n);
+
+         const double* pL = ppIn[0];
+         const double* pR = ppIn[1];
+         int i = 0;
+         for (; i + 2 <= n; i += 2)
+         {
+            __m128d l = _mm_loadu_pd(pL + i), r = _mm_loadu_pd(pR + i);
+            _mm_storeu_pd(pOut + 2 * i, _mm_unpacklo_pd(l, r));
+            _mm_storeu_pd(pOut + 2 * i + 2, _mm_unpackhi_pd(l, r));
+         }
+         for (; i < n; i++)
+         {
+            pOut[2 * i] = pL[i];
+            pOut[2 * i + 1] = pR[i];
+         }
+      }
+
+      inline void interleave_sse2f(float* pOut, const float* const* ppIn, int nChannels, int n)
+      {
+         if (nChannels != 2)
+            return interleave_scalar<float>(pOut, ppIn, nChannels, n);
+
+         const float* pL = ppIn[0];
+         const float* pR = ppIn[1];
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+         {
+            __m128 l = _mm_loadu_ps(pL + i), r = _mm_loadu_ps(pR + i);
+            _mm_storeu_ps(pOut + 2 * i, _mm_unpacklo_ps(l, r));
+            _mm_storeu_ps(pOut + 2 * i + 4, _mm_unpackhi_ps(l, r));
+         }
+         for (; i < n; i++)
+         {
+            pOut[2 * i] = pL[i];
+            pOut[2 * i + 1] = pR[i];
+         }
+      }
+
+      // ------------------------------------------------------------------
+      // AVX2, four doubles per instruction, hardware gathers for tables
+      // ------------------------------------------------------------------
+      SYNTH_TARGET_AVX2 inline __m256d round_avx2(__m256d x)
+      {
+         __m256d m = _mm256_set1_pd(ROUND_MAGIC);
+         return _mm256_sub_pd(_mm256_add_pd(x, m), m);
+      }
+
+      SYNTH_TARGET_AVX2 inline __m256d sine_avx2(__m256d p)
+      {
+         __m256d sign = _mm256_set1_pd(-0.0);
+         __m256d x = _mm256_sub_pd(p, round_avx2(p));
+         __m256d a = _mm256_andnot_pd(sign, x);
+         __m256d b = _mm256_sub_pd(_mm256_set1_pd(0.5), a);
+         a = _mm256_min_pd(b, a);
+         x = _mm256_or_pd(a, _mm256_and_pd(sign, x));
+
+         __m256d y = _mm256_mul_pd(x, _mm256_set1_pd(SIN_C1));
+         __m256d y2 = _mm256_mul_pd(y, y);
+         __m256d r = _mm256_set1_pd(SIN_C13);
+         r = _mm256_add_pd(_mm256_mul_pd(r, y2), _mm256_set1_pd(SIN_C11));
+         r = _mm256_add_pd(_mm256_mul_pd(r, y2), _mm256_set1_pd(SIN_C9));
+         r = _mm256_add_pd(_mm256_mul_pd(r, y2), _mm256_set1_pd(SIN_C7));
+         r = _mm256_add_pd(_mm256_mul_pd(r, y2), _mm256_set1_pd(SIN_C5));
+         r = _mm256_add_pd(_mm256_mul_pd(r, y2), _mm256_set1_pd(SIN_C3));
+         r = _mm256_mul_pd(r, y2);
+         return _mm256_add_pd(y, _mm256_mul_pd(y, r));
+      }
+
+      SYNTH_TARGET_AVX2 inline void sine_add_avx2(double* pOut, int n, double dPhase, double dIncrement, double dGain)
+      {
+         __m256d vIndex = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+         __m256d vFour = _mm256_set1_pd(4.0);
+         __m256d vPhase = _mm256_set1_pd(dPhase), vInc = _mm256_set1_pd(dIncrement), vGain = _mm256_set1_pd(dGain);
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+         {
+            __m256d p = _mm256_add_pd(vPhase, _mm256_mul_pd(vIndex, vInc));
+            __m256d o = _mm256_loadu_pd(pOut + i);
+            _mm256_storeu_pd(pOut + i, _mm256_add_pd(o, _mm256_mul_pd(vGain, sine_avx2(p))));
+            vIndex = _mm256_add_pd(vIndex, vFour);
+         }
+         for (; i < n; i++)
+            pOut[i] += dGain * sine_scalar<double>(dPhase + (double)i * dIncrement);
+      }
+
+      SYNTH_TARGET_AVX2 inline void table_add_avx2(double* pOut, int n, const double* pTable, int nSize, double dPhase, double dIncrement, double dGain)
+      {
+         __m256d vIndex = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+         __m256d vFour = _mm256_set1_pd(4.0), vOne = _mm256_set1_pd(1.0);
+         __m256d vPhase = _mm256_set1_pd(dPhase), vInc = _mm256_set1_pd(dIncrement), vGain = _mm256_set1_pd(dGain);
+         __m256d vSize = _mm256_set1_pd((double)nSize);
+         __m256d vAll = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+         {
+            __m256d p = _mm256_add_pd(vPhase, _mm256_mul_pd(vIndex, vInc));
+            __m256d f = round_avx2(p);
+            f = _mm256_sub_pd(f, _mm256_and_pd(_mm256_cmp_pd(f, p, _CMP_GT_OQ), vOne));
+            __m256d x = _mm256_mul_pd(_mm256_sub_pd(p, f), vSize);
+            __m128i k = _mm256_cvttpd_epi32(x);
+            __m256d dFrac = _mm256_sub_pd(x, _mm256_cvtepi32_pd(k));
+
+            __m256d t0 = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), pTable, k, vAll, 8);
+            __m256d t1 = _mm256_mask_i32gather_pd(_mm256_setzero_pd(), pTable + 1, k, vAll, 8);
+            __m256d s = _mm256_add_pd(t0, _mm256_mul_pd(_mm256_sub_pd(t1, t0), dFrac));
+
+            __m256d o = _mm256_loadu_pd(pOut + i);
+            _mm256_storeu_pd(pOut + i, _mm256_add_pd(o, _mm256_mul_pd(vGain, s)));
+            vIndex = _mm256_add_pd(vIndex, vFour);
+         }
+         if (i < n)
+            table_add_scalar<double>(pOut + i, n - i, pTable, nSize, dPhase + (double)i * dIncrement, dIncrement, dGain);
+      }
+
+      SYNTH_TARGET_AVX2 inline void scale_add_avx2(double* pOut, const double* pIn, int n, double dGain)
+      {
+         __m256d vGain = _mm256_set1_pd(dGain);
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+            _mm256_storeu_pd(pOut + i, _mm256_add_pd(_mm256_loadu_pd(pOut + i), _mm256_mul_pd(vGain, _mm256_loadu_pd(pIn + i))));
+         for (; i < n; i++)
+            pOut[i] += dGain * pIn[i];
+      }
+
+      SYNTH_TARGET_AVX2 inline void multiply_avx2(double* pOut, const double* pIn, int n, double dGain)
+      {
+         __m256d vGain = _mm256_set1_pd(dGain);
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+            _mm256_storeu_pd(pOut + i, _mm256_mul_pd(_mm256_loadu_pd(pOut + i), _mm256_mul_pd(vGain, _mm256_loadu_pd(pIn + i))));
+         for (; i < n; i++)
+            pOut[i] *= dGain * pIn[i];
+      }
+
+      SYNTH_TARGET_AVX2 inline void ramp_multiply_avx2(double* pOut, int n, double dStart, double dStep, double dGain)
+      {
+         __m256d vIndex = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+         __m256d vFour = _mm256_set1_pd(4.0);
+         __m256d vStart = _mm256_set1_pd(dStart), vStep = _mm256_set1_pd(dStep), vGain = _mm256_set1_pd(dGain);
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+         {
+            __m256d a = _mm256_add_pd(vStart, _mm256_mul_pd(vIndex, vStep));
+            _mm256_storeu_pd(pOut + i, _mm256_mul_pd(_mm256_loadu_pd(pOut + i), _mm256_mul_pd(vGain, a)));
+            vIndex = _mm256_add_pd(vIndex, vFour);
+         }
+         for (; i < n; i++)
+            pOut[i] *= dGain * (dStart + (double)i * dStep);
+      }
+
+      SYNTH_TARGET_AVX2 inline double peak_avx2(const double* pIn, int n)
+      {
+         __m256d sign = _mm256_set1_pd(-0.0);
+         __m256d vPeak = _mm256_setzero_pd();
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+            vPeak = _mm256_max_pd(vPeak, _mm256_andnot_pd(sign, _mm256_loadu_pd(pIn + i)));
+         double d[4];
+         _mm256_storeu_pd(d, vPeak);
+         double dPeak = 0.0;
+         for (int j = 0; j < 4; j++)
+            dPeak = d[j] > dPeak ? d[j] : dPeak;
+         for (; i < n; i++)
+            dPeak = fabs(pIn[i]) > dPeak ? fabs(pIn[i]) : dPeak;
+         return dPeak;
+      }
+
+      SYNTH_TARGET_AVX2 inline void noise_add_avx2(double* pOut, int n, uint32_t nCounter, uint32_t nKey, double dGain)
+      {
+         __m256i vWeyl = _mm256_mullo_epi32(_mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0), _mm256_set1_epi32((int)NOISE_WEYL));
+         __m256i vSpread = _mm256_add_epi32(_mm256_set1_epi32((int)(nCounter * NOISE_WEYL)), vWeyl);
+         __m256i vStep = _mm256_set1_epi32((int)(8 * NOISE_WEYL));
+         __m256i vKey = _mm256_set1_epi32((int)nKey);
+         __m256i vM1 = _mm256_set1_epi32((int)NOISE_M1), vM2 = _mm256_set1_epi32((int)NOISE_M2);
+         __m256d vScale = _mm256_set1_pd(NOISE_SCALE), vGain = _mm256_set1_pd(dGain);
+         int i = 0;
+         for (; i + 8 <= n; i += 8)
+         {
+            __m256i x = _mm256_xor_si256(vSpread, vKey);
+            x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+            x = _mm256_mullo_epi32(x, vM1);
+            x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+            x = _mm256_mullo_epi32(x, vM2);
+            x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+
+            __m256d a = _mm256_mul_pd(vGain, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(x)), vScale));
+            __m256d b = _mm256_mul_pd(vGain, _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(x, 1)), vScale));
+            _mm256_storeu_pd(pOut + i, _mm256_add_pd(_mm256_loadu_pd(pOut + i), a));
+            _mm256_storeu_pd(pOut + i + 4, _mm256_add_pd(_mm256_loadu_pd(pOut + i + 4), b));
+            vSpread = _mm256_add_epi32(vSpread, vStep);
+         }
+         if (i < n)
+            noise_add_scalar<double>(pOut + i, n - i, nCounter + (uint32_t)i, nKey, dGain);
+      }
+
+      // Single precision, eight floats per instruction
+      SYNTH_TARGET_AVX2 inline __m256i hash_avx2(__m256i vSpread, __m256i vKey)
+      {
+         __m256i x = _mm256_xor_si256(vSpread, vKey);
+         x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+         x = _mm256_mullo_epi32(x, _mm256_set1_epi32((int)NOISE_M1));
+         x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 15));
+         x = _mm256_mullo_epi32(x, _mm256_set1_epi32((int)NOISE_M2));
+         return _mm256_xor_si256(x, _mm256_srli_epi32(x, 16));
+      }
+
+      SYNTH_TARGET_AVX2 inline __m256i spread_avx2(uint32_t nCounter)
+      {
+         __m256i vWeyl = _mm256_mullo_epi32(_mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0), _mm256_set1_epi32((int)NOISE_WEYL));
+         return _mm256_add_epi32(_mm256_set1_epi32((int)(nCounter * NOISE_WEYL)), vWeyl);
+      }
+
+      SYNTH_TARGET_AVX2 inline __m256 join_avx2(__m128 lo, __m128 hi)
+      {
+         return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+      }
+
+      SYNTH_TARGET_AVX2 inline __m256 sine_fold_avx2(__m256d p0, __m256d p1)
+      {
+         __m256 x = join_avx2(_mm256_cvtpd_ps(_mm256_sub_pd(p0, round_avx2(p0))), _mm256_cvtpd_ps(_mm256_sub_pd(p1, round_avx2(p1))));
+         __m256 sign = _mm256_set1_ps(-0.0f);
+         __m256 a = _mm256_andnot_ps(sign, x);
+         __m256 b = _mm256_sub_ps(_mm256_set1_ps(0.5f), a);
+         a = _mm256_min_ps(b, a);
+         x = _mm256_or_ps(a, _mm256_and_ps(sign, x));
+
+         __m256 y = _mm256_mul_ps(x, _mm256_set1_ps((float)SIN_C1));
+         __m256 y2 = _mm256_mul_ps(y, y);
+         __m256 r = _mm256_set1_ps((float)SIN_C13);
+         r = _mm256_add_ps(_mm256_mul_ps(r, y2), _mm256_set1_ps((float)SIN_C11));
+         r = _mm256_add_ps(_mm256_mul_ps(r, y2), _mm256_set1_ps((float)SIN_C9));
+         r = _mm256_add_ps(_mm256_mul_ps(r, y2), _mm256_set1_ps((float)SIN_C7));
+         r = _mm256_add_ps(_mm256_mul_ps(r, y2), _mm256_set1_ps((float)SIN_C5));
+         r = _mm256_add_ps(_mm256_mul_ps(r, y2), _mm256_set1_ps((float)SIN_C3));
+         r = _mm256_mul_ps(r, y2);
+         return _mm256_add_ps(y, _mm256_mul_ps(y, r));
+      }
+
+      SYNTH_TARGET_AVX2 inline void sine_add_avx2f(float* pOut, int n, double dPhase, double dIncrement, float dGain)
+      {
+         __m256d vIndex = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+         __m256d vFour = _mm256_set1_pd(4.0), vEight = _mm256_set1_pd(8.0);
+         __m256d vPhase = _mm256_set1_pd(dPhase), vInc = _mm256_set1_pd(dIncrement);
+         __m256 vGain = _mm256_set1_ps(dGain);
+         int i = 0;
+         for (; i + 8 <= n; i += 8)
+         {
+            __m256d p0 = _mm256_add_pd(vPhase, _mm256_mul_pd(vIndex, vInc));
+            __m256d p1 = _mm256_add_pd(vPhase, _mm256_mul_pd(_mm256_add_pd(vIndex, vFour), vInc));
+            _mm256_storeu_ps(pOut + i, _mm256_add_ps(_mm256_loadu_ps(pOut + i), _mm256_mul_ps(vGain, sine_fold_avx2(p0, p1))));
+            vIndex = _mm256_add_pd(vIndex, vEight);
+         }
+         for (; i < n; i++)
+            pOut[i] += dGain * (float)sine_scalar<double>(dPhase + (double)i * dIncrement);
+      }
+
+      // Index and fraction in double, the table and the blend in float
+      SYNTH_TARGET_AVX2 inline void table_add_avx2f(float* pOut, int n, const float* pTable, int nSize, double dPhase, double dIncrement, float dGain)
+      {
+         __m256d vIndex = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+         __m256d vFour = _mm256_set1_pd(4.0), vEight = _mm256_set1_pd(8.0), vOne = _mm256_set1_pd(1.0);
+         __m256d vPhase = _mm256_set1_pd(dPhase), vInc = _mm256_set1_pd(dIncrement);
+         __m256d vSize = _mm256_set1_pd((double)nSize);
+         __m256 vGain = _mm256_set1_ps(dGain);
+         int i = 0;
+         for (; i + 8 <= n; i += 8)
+         {
+            __m256d p[2] = { _mm256_add_pd(vPhase, _mm256_mul_pd(vIndex, vInc)), _mm256_add_pd(vPhase, _mm256_mul_pd(_mm256_add_pd(vIndex, vFour), vInc)) };
+            __m128i k[2];
+            __m128 dFrac[2];
+            for (int h = 0; h < 2; h++)
+            {
+               __m256d f = round_avx2(p[h]);
+               f = _mm256_sub_pd(f, _mm256_and_pd(_mm256_cmp_pd(f, p[h], _CMP_GT_OQ), vOne));
+               __m256d x = _mm256_mul_pd(_mm256_sub_pd(p[h], f), vSize);
+               k[h] = _mm256_cvttpd_epi32(x);
+               dFrac[h] = _mm256_cvtpd_ps(_mm256_sub_pd(x, _mm256_cvtepi32_pd(k[h])));
+            }
+
+            __m256i vK = _mm256_insertf128_si256(_mm256_castsi128_si256(k[0]), k[1], 1);
+            __m256 t0 = _mm256_i32gather_ps(pTable, vK, 4);
+            __m256 t1 = _mm256_i32gather_ps(pTable + 1, vK, 4);
+            __m256 s = _mm256_add_ps(t0, _mm256_mul_ps(_mm256_sub_ps(t1, t0), join_avx2(dFrac[0], dFrac[1])));
+
+            _mm256_storeu_ps(pOut + i, _mm256_add_ps(_mm256_loadu_ps(pOut + i), _mm256_mul_ps(vGain, s)));
+            vIndex = _mm256_add_pd(vIndex, vEight);
+         }
+         if (i < n)
+            table_add_scalar<float>(pOut + i, n - i, pTable, nSize, dPhase + (double)i * dIncrement, dIncrement, dGain);
+      }
+
+      SYNTH_TARGET_AVX2 inline void scale_add_avx2f(float* pOut, const float* pIn, int n, float dGain)
+      {
+         __m256 vGain = _mm256_set1_ps(dGain);
+         int i = 0;
+         for (; i + 8 <= n; i += 8)
+            _mm256_storeu_ps(pOut + i, _mm256_add_ps(_mm256_loadu_ps(pOut + i), _mm256_mul_ps(vGain, _mm256_loadu_ps(pIn + i))));
+         for (; i < n; i++)
+            pOut[i] += dGain * pIn[i];
+      }
+
+      SYNTH_TARGET_AVX2 inline void multiply_avx2f(float* pOut, const float* pIn, int n, float dGain)
+      {
+         __m256 vGain = _mm256_set1_ps(dGain);
+         int i = 0;
+         for (; i + 8 <= n; i += 8)
+            _mm256_storeu_ps(pOut + i, _mm256_mul_ps(_mm256_loadu_ps(pOut + i), _mm256_mul_ps(vGain, _mm256_loadu_ps(pIn + i))));
+         for (; i < n; i++)
+            pOut[i] *= dGain * pIn[i];
+      }
+
+      SYNTH_TARGET_AVX2 inline void ramp_multiply_avx2f(float* pOut, int n, float dStart, float dStep, float dGain)
+      {
+         __m256 vIndex = _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
+         __m256 vEight = _mm256_set1_ps(8.0f);
+         __m256 vStart = _mm256_set1_ps(dStart), vStep = _mm256_set1_ps(dStep), vGain = _mm256_set1_ps(dGain);
+         int i = 0;
+         for (; i + 8 <= n; i += 8)
+         {
+            __m256 a = _mm256_add_ps(vStart, _mm256_mul_ps(vIndex, vStep));
+            _mm256_storeu_ps(pOut + i, _mm256_mul_ps(_mm256_loadu_ps(pOut + i), _mm256_mul_ps(vGain, a)));
+            vIndex = _mm256_add_ps(vIndex, vEight);
+         }
+         for (; i < n; i++)
+            pOut[i] *= dGain * (dStart + (float)i * dStep);
+      }
+
+      SYNTH_TARGET_AVX2 inline float peak_avx2f(const float* pIn, int n)
+      {
+         __m256 sign = _mm256_set1_ps(-0.0f);
+         __m256 vPeak = _mm256_setzero_ps();
+         int i = 0;
+         for (; i + 8 <= n; i += 8)
+            vPeak = _mm256_max_ps(vPeak, _mm256_andnot_ps(sign, _mm256_loadu_ps(pIn + i)));
+         float d[8];
+         _mm256_storeu_ps(d, vPeak);
+         float dPeak = 0.0f;
+         for (int j = 0; j < 8; j++)
+            dPeak = d[j] > dPeak ? d[j] : dPeak;
+         for (; i < n; i++)
+            dPeak = fabs(pIn[i]) > dPeak ? fabs(pIn[i]) : dPeak;
+         return dPeak;
+      }
+
+      SYNTH_TARGET_AVX2 inline void noise_add_avx2f(float* pOut, int n, uint32_t nCounter, uint32_t nKey, float dGain)
+      {
+         __m256i vSpread = spread_avx2(nCounter);
+         __m256i vStep = _mm256_set1_epi32((int)(8 * NOISE_WEYL));
+         __m256i vKey = _mm256_set1_epi32((int)nKey);
+         __m256 vScale = _mm256_set1_ps((float)NOISE_SCALE), vGain = _mm256_set1_ps(dGain);
+         int i = 0;
+         for (; i + 8 <= n; i += 8)
+         {
+            __m256 a = _mm256_mul_ps(vGain, _mm256_mul_ps(_mm256_cvtepi32_ps(hash_avx2(vSpread, vKey)), vScale));
+            _mm256_storeu_ps(pOut + i, _mm256_add_ps(_mm256_loadu_ps(pOut + i), a));
+            vSpread = _mm256_add_epi32(vSpread, vStep);
+         }
+         if (i < n)
+            noise_add_scalar<float>(pOut + i, n - i, nCounter + (uint32_t)i, nKey, dGain);
+      }
+
+      // Output conversion, eight samples at a time
+      SYNTH_TARGET_AVX2 inline __m256 load8_avx2(const double* p)
+      {
+         return join_avx2(_mm256_cvtpd_ps(_mm256_loadu_pd(p)), _mm256_cvtpd_ps(_mm256_loadu_pd(p + 4)));
+      }
+
+      SYNTH_TARGET_AVX2 inline __m256 load8_avx2(const float* p)
+      {
+         return _mm256_loadu_ps(p);
+      }
+
+      SYNTH_TARGET_AVX2 inline __m256i quantise_avx2(__m256 x, __m256 vScale, __m256 vDither, __m256 vLow, __m256 vHigh, __m256i vSpread, __m256i vKey)
+      {
+         __m256i h = hash_avx2(vSpread, vKey);
+         __m256i s = _mm256_add_epi32(_mm256_and_si256(h, _mm256_set1_epi32(0xffff)), _mm256_srli_epi32(h, 16));
+         __m256 tpdf = _mm256_sub_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(s), _mm256_set1_ps(1.0f / 65536.0f)), _mm256_set1_ps(65535.0f / 65536.0f));
+
+         x = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-1.0f)), _mm256_set1_ps(1.0f));
+         x = _mm256_add_ps(_mm256_mul_ps(x, vScale), _mm256_mul_ps(vDither, tpdf));
+         return _mm256_cvtps_epi32(_mm256_min_ps(_mm256_max_ps(x, vLow), vHigh));
+      }
+
+      template<class T>
+      SYNTH_TARGET_AVX2 void to_s16_avx2(int16_t* pOut, const T* pIn, int n, uint32_t nCounter, uint32_t nKey, float fDither)
+      {
+         __m256i vSpread = spread_avx2(nCounter);
+         __m256i vStep = _mm256_set1_epi32((int)(8 * NOISE_WEYL));
+         __m256i vKey = _mm256_set1_epi32((int)nKey);
+         __m256 vScale = _mm256_set1_ps(32767.0f), vDither = _mm256_set1_ps(fDither);
+         __m256 vLow = _mm256_set1_ps(-32768.0f), vHigh = _mm256_set1_ps(32767.0f);
+         int i = 0;
+         for (; i + 8 <= n; i += 8)
+         {
+            __m256i v = quantise_avx2(load8_avx2(pIn + i), vScale, vDither, vLow, vHigh, vSpread, vKey);
+            __m256i p = _mm256_permute4x64_epi64(_mm256_packs_epi32(v, v), _MM_SHUFFLE(3, 1, 2, 0));
+            _mm_storeu_si128((__m128i*)(pOut + i), _mm256_castsi256_si128(p));
+            vSpread = _mm256_add_epi32(vSpread, vStep);
+         }
+         if (i < n)
+            to_s16_scalar<T>(pOut + i, pIn + i, n - i, nCounter + (uint32_t)i, nKey, fDither);
+      }
+
+      template<class T>
+      SYNTH_TARGET_AVX2 void to_s24_avx2(int32_t* pOut, const T* pIn, int n, uint32_t nCounter, uint32_t nKey, float fDither)
+      {
+         __m256i vSpread = spread_avx2(nCounter);
+         __m256i vStep = _mm256_set1_epi32((int)(8 * NOISE_WEYL));
+         __m256i vKey = _mm256_set1_epi32((int)nKey);
+         __m256 vScale = _mm256_set1_ps(8388607.0f), vDither = _mm256_set1_ps(fDither);
+         __m256 vLow = _mm256_set1_ps(-8388608.0f), vHigh = _mm256_set1_ps(8388607.0f);
+         int i = 0;
+         for (; i + 8 <= n; i += 8)
+         {
+            __m256i v = quantise_avx2(load8_avx2(pIn + i), vScale, vDither, vLow, vHigh, vSpread, vKey);
+            _mm256_storeu_si256((__m256i*)(pOut + i), _mm256_slli_epi32(v, 8));
+            vSpread = _mm256_add_epi32(vSpread, vStep);
+         }
+         if (i < n)
+            to_s24_scalar<T>(pOut + i, pIn + i, n - i, nCounter + (uint32_t)i, nKey, fDither);
+      }
+
+      template<class T>
+      SYNTH_TARGET_AVX2 void to_f32_avx2(float* pOut, const T* pIn, int n)
+      {
+         __m256 vLow = _mm256_set1_ps(-1.0f), vHigh = _mm256_set1_ps(1.0f);
+         int i = 0;
+         for (; i + 8 <= n; i += 8)
+            _mm256_storeu_ps(pOut + i, _mm256_min_ps(_mm256_max_ps(load8_avx2(pIn + i), vLow), vHigh));
+         if (i < n)
+            to_f32_scalar<T>(pOut + i, pIn + i, n - i);
+      }
+
+      // The unpacks work within 128 bit lanes, the permutes put the lanes
+      // back in order
+      SYNTH_TARGET_AVX2 inline void interleave_avx2(double* pOut, const double* const* ppIn, int nChannels, int n)
+      {
+         if (nChannels != 2)
+            return interleave_scalar<double>(pOut, ppIn, nChannels, n);
+
+         const double* pL = ppIn[0];
+         const double* pR = ppIn[1];
+         int i = 0;
+         for (; i + 4 <= n; i += 4)
+         {
+            __m256d l = _mm256_loadu_pd(pL + i), r = _mm256_loadu_pd(pR + i);
+            __m256d lo = _mm256_unpacklo_pd(l, r), hi = _mm256_unpackhi_pd(l, r);
+            _mm256_storeu_pd(pOut + 2 * i, _mm256_permute2f128_pd(lo, hi, 0x20));
+            _mm256_storeu_pd(pOut + 2 * i + 4, _mm256_permute2f128_pd(lo, hi, 0x31));
+         }
+         for (; i < n; i++)
+         {
+            pOut[2 * i] = pL[i];
+            pOut[2 * i + 1] = pR[i];
+         }
+      }
+
+      SYNTH_TARGET_AVX2 inline void interleave_avx2f(float* pOut, const float* const* ppIn, int nChannels, int n)
+      {
+         if (nChannels != 2)
+            return interleave_scalar<float>(pOut, ppIn, nChannels, n);
+
+         const float* pL = ppIn[0];
+         const float* pR = ppIn[1];
+         int i = 0;
+         for (; i + 8 <= n; i += 8)
+         {
+            __m256 l = _mm256_loadu_ps(pL + i), r = _mm256_loadu_ps(pR + i);
+            __m256 lo = _mm256_unpacklo_ps(l, r), hi = _mm256_unpackhi_ps(l, r);
+            _mm256_storeu_ps(pOut + 2 * i, _mm256_permute2f128_ps(lo, hi, 0x20));
+            _mm256_storeu_ps(pOut + 2 * i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+         }
+         for (; i < n; i++)
+         {
+            pOut[2 * i] = pL[i];
+            pOut[2 * i + 1] = pR[i];
+         }
+      }
+#endif
+
+      // ------------------------------------------------------------------
+      // Dispatch
+      // ------------------------------------------------------------------
+      template<class T>
+      struct kernels
+      {
+         void(*sine_add)(T*, int, double, double, T);
+         void(*table_add)(T*, int, const T*, int, double, double, T);
+         void(*scale_add)(T*, const T*, int, T);
+         void(*multiply)(T*, const T*, int, T);
+         void(*ramp_multiply)(T*, int, T, T, T);
+         T(*peak)(const T*, int);
+         void(*noise_add)(T*, int, uint32_t, uint32_t, T);
+         void(*to_s16)(int16_t*, const T*, int, uint32_t, uint32_t, float);
+         void(*to_s24)(int32_t*, const T*, int, uint32_t, uint32_t, float);
+         void(*to_f32)(float*, const T*, int);
+         void(*interleave)(T*, const T* const*, int, int);
+         int isa;
+
+         // Scalar for every type, specialisations below add vector paths
+         static kernels select(int nISA)
+         {
+            kernels k;
+            k.sine_add = sine_add_scalar<T>;
+            k.table_add = table_add_scalar<T>;
+            k.scale_add = scale_add_scalar<T>;
+            k.multiply = multiply_scalar<T>;
+            k.ramp_multiply = ramp_multiply_scalar<T>;
+            k.peak = peak_scalar<T>;
+            k.noise_add = noise_add_scalar<T>;
+            k.to_s16 = to_s16_scalar<T>;
+            k.to_s24 = to_s24_scalar<T>;
+            k.to_f32 = to_f32_scalar<T>;
+            k.interleave = interleave_scalar<T>;
+            k.isa = ISA_SCALAR;
+            return k;
+         }
+      };
+
+#if defined(SYNTH_SIMD_X86)
+      template<>
+      inline kernels<double> kernels<double>::select(int nISA)
+      {
+         kernels<double> k;
+         k.sine_add = sine_add_scalar<double>;
+         k.table_add = table_add_scalar<double>;
+         k.scale_add = scale_add_scalar<double>;
+         k.multiply = multiply_scalar<double>;
+         k.ramp_multiply = ramp_multiply_scalar<double>;
+         k.peak = peak_scalar<double>;
+         k.noise_add = noise_add_scalar<double>;
+         k.to_s16 = to_s16_scalar<double>;
+         k.to_s24 = to_s24_scalar<double>;
+         k.to_f32 = to_f32_scalar<double>;
+         k.interleave = interleave_scalar<double>;
+         k.isa = ISA_SCALAR;
+
+         if (nISA >= ISA_SSE2)
+         {
+            k.sine_add = sine_add_sse2;
+            k.table_add = table_add_sse2;
+            k.scale_add = scale_add_sse2;
+            k.multiply = multiply_sse2;
+            k.ramp_multiply = ramp_multiply_sse2;
+            k.peak = peak_sse2;
+            k.noise_add = noise_add_sse2;
+            k.to_s16 = to_s16_sse2<double>;
+            k.to_s24 = to_s24_sse2<double>;
+            k.to_f32 = to_f32_sse2<double>;
+            k.interleave = interleave_sse2;
+            k.isa = ISA_SSE2;
+         }
+
+         if (nISA >= ISA_AVX2)
+         {
+            k.sine_add = sine_add_avx2;
+            k.table_add = table_add_avx2;
+            k.scale_add = scale_add_avx2;
+            k.multiply = multiply_avx2;
+            k.ramp_multiply = ramp_multiply_avx2;
+            k.peak = peak_avx2;
+            k.noise_add = noise_add_avx2;
+            k.to_s16 = to_s16_avx2<double>;
+            k.to_s24 = to_s24_avx2<double>;
+            k.to_f32 = to_f32_avx2<double>;
+            k.interleave = interleave_avx2;
+            k.isa = ISA_AVX2;
+         }
+         return k;
+      }
+
+      // Single precision: twice the lanes of double for the same instructions
+      template<>
+      inline kernels<float> kernels<float>::select(int nISA)
+      {
+         kernels<float> k;
+         k.sine_add = sine_add_scalar<float>;
+         k.table_add = table_add_scalar<float>;
+         k.scale_add = scale_add_scalar<float>;
+         k.multiply = multiply_scalar<float>;
+         k.ramp_multiply = ramp_multiply_scalar<float>;
+         k.peak = peak_scalar<float>;
+         k.noise_add = noise_add_scalar<float>;
+         k.to_s16 = to_s16_scalar<float>;
+         k.to_s24 = to_s24_scalar<float>;
+         k.to_f32 = to_f32_scalar<float>;
+         k.interleave = interleave_scalar<float>;
+         k.isa = ISA_SCALAR;
+
+         if (nISA >= ISA_SSE2)
+         {
+            k.sine_add = sine_add_sse2f;
+            k.scale_add = scale_add_sse2f;
+            k.multiply = multiply_sse2f;
+            k.ramp_multiply = ramp_multiply_sse2f;
+            k.peak = peak_sse2f;
+            k.noise_add = noise_add_sse2f;
+            k.to_s16 = to_s16_sse2<float>;
+            k.to_s24 = to_s24_sse2<float>;
+            k.to_f32 = to_f32_sse2<float>;
+            k.interleave = interleave_sse2f;
+            k.isa = ISA_SSE2;
+         }
+
+         if (nISA >= ISA_AVX2)
+         {
+            k.sine_add = sine_add_avx2f;
+            k.table_add = table_add_avx2f;
+            k.scale_add = scale_add_avx2f;
+            k.multiply = multiply_avx2f;
+            k.ramp_multiply = ramp_multiply_avx2f;
+            k.peak = peak_avx2f;
+            k.noise_add = noise_add_avx2f;
+            k.to_s16 = to_s16_avx2<float>;
+            k.to_s24 = to_s24_avx2<float>;
+            k.to_f32 = to_f32_avx2<float>;
+            k.interleave = interleave_avx2f;
+            k.isa = ISA_AVX2;
+         }
+         return k;
+      }
+#endif
+
+      // Kernels in use. Picked from the CPU on first call, force() overrides.
+      template<class T>
+      inline kernels<T>& active()
+      {
+         static kernels<T> k = kernels<T>::select(detect());
+         return k;
+      }
+
+      template<class T>
+      inline void force(int nISA)
+      {
+         active<T>() = kernels<T>::select(nISA < detect() ? nISA : detect());
+      }
+
+      inline const char* isa_name(int nISA)
+      {
+         return nISA == ISA_AVX2 ? "avx2" : nISA == ISA_SSE2 ? "sse2" : "scalar";
+      }
+
+      // Runs every available vector path against the scalar one on the same
+      // input. Returns the largest absolute difference seen, anything above
+      // dTolerance is reported through nFailures. The output converters and
+      // the interleaver have to agree exactly. Single precision kernels sum in float where the
+      // scalar ones go through double, hence the looser default for float.
+      template<class T>
+      inline double selftest(int& nFailures, T dTolerance = sizeof(T) < sizeof(double) ? (T)2e-6 : (T)1e-9)
+      {
+         const int n = 1027;   // odd, so the scalar tails are exercised too
+         const int nSize = 2048;
+         std::vector<T> table(nSize + 2), in(n), ref(n), out(n);
+         for (int i = 0; i < nSize + 2; i++)
+            table[i] = sine_scalar<T>((T)i / (T)nSize) + (T)0.25 * sine_scalar<T>((T)(3 * i) / (T)nSize);
+         for (int i = 0; i < n; i++)
+            in[i] = sine_scalar<T>((T)i * (T)0.0123) * (T)0.8;
+
+         kernels<T> scalar = kernels<T>::select(ISA_SCALAR);
+         double dWorst = 0.0;
+         nFailures = 0;
+
+         auto compare = [&]()
+         {
+            for (int i = 0; i < n; i++)
+            {
+               double d = fabs((double)ref[i] - (double)out[i]);
+               if (d > dWorst) dWorst = d;
+               if (!(d <= (double)dTolerance)) nFailures++;
+            }
+         };
+
+         for (int nISA = ISA_SSE2; nISA <= detect(); nISA++)
+         {
+            kernels<T> k = kernels<T>::select(nISA);
+            if (k.isa == ISA_SCALAR)
+               break;
+
+            double phases[] = { 0.0, 0.37, -2.25, 1234.5678 };
+            double increments[] = { 440.0 / 44100.0, 0.4999, -0.01, 3.7 };
+            for (double p : phases)
+               for (double inc : increments)
+               {
+                  ref.assign(in.begin(), in.end());
+                  out.assign(in.begin(), in.end());
+                  scalar.sine_add(ref.data(), n, p, inc, (T)0.7);
+                  k.sine_add(out.data(), n, p, inc, (T)0.7);
+                  compare();
+
+                  ref.assign(in.begin(), in.end());
+                  out.assign(in.begin(), in.end());
+                  scalar.table_add(ref.data(), n, table.data(), nSize, p, inc, (T)0.7);
+                  k.table_add(out.data(), n, table.data(), nSize, p, inc, (T)0.7);
+                  compare();
+               }
+
+            ref.assign(in.begin(), in.end());
+            out.assign(in.begin(), in.end());
+            scalar.scale_add(ref.data(), table.data(), n, (T)0.3);
+            k.scale_add(out.data(), table.data(), n, (T)0.3);
+            compare();
+
+            ref.assign(in.begin(), in.end());
+            out.assign(in.begin(), in.end());
+            scalar.multiply(ref.data(), table.data(), n, (T)0.3);
+            k.multiply(out.data(), table.data(), n, (T)0.3);
+            compare();
+
+            ref.assign(in.begin(), in.end());
+            out.assign(in.begin(), in.end());
+            scalar.ramp_multiply(ref.data(), n, (T)0.9, (T)-0.0007, (T)0.3);
+            k.ramp_multiply(out.data(), n, (T)0.9, (T)-0.0007, (T)0.3);
+            compare();
+
+            ref.assign(in.begin(), in.end());
+            out.assign(in.begin(), in.end());
+            scalar.noise_add(ref.data(), n, 0xfffffff0u, 0x1234567u, (T)0.3);
+            k.noise_add(out.data(), n, 0xfffffff0u, 0x1234567u, (T)0.3);
+            compare();
+
+            double d = fabs((double)scalar.peak(in.data(), n) - (double)k.peak(in.data(), n));
+            if (d > dWorst) dWorst = d;
+            if (!(d <= (double)dTolerance)) nFailures++;
+
+            // Driven past full scale so the clipping is exercised
+            std::vector<T> loud(n);
+            for (int i = 0; i < n; i++)
+               loud[i] = in[i] * (T)1.5;
+            for (float fDither : { 0.0f, 1.0f })
+            {
+               std::vector<int16_t> s16a(n), s16b(n);
+               std::vector<int32_t> s24a(n), s24b(n);
+               scalar.to_s16(s16a.data(), loud.data(), n, 0xfffffff0u, 0x1234567u, fDither);
+               k.to_s16(s16b.data(), loud.data(), n, 0xfffffff0u, 0x1234567u, fDither);
+               scalar.to_s24(s24a.data(), loud.data(), n, 0xfffffff0u, 0x1234567u, fDither);
+               k.to_s24(s24b.data(), loud.data(), n, 0xfffffff0u, 0x1234567u, fDither);
+               for (int i = 0; i < n; i++)
+                  if (s16a[i] != s16b[i] || s24a[i] != s24b[i])
+                     nFailures++;
+            }
+
+            std::vector<float> f32a(n), f32b(n);
+            scalar.to_f32(f32a.data(), loud.data(), n);
+            k.to_f32(f32b.data(), loud.data(), n);
+            for (int i = 0; i < n; i++)
+               if (f32a[i] != f32b[i])
+                  nFailures++;
+
+            for (int nChannels = 1; nChannels <= 3; nChannels++)
+            {
+               const T* planes[3] = { in.data(), table.data(), loud.data() };
+               std::vector<T> ia(n * nChannels), ib(n * nChannels);
+               scalar.interleave(ia.data(), planes, nChannels, n);
+               k.interleave(ib.data(), planes, nChannels, n);
+               for (int i = 0; i < n * nChannels; i++)
+                  if (ia[i] != ib[i])
+                     nFailures++;
+            }
+         }
+
+         return dWorst;
+      }
+   }
+}
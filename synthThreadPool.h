@@ -0,0 +1,234 @@
+#pragma once
+
+// Worker pool for splitting a block's voices across cores. The audio thread
+// calls run() with a number of tasks; it and the workers claim them until
+// none are left and run() returns once every task has finished.
+//
+// Each participant starts with its own contiguous share of the task range
+// and claims from it with a fetch_add. When its share is used up it steals
+// from the others the same way, so a slow voice on one core doesn't hold up
+// the block. Nothing is locked or allocated inside run(). Idle workers spin
+// for a short while, then sleep; they only need waking after a quiet spell.
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX   // std::min and std::max, not the macros
+#endif
+#include <Windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace synth
+{
+   class work_pool
+   {
+   public:
+      typedef void(*job)(void* pContext, int nTask, int nWorker);
+
+      // nWorkers threads besides the caller. With bPin each is tied to its
+      // own core, the caller keeping core 0.
+      work_pool(int nWorkers, bool bPin = true) : vecSlots(nWorkers > 0 ? nWorkers + 1 : 1)
+      {
+         nEpoch = 0;
+         nBusy = 0;
+         nSleeping = 0;
+         nDone = 0;
+         nTasks = 0;
+         bQuit = false;
+         funcJob = nullptr;
+         pContext = nullptr;
+
+         for (int i = 0; i < nWorkers; i++)
+         {
+            vecThreads.push_back(std::thread(&work_pool::Worker, this, i + 1));
+            if (bPin)
+               pin(vecThreads.back(), i + 1);
+         }
+      }
+
+      ~work_pool()
+      {
+         {
+            std::unique_lock<std::mutex> lm(muxSleep);
+            bQuit = true;
+            cvSleep.notify_all();
+         }
+         for (auto& t : vecThreads)
+            t.join();
+      }
+
+      // Participants, the caller included
+      int size() const
+      {
+         return (int)vecSlots.size();
+      }
+
+      // Runs f(pContext, task, worker) for every task in [0, nTaskCount).
+      // worker is 0 for the caller and 1..size()-1 for the pool threads, so
+      // it can index per worker scratch space.
+      void run(int nTaskCount, job f, void* pUser)
+      {
+         if (nTaskCount <= 0)
+            return;
+
+         if (vecThreads.empty() || nTaskCount == 1)
+         {
+            for (int t = 0; t < nTaskCount; t++)
+               f(pUser, t, 0);
+            return;
+         }
+
+         // Odd epoch: workers stay out while the task is set up
+         unsigned int e = nEpoch.load(std::memory_order_relaxed);
+         nEpoch.store(e + 1, std::memory_order_seq_cst);
+         while (nBusy.load(std::memory_order_seq_cst) != 0)
+            std::this_thread::yield();
+
+         funcJob = f;
+         pContext = pUser;
+         nTasks = nTaskCount;
+         nDone.store(0, std::memory_order_relaxed);
+         int nParts = size();
+         for (int p = 0; p < nParts; p++)
+         {
+            vecSlots[p].nNext.store(nTaskCount * p / nParts, std::memory_order_relaxed);
+            vecSlots[p].nEnd = nTaskCount * (p + 1) / nParts;
+         }
+
+         nEpoch.store(e + 2, std::memory_order_seq_cst);
+         if (nSleeping.load(std::memory_order_seq_cst) > 0)
+         {
+            std::unique_lock<std::mutex> lm(muxSleep);
+            cvSleep.notify_all();
+         }
+
+         Participate(0);
+
+         while (nDone.load(std::memory_order_acquire) != nTasks)
+            std::this_thread::yield();
+      }
+
+      // Ties a thread to one core, best effort
+      static void pin(std::thread& t, int nCore)
+      {
+         unsigned int nCores = std::thread::hardware_concurrency();
+         if (nCores == 0)
+            return;
+#if defined(_WIN32)
+         SetThreadAffinityMask(t.native_handle(), (DWORD_PTR)1 << (nCore % nCores));
+#elif defined(__linux__)
+         cpu_set_t set;
+         CPU_ZERO(&set);
+         CPU_SET(nCore % nCores, &set);
+         pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+#endif
+      }
+
+   private:
+      // One participant's share of the tasks, padded to its own cache line
+      struct slot
+      {
+         std::atomic<int> nNext;
+         int nEnd;
+         char pad[64 - sizeof(std::atomic<int>) - sizeof(int)];
+
+         slot() : nNext(0), nEnd(0) {}
+      };
+
+      std::vector<slot> vecSlots;
+      std::vector<std::thread> vecThreads;
+
+      std::atomic<unsigned int> nEpoch;    // odd while a run is being set up
+      std::atomic<int> nBusy;              // workers inside Participate()
+      std::atomic<int> nSleeping;
+      std::atomic<int> nDone;
+      int nTasks;
+      job funcJob;
+      void* pContext;
+
+      std::atomic<bool> bQuit;
+      std::mutex muxSleep;
+      std::condition_variable cvSleep;
+
+      // Own share first, then everyone else's
+      void Participate(int nWorker)
+      {
+         int nParts = size();
+         for (int i = 0; i < nParts; i++)
+         {
+            slot& s = vecSlots[(nWorker + i) % nParts];
+            for (;;)
+            {
+               int t = s.nNext.fetch_add(1, std::memory_order_relaxed);
+               if (t >= s.nEnd)
+                  break;
+
+               funcJob(pContext, t, nWorker);
+               nDone.fetch_add(1, std::memory_order_release);
+            }
+         }
+      }
+
+      void Worker(int nWorker)
+      {
+         unsigned int nSeen = 0;
+         for (;;)
+         {
+            // Wait for a new run: spin, then yield, then sleep
+            unsigned int e;
+            auto tIdle = std::chrono::steady_clock::now();
+            for (int nSpins = 0;; nSpins++)
+            {
+               e = nEpoch.load(std::memory_order_seq_cst);
+               if ((e & 1) == 0 && e != nSeen)
+                  break;
+
+               if (bQuit)
+                  return;
+
+               if (nSpins < 64)
+                  continue;
+
+               if (std::chrono::steady_clock::now() - tIdle < std::chrono::milliseconds(20))
+               {
+                  std::this_thread::yield();
+                  continue;
+               }
+
+               nSleeping.fetch_add(1, std::memory_order_seq_cst);
+               {
+                  std::unique_lock<std::mutex> lm(muxSleep);
+                  cvSleep.wait(lm, [&]()
+                  {
+                     unsigned int n = nEpoch.load(std::memory_order_seq_cst);
+                     return bQuit || ((n & 1) == 0 && n != nSeen);
+                  });
+               }
+               nSleeping.fetch_sub(1, std::memory_order_seq_cst);
+               tIdle = std::chrono::steady_clock::now();
+            }
+
+            // Announce ourselves, backing off if a new run started setting up
+            nBusy.fetch_add(1, std::memory_order_seq_cst);
+            if (nEpoch.load(std::memory_order_seq_cst) != e)
+            {
+               nBusy.fetch_sub(1, std::memory_order_seq_cst);
+               continue;
+            }
+
+            nSeen = e;
+            Participate(nWorker);
+            nBusy.fetch_sub(1, std::memory_order_seq_cst);
+         }
+      }
+   };
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+// Note id to frequency. The default scale is 12 tone equal temperament with
+// note 0 at 256Hz, generated at compile time. Other tunings are loaded at
+// run time into the same kind of flat table, so a lookup is always one load.
+
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef FTYPE
+#define FTYPE double
+#endif
+
+namespace synth
+{
+   const int TUNING_LOWEST_NOTE = -128;
+   const int TUNING_NOTES = 384;         // note ids -128 to 255
+   const int TUNING_MIDI_ZERO = 60;      // MIDI note that plays as note id 0, middle C
+
+   // 12-TET table built by the compiler. Semitone ratios are exact to double
+   // precision and octaves are exact powers of two, so there is no drift
+   // across the range the way repeated multiplication or pow() would give.
+   struct equal_tempered_table
+   {
+      FTYPE hertz[TUNING_NOTES];
+
+      constexpr equal_tempered_table() : hertz()
+      {
+         const double ratio[12] =
+         {
+            1.0, 1.0594630943592953, 1.122462048309373, 1.189207115002721,
+            1.2599210498948732, 1.3348398541700344, 1.4142135623730951, 1.4983070768766815,
+            1.5874010519681996, 1.681792830507429, 1.7817974362806785, 1.887748625363387
+         };
+
+         for (int i = 0; i < TUNING_NOTES; i++)
+         {
+            int n = i + TUNING_LOWEST_NOTE;
+            int nOctave = (n >= 0) ? n / 12 : -((11 - n) / 12);
+            double d = 256.0 * ratio[n - nOctave * 12];
+            for (int o = 0; o < nOctave; o++) d *= 2.0;
+            for (int o = 0; o > nOctave; o--) d *= 0.5;
+            hertz[i] = (FTYPE)d;
+         }
+      }
+   };
+
+   constexpr equal_tempered_table TUNING_12TET{};
+
+   const int SCALE_DEFAULT = 0;
+
+   inline FTYPE scale(const int nNoteID, const int nScaleID = SCALE_DEFAULT)
+   {
+      switch (nScaleID)
+      {
+      case SCALE_DEFAULT: default:
+         if (nNoteID >= TUNING_LOWEST_NOTE && nNoteID < TUNING_LOWEST_NOTE + TUNING_NOTES)
+            return TUNING_12TET.hertz[nNoteID - TUNING_LOWEST_NOTE];
+         return 256 * pow(1.0594630943592952645618252949463, nNoteID);
+      }
+   }
+
+   // A run time tuning, one frequency per note id. Defaults to the 12-TET
+   // table, can be rebuilt from any equal division or a Scala .scl file and
+   // pinned to a reference pitch.
+   class tuning
+   {
+   public:
+      tuning()
+      {
+         vHertz.assign(TUNING_12TET.hertz, TUNING_12TET.hertz + TUNING_NOTES);
+      }
+
+      FTYPE hertz(int nNote) const
+      {
+         int i = nNote - TUNING_LOWEST_NOTE;
+         if (i < 0) i = 0;
+         if (i >= TUNING_NOTES) i = TUNING_NOTES - 1;
+         return vHertz[i];
+      }
+
+      // nSteps equal divisions of dPeriod (2.0 is an octave)
+      void equal(int nSteps, FTYPE dPeriod = 2.0, FTYPE dReferenceHertz = 256.0, int nReferenceNote = 0)
+      {
+         std::vector<double> vDegrees;
+         for (int k = 1; k <= nSteps; k++)
+            vDegrees.push_back(pow((double)dPeriod, (double)k / (double)nSteps));
+         build(vDegrees, dReferenceHertz, nReferenceNote);
+      }
+
+      // Loads a Scala scale file. Each degree is in cents if it has a decimal
+      // point, otherwise a ratio such as 3/2. The last degree is the period.
+      bool load_scala(const std::string& sFile, FTYPE dReferenceHertz = 256.0, int nReferenceNote = 0)
+      {
+         std::ifstream f(sFile);
+         if (!f.is_open())
+            return false;
+
+         std::vector<double> vDegrees;
+         std::string sLine;
+         int nLine = 0, nCount = 0;
+         while (getline(f, sLine))
+         {
+            if (!sLine.empty() && sLine[0] == '!')
+               continue;
+
+            if (nLine++ == 0)   // description
+               continue;
+
+            std::istringstream ss(sLine);
+            std::string sToken;
+            ss >> sToken;
+
+            if (nLine == 2)
+            {
+               nCount = atoi(sToken.c_str());
+               continue;
+            }
+
+            if (sToken.empty())
+               continue;
+
+            double dRatio;
+            if (sToken.find('.') != std::string::npos)
+               dRatio = pow(2.0, atof(sToken.c_str()) / 1200.0);
+            else
+            {
+               size_t nSlash = sToken.find('/');
+               double dNum = atof(sToken.substr(0, nSlash).c_str());
+               double dDen = nSlash == std::string::npos ? 1.0 : atof(sToken.substr(nSlash + 1).c_str());
+               if (dDen == 0.0) return false;
+               dRatio = dNum / dDen;
+            }
+
+            if (dRatio <= 0.0) return false;
+            vDegrees.push_back(dRatio);
+            if ((int)vDegrees.size() == nCount)
+               break;
+         }
+
+         if (nCount <= 0 || (int)vDegrees.size() != nCount)
+            return false;
+
+         build(vDegrees, dReferenceHertz, nReferenceNote);
+         return true;
+      }
+
+      // Rescales the whole table so nNote sounds at dHertz
+      void set_reference(FTYPE dHertz, int nNote)
+      {
+         FTYPE dRatio = dHertz / hertz(nNote);
+         for (auto& h : vHertz)
+            h *= dRatio;
+      }
+
+      static const tuning& standard()
+      {
+         static tuning t;
+         return t;
+      }
+
+   private:
+      // vDegrees holds the ratios of steps 1..N above the reference, N being
+      // the period
+      void build(const std::vector<double>& vDegrees, FTYPE dReferenceHertz, int nReferenceNote)
+      {
+         int nSteps = (int)vDegrees.size();
+         double dPeriod = vDegrees.back();
+         for (int i = 0; i < TUNING_NOTES; i++)
+         {
+            int d = i + TUNING_LOWEST_NOTE - nReferenceNote;
+            int nPeriods = (d >= 0) ? d / nSteps : -((nSteps - 1 - d) / nSteps);
+            int k = d - nPeriods * nSteps;
+            double dRatio = (k == 0 ? 1.0 : vDegrees[k - 1]) * pow(dPeriod, (double)nPeriods);
+            vHertz[i] = (FTYPE)(dReferenceHertz * dRatio);
+         }
+      }
+
+      std::vector<FTYPE> vHertz;
+   };
+}
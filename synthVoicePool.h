@@ -0,0 +1,214 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "synthEnvelope.h"
+#include "synthNoise.h"
+
+namespace synth
+{
+   struct instrument_base;
+
+   const int VOICE_HELD = 0;       // key still down
+   const int VOICE_RELEASED = 1;   // key up, instrument releasing
+
+   const int VOICE_LAYERS = 4;     // oscillator layers with their own phase per voice
+
+   const int STEAL_OLDEST = 0;
+   const int STEAL_QUIETEST = 1;
+
+   // Fixed capacity voice storage. Every field lives in its own contiguous
+   // array indexed by voice number, nothing is allocated once constructed.
+   // Free voices sit on a stack, sounding voices in a dense list so the
+   // renderer only ever walks what is playing.
+   struct voice_pool
+   {
+      voice_pool(int nMaxVoices = 256, int nPolicy = STEAL_OLDEST)
+      {
+         nCapacity = nMaxVoices;
+         nStealPolicy = nPolicy;
+         nActive = 0;
+         nFree = nMaxVoices;
+         nStolen = 0;
+         nNoiseSeed = 0;
+         nStarted = 0;
+
+         vId.assign(nCapacity, 0);
+         vOn.assign(nCapacity, 0.0);
+         vOff.assign(nCapacity, 0.0);
+         vChannel.assign(nCapacity, nullptr);
+         vState.assign(nCapacity, VOICE_HELD);
+         vLevel.assign(nCapacity, 0.0);
+         vVelocity.assign(nCapacity, 1.0);
+         vPan.assign(nCapacity, 0.0);
+         vStart.assign(nCapacity, 0);
+         vCursor.assign(nCapacity, 0);
+         vTake.assign(nCapacity, -1);
+         vFinished.assign(nCapacity, false);
+         vEnv.assign(nCapacity, envelope_state());
+         vNoise.assign(nCapacity, noise_state());
+         vSlot.assign(nCapacity, -1);
+         vActiveList.assign(nCapacity, 0);
+         vFreeList.assign(nCapacity, 0);
+         for (int l = 0; l < VOICE_LAYERS; l++)
+         {
+            vPhase[l].assign(nCapacity, 0.0);
+            vLFOPhase[l].assign(nCapacity, 0.0);
+            vHertz[l].assign(nCapacity, 0.0);
+         }
+
+         // Hand out low voice numbers first
+         for (int i = 0; i < nCapacity; i++)
+            vFreeList[i] = nCapacity - 1 - i;
+      }
+
+      // Claims a voice, stealing one if the pool is full. Never fails.
+      int Allocate(instrument_base* channel, int id, FTYPE dTimeOn, uint64_t nSample)
+      {
+         int v;
+         if (nFree > 0)
+            v = vFreeList[--nFree];
+         else
+         {
+            v = Victim();
+            Unlink(v);
+            nStolen++;
+         }
+
+         vId[v] = id;
+         vOff[v] = 0.0;
+         vChannel[v] = channel;
+         vLevel[v] = 1.0;
+         vVelocity[v] = 1.0;
+         vPan[v] = 0.0;
+         vFinished[v] = false;
+         vEnv[v] = envelope_state();
+         vNoise[v] = noise_state();
+         Retrigger(v, dTimeOn, nSample);
+
+         vSlot[v] = nActive;
+         vActiveList[nActive++] = v;
+         return v;
+      }
+
+      // Restarts a sounding voice from the top. The envelope keeps its level
+      // and is restarted by the instrument, so a retrigger doesn't click.
+      // Every hit draws a noise stream of its own, as a new voice would; the
+      // noise filters keep their state.
+      void Retrigger(int v, FTYPE dTimeOn, uint64_t nSample)
+      {
+         noise_state s = noise_seed(nNoiseSeed, nStarted++);
+         vNoise[v].nKey = s.nKey;
+         vNoise[v].nCounter = s.nCounter;
+
+         vOn[v] = dTimeOn;
+         vState[v] = VOICE_HELD;
+         vStart[v] = nSample;
+         vCursor[v] = 0;
+         vTake[v] = -1;
+         for (int l = 0; l < VOICE_LAYERS; l++)
+         {
+            vPhase[l][v] = 0.0;
+            vLFOPhase[l][v] = 0.0;
+         }
+      }
+
+      // Restarts the noise streams. Voices started after this draw the same
+      // noise for the same seed and the same sequence of notes.
+      void Seed(uint64_t nSeed)
+      {
+         nNoiseSeed = nSeed;
+         nStarted = 0;
+      }
+
+      // Returns a voice to the free stack
+      void Release(int v)
+      {
+         Unlink(v);
+         vFreeList[nFree++] = v;
+      }
+
+      // Frees every voice the renderer flagged as finished
+      void Collect()
+      {
+         for (int i = nActive - 1; i >= 0; i--)
+            if (vFinished[vActiveList[i]])
+               Release(vActiveList[i]);
+      }
+
+      // Sounding voice playing note id on channel in the given state, or -1
+      int Find(instrument_base* channel, int id, int nState) const
+      {
+         for (int i = 0; i < nActive; i++)
+         {
+            int v = vActiveList[i];
+            if (vId[v] == id && vChannel[v] == channel && vState[v] == nState && !vFinished[v])
+               return v;
+         }
+         return -1;
+      }
+
+      // Picks the voice to steal. Released voices go before held ones,
+      // then the policy decides between the oldest and the quietest.
+      int Victim() const
+      {
+         int nBest = vActiveList[0];
+         for (int i = 1; i < nActive; i++)
+         {
+            int v = vActiveList[i];
+            if (vState[v] != vState[nBest])
+            {
+               if (vState[v] == VOICE_RELEASED) nBest = v;
+               continue;
+            }
+
+            if (nStealPolicy == STEAL_QUIETEST ? vLevel[v] < vLevel[nBest] : vStart[v] < vStart[nBest])
+               nBest = v;
+         }
+         return nBest;
+      }
+
+      // Per voice fields
+      std::vector<int> vId;
+      std::vector<FTYPE> vOn;
+      std::vector<FTYPE> vOff;
+      std::vector<instrument_base*> vChannel;
+      std::vector<int> vState;
+      std::vector<FTYPE> vLevel;      // last output level, for STEAL_QUIETEST
+      std::vector<FTYPE> vVelocity;   // note on velocity as a gain, 0..1
+      std::vector<FTYPE> vPan;        // -1 left .. 1 right, see pan_gains()
+      std::vector<uint64_t> vStart;   // sample the voice started on, for STEAL_OLDEST
+      std::vector<int> vCursor;       // frames rendered since note on, the play position in a one-shot
+      std::vector<int> vTake;         // one-shot take the note plays, -1 if it is synthesised
+      std::vector<char> vFinished;
+      std::vector<envelope_state> vEnv;
+      std::vector<noise_state> vNoise;
+      std::vector<FTYPE> vPhase[VOICE_LAYERS];      // oscillator phase in cycles
+      std::vector<FTYPE> vLFOPhase[VOICE_LAYERS];
+      std::vector<FTYPE> vHertz[VOICE_LAYERS];      // layer pitch, resolved on note on
+
+      // Book keeping
+      std::vector<int> vActiveList;
+      std::vector<int> vFreeList;
+      std::vector<int> vSlot;         // position of each voice in vActiveList
+
+      int nCapacity;
+      int nStealPolicy;
+      int nActive;
+      int nFree;
+      int nStolen;
+      uint64_t nNoiseSeed;
+      uint64_t nStarted;              // voices allocated since Seed(), picks the noise stream
+
+   private:
+      // Swap removes a voice from the active list
+      void Unlink(int v)
+      {
+         int nLast = vActiveList[--nActive];
+         vActiveList[vSlot[v]] = nLast;
+         vSlot[nLast] = vSlot[v];
+         vSlot[v] = -1;
+      }
+   };
+}